@@ -0,0 +1,573 @@
+/*
+ * File:   Nova.Abi.h
+ * Author: jools
+ *
+ * Plain C entry points for callers that cannot use the JNI glue, such as
+ * Java 21 Foreign Function & Memory downcalls or jextract generated bindings.
+ *
+ * Only pointers, lengths and caller allocated buffers cross this boundary.
+ * Output buffers follow one convention: on entry *length holds the capacity
+ * of the buffer, on return it holds the length of the value excluding the
+ * terminating NUL. If the capacity is too small NOVA_ERROR_BUFFER_SIZE is
+ * returned and *length tells the caller how much to allocate (minus one).
+ */
+
+#ifndef NOVA_ABI_H
+#define NOVA_ABI_H
+
+#include <stddef.h>
+
+/* bump on any incompatible change to the signatures below */
+#define NOVA_ABI_VERSION            1
+
+#define NOVA_OK                     0
+#define NOVA_FAILED                 1
+#define NOVA_ERROR_ARGUMENT         2
+#define NOVA_ERROR_BUFFER_SIZE      3
+#define NOVA_PENDING                4
+#define NOVA_ERROR_TICKET           5
+#define NOVA_ERROR_SYSTEM           6
+
+/* nova_trace_start flag: record license bytes, not just their hash */
+#define NOVA_TRACE_LICENSE_DATA     1
+
+/* what a forked child rebuilds, see nova_fork_mode */
+#define NOVA_FORK_REBUILD_UNSHARED  0
+#define NOVA_FORK_REBUILD_ALL       1
+
+/* opaque handle of a count-block lease manager */
+typedef struct nova_lease nova_lease;
+
+/* opaque handle of a pipelined capability exchange */
+typedef struct nova_exchange nova_exchange;
+
+/* opaque description of a capability request */
+typedef struct nova_request nova_request;
+
+/* opaque handle of a usage aggregator */
+typedef struct nova_usage nova_usage;
+
+/* opaque handle of a license validity oracle */
+typedef struct nova_validity nova_validity;
+
+/* opaque handle of a columnar feature table */
+typedef struct nova_table nova_table;
+
+/* feature flags of a table row */
+#define NOVA_FEATURE_METERED        0x01
+#define NOVA_FEATURE_REUSABLE       0x02
+#define NOVA_FEATURE_SERVED         0x04
+#define NOVA_FEATURE_UNCOUNTED      0x08
+#define NOVA_FEATURE_PERPETUAL      0x10
+
+/*
+ * Rows with start <= at, expires_from <= expiration <= expires_to and
+ * (flags & flags_mask) == flags_value. Dates are seconds since the epoch of
+ * UTC midnight; no start date is LLONG_MIN and perpetual is LLONG_MAX.
+ */
+typedef struct nova_table_query
+{
+    long long at;
+    long long expires_from;
+    long long expires_to;
+    unsigned int flags_mask;
+    unsigned int flags_value;
+} nova_table_query;
+
+/* one row; name and version stay valid until the table is closed */
+typedef struct nova_table_row
+{
+    const char*name;
+    const char*version;
+    unsigned int name_id;
+    long long start;
+    long long expiration;
+    int count;
+    unsigned int flags;
+} nova_table_row;
+
+/* opaque handle of a vendor dictionary snapshot */
+typedef struct nova_dictionary nova_dictionary;
+
+/* which vendor dictionary of an exchange, see nova_exchange_dictionary */
+#define NOVA_DICTIONARY_STORAGE     0
+#define NOVA_DICTIONARY_RESPONSE    1
+
+/* value types, as FlcDictionaryValueType */
+#define NOVA_VALUE_STRING           1
+#define NOVA_VALUE_INT              2
+
+/*
+ * One dictionary value. string points into the snapshot, NUL terminated,
+ * and stays valid until the snapshot is released
+ */
+typedef struct nova_value
+{
+    int type;
+    int integer;
+    const char*string;
+    size_t length;
+} nova_value;
+
+/* opaque handle of a short code service */
+typedef struct nova_shortcode nova_shortcode;
+
+/* response decodings, as FlcShortCodeEncoding */
+#define NOVA_SHORTCODE_BASE10       2
+#define NOVA_SHORTCODE_BASE16       3
+#define NOVA_SHORTCODE_BASE34       4
+#define NOVA_SHORTCODE_BASE36       5
+
+/* outcome of one response code of a batch */
+typedef struct nova_shortcode_result
+{
+    int result;
+    int template_id;
+    int error_code;
+    char message[256];
+} nova_shortcode_result;
+
+#if defined( __cplusplus )
+extern "C"
+{
+#endif
+
+    int nova_abi_version(void);
+
+    /*!
+     * Equivalent of Nova.process(); lic is an optional license file path
+     */
+    int nova_process(const char*lic, size_t lic_length,
+                     char*out_identity, size_t*identity_length,
+                     char*out_message, size_t*message_length);
+
+    /*!
+     * As nova_process, with the license file contents at data rather than
+     * a path, handed to the SDK without a copy
+     */
+    int nova_process_data(const void*data, size_t size,
+                          char*out_identity, size_t*identity_length,
+                          char*out_message, size_t*message_length);
+
+    /*!
+     * FNE error code and system code of the calling thread's last process
+     * call, or of the last ticket it collected with nova_poll/nova_await;
+     * NOVA_FAILED if it had an error
+     */
+    int nova_last_error(int*code, int*system_code);
+
+    /*!
+     * Description of that error, formatted now; empty if there was none
+     */
+    int nova_last_error_message(char*out_message, size_t*message_length);
+
+    /*!
+     * Its status collection, "<code> <type> <description>: <details>" a line
+     */
+    int nova_last_error_status(char*out_status, size_t*status_length);
+
+    /*!
+     * Turn per stage hardware counter profiling on (1) or off (0); returns
+     * the previous setting. Stages are timed even where perf_event_open is
+     * refused.
+     */
+    int nova_profile_enable(int enable);
+
+    int nova_profile_reset(void);
+
+    /*!
+     * A line per stage: calls, ns/call, IPC and misses per 1000 instructions
+     */
+    int nova_profile_report(char*out_report, size_t*report_length);
+
+    /*!
+     * Record every process call to a trace file (layout in Nova.Trace.h)
+     * for replay/Nova.Replay.cpp, created 0600. Licenses are recorded by
+     * path or hash; NOVA_TRACE_LICENSE_DATA also records the bytes of
+     * licenses passed as data. Setting NOVA_TRACE=<file> (and
+     * NOVA_TRACE_DATA=1) does the same from library load.
+     */
+    int nova_trace_start(const char*file, size_t file_length, int flags);
+
+    /*!
+     * Flush all threads' records and close the trace file
+     */
+    int nova_trace_stop(void);
+
+    int nova_test_tra(char*out, size_t*out_length);
+
+    /*!
+     * Randomized TDT programs on threads threads (0 for one per CPU) against
+     * shared, pooled and per-thread states; NOVA_FAILED on any corruption
+     */
+    int nova_test_tra_stress(int threads, char*out, size_t*out_length);
+
+    /*!
+     * Calls per second through run_process and nova_process, to set against
+     * the same calls made through FFM and JNI from Java
+     */
+    int nova_test_calls(char*out, size_t*out_length);
+
+    int nova_test_fne(const char*lic, size_t lic_length, char*out, size_t*out_length);
+
+    /*!
+     * Queue nova_process on the native worker pool and return at once
+     */
+    int nova_submit(const char*lic, size_t lic_length, unsigned long long*ticket);
+
+    /*!
+     * Never blocks; NOVA_PENDING until the ticket completes, after which the
+     * result is returned exactly as nova_process would and the ticket is
+     * released (unless NOVA_ERROR_BUFFER_SIZE asks for a retry)
+     */
+    int nova_poll(unsigned long long ticket,
+                  char*out_identity, size_t*identity_length,
+                  char*out_message, size_t*message_length);
+
+    /*!
+     * As nova_poll but blocks up to timeout_ms (-1 forever) for completion;
+     * for platform threads only, a virtual thread should select on the fd
+     */
+    int nova_await(unsigned long long ticket, int timeout_ms,
+                   char*out_identity, size_t*identity_length,
+                   char*out_message, size_t*message_length);
+
+    /*!
+     * Non-blocking eventfd signalled whenever a ticket completes, or -1.
+     * The reader drains the counter and then polls its outstanding tickets
+     */
+    int nova_event_fd(void);
+
+    /*!
+     * Load the TRA states up front so pre-forked children inherit them
+     */
+    int nova_prewarm(void);
+
+    /*!
+     * NOVA_FORK_REBUILD_UNSHARED (default) keeps the parent's TRA states in
+     * the child, copy-on-write, and only drops licensing environments whose
+     * SDK threads did not survive the fork. NOVA_FORK_REBUILD_ALL also drops
+     * the TRA states so the child reloads them. Returns the previous mode.
+     * fork() must not be called from inside a native call.
+     */
+    int nova_fork_mode(int mode);
+
+    /*!
+     * Parse every .lic file in a directory and list its features, one
+     * "path: name - version" or "path: error: ..." line each
+     */
+    int nova_audit_directory(const char*dir, size_t dir_length, char*out, size_t*out_length);
+
+    /*!
+     * Lease manager for a counted feature of the license file (or directory)
+     * lic, acquiring up to block counts per FlcAcquireLicenses call. block
+     * is at most INT_MAX / 64; NOVA_ERROR_SYSTEM if its index space cannot
+     * be allocated.
+     */
+    int nova_lease_open(const char*lic, size_t lic_length,
+                        const char*feature, const char*version,
+                        unsigned int block, nova_lease**lease);
+
+    /*!
+     * One count for one job; *count identifies it for nova_lease_release.
+     * NOVA_FAILED when the SDK would not grant even a single count.
+     */
+    int nova_lease_acquire(nova_lease*lease, unsigned int*count);
+
+    /*!
+     * Hand a count back to the free lists, each count exactly once
+     */
+    int nova_lease_release(nova_lease*lease, unsigned int count);
+
+    /*!
+     * Return every wholly unused block to the SDK, e.g. from an idle timer;
+     * gives the number of counts returned
+     */
+    int nova_lease_trim(nova_lease*lease);
+
+    /*!
+     * Return all blocks and free the manager
+     */
+    int nova_lease_close(nova_lease*lease);
+
+    /*!
+     * Validity oracle for feature and version of the license file (or
+     * directory) lic. Fails only if the license cannot be loaded at all.
+     */
+    int nova_validity_open(const char*lic, size_t lic_length,
+                           const char*feature, const char*version,
+                           nova_validity**validity);
+
+    /*!
+     * NOVA_OK while the license would be granted, else NOVA_FAILED. Answered
+     * from one clock read until the earliest start, expiry, grace period end
+     * or server update due over all features, or until the wall clock is
+     * wound back; only then is the license acquired again.
+     */
+    int nova_validity_check(nova_validity*validity);
+
+    /*!
+     * Acquire again now, e.g. after adding a license or processing a response
+     */
+    int nova_validity_recheck(nova_validity*validity);
+
+    /*!
+     * Seconds until nova_validity_check next asks the SDK
+     */
+    int nova_validity_seconds(nova_validity*validity);
+
+    /*!
+     * SDK error of the last recheck that found the license invalid
+     */
+    int nova_validity_message(nova_validity*validity, char*out_message, size_t*message_length);
+
+    int nova_validity_close(nova_validity*validity);
+
+    /*!
+     * Columnar table of every feature of the license file (or directory) lic,
+     * read once; reopen it after the license changes
+     */
+    int nova_table_open(const char*lic, size_t lic_length, nova_table**table);
+
+    int nova_table_rows(const nova_table*table, size_t*rows);
+
+    /*!
+     * Indices of the rows matching query, in row order. On entry *count is
+     * the capacity of out_rows, on return the number of matches, with
+     * NOVA_ERROR_BUFFER_SIZE if they did not all fit.
+     */
+    int nova_table_select(const nova_table*table, const nova_table_query*query,
+                          unsigned int*out_rows, size_t*count);
+
+    int nova_table_get(const nova_table*table, unsigned int index, nova_table_row*row);
+
+    int nova_table_close(nova_table*table);
+
+    /*!
+     * Short code service over the templates in the file or directory
+     * templates, parsed once into each of workers (1 to 32) environments.
+     * encoding, characters and segment_size are as for
+     * FlcShortCodeSetResponseDecoding; characters may be NULL. The workers
+     * do not survive fork, open services in the child instead.
+     */
+    int nova_shortcode_open(const char*templates, size_t templates_length,
+                            int encoding, const char*characters, size_t segment_size,
+                            unsigned int workers, nova_shortcode**service);
+
+    /*!
+     * Process count response codes, results[i] for codes[i]. NOVA_FAILED if
+     * any of them failed. Batches of one service run one at a time.
+     */
+    int nova_shortcode_process(nova_shortcode*service, const char*const*codes, size_t count,
+                               nova_shortcode_result*results);
+
+    int nova_shortcode_close(nova_shortcode*service);
+
+    /*!
+     * Capability exchange with server (URL) for a licensing environment
+     * holding the license file or directory lic, which may be empty.
+     * depth worker threads keep up to depth requests in flight.
+     */
+    int nova_exchange_open(const char*lic, size_t lic_length,
+                           const char*server, unsigned int depth,
+                           nova_exchange**exchange);
+
+    /*!
+     * Save every response received from now on into dir as <ticket>.bin,
+     * for the stand-in server to replay; an empty dir stops recording
+     */
+    int nova_exchange_record(nova_exchange*exchange, const char*dir, size_t dir_length);
+
+    /*!
+     * Generate a capability request, optionally desiring count of feature,
+     * and queue it. Responses are processed in ticket order.
+     */
+    int nova_exchange_submit(nova_exchange*exchange,
+                             const char*feature, const char*version, int count,
+                             unsigned long long*ticket);
+
+    /*!
+     * Capability request built item by item. Requests without a correlation
+     * ID are signed once and reused by an exchange for as long as the
+     * sorted items, the default host ID and trusted storage are unchanged.
+     */
+    int nova_request_create(nova_request**request);
+
+    int nova_request_add_feature(nova_request*request, const char*feature, const char*version, int count);
+
+    int nova_request_add_rights_id(nova_request*request, const char*rights_id, int count);
+
+    int nova_request_add_dictionary_string(nova_request*request, const char*key, const char*value);
+
+    int nova_request_add_dictionary_int(nova_request*request, const char*key, int value);
+
+    /*!
+     * Auxiliary host ID, type is an FlcHostIdType
+     */
+    int nova_request_add_host_id(nova_request*request, int type, const char*id);
+
+    /*!
+     * An FlcCapabilityRequestOperation value
+     */
+    int nova_request_set_operation(nova_request*request, int operation);
+
+    /*!
+     * Fixed correlation ID, or NULL for a new one generated on every submit;
+     * either way the request bypasses the cache
+     */
+    int nova_request_set_correlation_id(nova_request*request, const char*correlation_id);
+
+    /*!
+     * License server instance (FlcLicenseServerInstance) the request is for
+     */
+    int nova_request_set_server_instance(nova_request*request, int instance);
+
+    int nova_request_delete(nova_request*request);
+
+    /*!
+     * As nova_exchange_submit for a request built above, which the caller
+     * may reuse or delete as soon as this returns
+     */
+    int nova_exchange_submit_request(nova_exchange*exchange, const nova_request*request,
+                                     unsigned long long*ticket);
+
+    /*!
+     * As nova_await, for a ticket of nova_exchange_submit; message holds the
+     * SDK error when the exchange failed or the response was not applied
+     */
+    int nova_exchange_wait(nova_exchange*exchange, unsigned long long ticket, int timeout_ms,
+                           char*out_message, size_t*message_length);
+
+    /*!
+     * Stop the workers and free the exchange; nothing may be waiting on it
+     */
+    int nova_exchange_close(nova_exchange*exchange);
+
+    /*!
+     * Keep the exchange refreshed with request in the background, at the
+     * next update time trusted storage reports for the request's server
+     * instance, else at the renew interval of the last response, else every
+     * fallback_seconds. Due times are brought forward at random by up to a
+     * tenth of the interval and failures back off with jitter. *id is for
+     * nova_refresh_remove; closing the exchange removes its refreshes.
+     */
+    int nova_refresh_add(nova_exchange*exchange, const nova_request*request,
+                         int fallback_seconds, unsigned long long*id);
+
+    int nova_refresh_remove(unsigned long long id);
+
+    /*!
+     * Most refreshes in flight at once across all exchanges, 4 by default
+     */
+    int nova_refresh_limit(int concurrent);
+
+    /*!
+     * Snapshot of the trusted storage vendor dictionary (for the default
+     * server instance) or of the vendor dictionary of the last response the
+     * exchange processed, empty if there is none. Snapshots are rebuilt only
+     * when a response is processed, so taking one is normally just a
+     * reference count. Release each with nova_dictionary_release.
+     */
+    int nova_exchange_dictionary(nova_exchange*exchange, int source, nova_dictionary**dictionary);
+
+    /*!
+     * NOVA_FAILED if key is not in the snapshot; no copying either way
+     */
+    int nova_dictionary_get(const nova_dictionary*dictionary, const char*key, size_t key_length,
+                            nova_value*value);
+
+    /*!
+     * The snapshot as one read-only image, valid until it is released, for
+     * lookups without a call per key (e.g. from a MemorySegment). Native
+     * byte order, all offsets from the start of the image:
+     *
+     *   uint32 capacity, a power of two; uint32 count
+     *   capacity slots of 32 bytes: uint64 hash, uint32 key offset,
+     *   uint32 key length, int32 type (0 empty), int32 integer value,
+     *   uint32 string offset, uint32 string length
+     *   keys and string values, each NUL terminated
+     *
+     * The hash is 64 bit FNV-1a of the key bytes; probing is linear from
+     * slot hash & (capacity - 1) up to the first empty slot.
+     */
+    int nova_dictionary_image(const nova_dictionary*dictionary, const void**data, size_t*size);
+
+    int nova_dictionary_release(nova_dictionary*dictionary);
+
+    /*!
+     * Usage aggregator reporting metered usage through exchange with operation
+     * FLC_CAPABILITY_REQUEST_OPERATION_REPORT or _REQUEST. Events are summed
+     * and sent as one request every flush_ms, or once flush_events are
+     * waiting. With a spool directory each batch is synced to disk before it
+     * is sent and batches left by an earlier process are sent on open.
+     * Close it before its exchange.
+     */
+    int nova_usage_open(nova_exchange*exchange, int operation,
+                        const char*spool, size_t spool_length,
+                        unsigned int flush_events, int flush_ms,
+                        nova_usage**usage);
+
+    /*!
+     * Count usage of a feature (negative to return reusable metered counts);
+     * *token, if given, identifies the event for nova_usage_undo
+     */
+    int nova_usage_record(nova_usage*usage, const char*feature, const char*version, int count,
+                          unsigned long long*token);
+
+    /*!
+     * Undo a recorded event. Before its batch is flushed this is local;
+     * after, its batch is undone at the back office while the feature's undo
+     * interval lasts and the rest of the batch is reported again. NOVA_PENDING
+     * while the batch is in flight, NOVA_FAILED once the interval is over.
+     */
+    int nova_usage_undo(nova_usage*usage, unsigned long long token,
+                        const char*feature, const char*version, int count);
+
+    /*!
+     * Flush now rather than at the end of the window
+     */
+    int nova_usage_flush(nova_usage*usage);
+
+    /*!
+     * Flush, wait a while for batches in flight and free the aggregator;
+     * anything not accepted stays in the spool
+     */
+    int nova_usage_close(nova_usage*usage);
+
+    /*!
+     * Probe the host identity again now, as a network link change would.
+     * Licensing environments otherwise reuse the identity cached by the
+     * first one created.
+     */
+    int nova_host_refresh(void);
+
+    /*!
+     * Cached host IDs as "<FlcHostIdType> <value>" lines, the default first
+     */
+    int nova_host_ids(char*out, size_t*out_length);
+
+    /*!
+     * Cached FlcMachineType, whether containerized (0/1) and any virtual
+     * machine information as "key=value" lines
+     */
+    int nova_host_machine(int*machine_type, int*containerized,
+                          char*out_vm_info, size_t*vm_info_length);
+
+    /*!
+     * Loopback HTTP stand-in for the back office, answering each request
+     * with the next .bin response in dir after delay_ms. port 0 picks a
+     * free port, returned in *bound_port.
+     */
+    int nova_standin_start(const char*dir, size_t dir_length, int port, int delay_ms, int*bound_port);
+
+    /*!
+     * Stop the stand-in; *served, if not NULL, gets the number of responses
+     * it served. NOVA_ERROR_ARGUMENT if it was not running.
+     */
+    int nova_standin_stop(unsigned int*served);
+
+#if defined( __cplusplus )
+}
+#endif
+
+#endif /* NOVA_ABI_H */
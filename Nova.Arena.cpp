@@ -0,0 +1,152 @@
+/*
+ * File:   Nova.Arena.cpp
+ * Author: jools
+ *
+ * Per thread bump arena for the scratch memory of one native call.
+ *
+ * The strings a Nova.process() call builds along the way, the error text,
+ * the feature name and version and the identity, all die with the call,
+ * yet each one went through malloc, and with many JVM threads calling in
+ * that is where the time went. Here they come out of a per thread arena
+ * instead, which the outermost TraScope rewinds when the call returns. The
+ * arena keeps its chunks, so once a thread has seen its largest call the
+ * next ones never reach the heap; arena_heap_allocations counts the times
+ * it had to, and heapcheck/ checks that nothing else in the call does.
+ */
+
+#include "Nova.Internal.h"
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstdlib>
+#include <new>
+
+#include "Nova.h"
+#include "Nova.Abi.h"
+
+using namespace std;
+
+// size of a regular chunk; larger requests get a chunk of their own
+static const size_t ARENA_CHUNK = 16384;
+
+// every allocation is aligned to this
+static const size_t ARENA_ALIGN = 16;
+
+class CArena
+{
+    struct Chunk
+    {
+        char*memory;
+        size_t size;
+    };
+
+    vector<Chunk> m_chunks;
+    size_t m_current;
+    size_t m_offset;
+    size_t m_heap;
+
+public:
+    CArena() : m_current(0), m_offset(0), m_heap(0)
+    {
+    }
+
+    virtual~CArena()
+    {
+        for (size_t i = 0; i < m_chunks.size(); i++)
+        {
+            free(m_chunks[i].memory);
+        }
+    }
+
+    void*allocate(size_t size)
+    {
+        size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+        // the chunks after the current one are free again since the last reset
+        while (m_current < m_chunks.size())
+        {
+            if (m_offset + size <= m_chunks[m_current].size)
+            {
+                void*result = m_chunks[m_current].memory + m_offset;
+                m_offset += size;
+                return result;
+            }
+
+            m_current++;
+            m_offset = 0;
+        }
+
+        Chunk chunk;
+        chunk.size = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        chunk.memory = (char*)malloc(chunk.size);
+        if (NULL == chunk.memory)
+        {
+            throw bad_alloc();
+        }
+        m_heap++;
+
+        m_chunks.push_back(chunk);
+        m_current = m_chunks.size() - 1;
+        m_offset = size;
+        return chunk.memory;
+    }
+
+    void reset()
+    {
+        m_current = 0;
+        m_offset = 0;
+    }
+
+    size_t heap() const
+    {
+        return m_heap;
+    }
+};
+
+static thread_local CArena t_arena;
+
+void*arena_allocate(size_t size)
+{
+    return t_arena.allocate(size);
+}
+
+void arena_reset()
+{
+    t_arena.reset();
+}
+
+size_t arena_heap_allocations()
+{
+    return t_arena.heap();
+}
+
+extern "C"
+{
+    /*!
+     * A steady state process call should take nothing from the heap through
+     * the arena; warm up, then count over a run of calls
+     */
+    bool LIB_EXPORT TestArena(stringstream&stream)
+    {
+        const int calls = 100;
+
+        string identity, message;
+        for (int i = 0; i < 2; i++)
+        {
+            run_process(string(), identity, message);
+        }
+
+        const size_t before = arena_heap_allocations();
+        for (int i = 0; i < calls; i++)
+        {
+            run_process(string(), identity, message);
+        }
+        const size_t after = arena_heap_allocations();
+
+        stream << "arena heap allocations over " << calls << " calls: " << (after - before);
+
+        return before == after;
+    }
+}
+/* extern c */
@@ -0,0 +1,410 @@
+/*
+ * File:   Nova.Async.cpp
+ * Author: jools
+ *
+ * Two phase submit/poll front end for Nova.process().
+ *
+ * The first process call loads TRA and reads/verifies the FNE license which
+ * can take long enough to stall a Java 21 carrier thread. Here the work is
+ * handed to a small native pool; the caller only ever holds the carrier for
+ * a queue push or a result copy. Completion is signalled through an eventfd
+ * so a Java selector can park instead of spinning. The worker's error record
+ * travels with the result, and the poll that hands the result over makes it
+ * the polling thread's last error.
+ */
+
+#include "Nova.Internal.h"
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "Nova.Abi.h"
+
+using namespace std;
+
+#include "jni.h"
+#include "com_flexera_schneider_fnesigner_Nova.h"
+
+/*!
+ * Worker pool and ticket table, started lazily on first submit
+ */
+class CAsync
+{
+    struct Job
+    {
+        string path;
+        string identity;
+        string message;
+        CErrorRecord error;
+        int result;
+        bool done;
+
+        Job() : result(NOVA_FAILED), done(false)
+        {
+        }
+    };
+
+    /*!
+     * The workers and the condition variables they and the pollers wait on,
+     * held together so a fork child can abandon them in one go (see release)
+     */
+    struct Pool
+    {
+        condition_variable work;
+        condition_variable done;
+        vector<thread> threads;
+    };
+
+    mutex m_lock;
+    Pool*m_pool;
+    deque<unsigned long long> m_queue;
+    unordered_map<unsigned long long, Job> m_jobs;
+    unsigned long long m_next;
+    bool m_stop;
+    int m_event;
+
+public:
+    CAsync() : m_pool(NULL), m_next(0), m_stop(false), m_event(-1)
+    {
+    }
+
+    virtual~CAsync()
+    {
+        if (m_pool)
+        {
+            {
+                lock_guard<mutex> guard(m_lock);
+                m_stop = true;
+            }
+            m_pool->work.notify_all();
+
+            for (size_t i = 0; i < m_pool->threads.size(); i++)
+            {
+                m_pool->threads[i].join();
+            }
+
+            delete m_pool;
+        }
+
+        if (m_event >= 0)
+        {
+            close(m_event);
+        }
+    }
+
+    int event()
+    {
+        lock_guard<mutex> guard(m_lock);
+        start();
+        return m_event;
+    }
+
+    int submit(const string&path, unsigned long long&ticket)
+    {
+        {
+            lock_guard<mutex> guard(m_lock);
+            if (!start())
+            {
+                return NOVA_ERROR_SYSTEM;
+            }
+
+            ticket = ++m_next;
+            m_jobs[ticket].path = path;
+            m_queue.push_back(ticket);
+        }
+        m_pool->work.notify_one();
+
+        return NOVA_OK;
+    }
+
+    int poll(unsigned long long ticket, int timeout_ms,
+             char*out_identity, size_t*identity_length,
+             char*out_message, size_t*message_length)
+    {
+        unique_lock<mutex> guard(m_lock);
+
+        // a ticket only exists once start() made the pool
+        if (m_jobs.end() == m_jobs.find(ticket))
+        {
+            return NOVA_ERROR_TICKET;
+        }
+
+        // waiting drops m_lock, so iterators go stale; look the ticket up each time
+        const auto finished = [&]
+        {
+            unordered_map<unsigned long long, Job>::const_iterator job = m_jobs.find(ticket);
+            return job == m_jobs.end() || job->second.done;
+        };
+
+        if (timeout_ms < 0)
+        {
+            m_pool->done.wait(guard, finished);
+        }
+        else if (timeout_ms)
+        {
+            m_pool->done.wait_for(guard, chrono::milliseconds(timeout_ms), finished);
+        }
+
+        unordered_map<unsigned long long, Job>::iterator job = m_jobs.find(ticket);
+        if (job == m_jobs.end())
+        {
+            // another poller took the result while this one waited
+            return NOVA_ERROR_TICKET;
+        }
+
+        if (!job->second.done)
+        {
+            return NOVA_PENDING;
+        }
+
+        const int copied_message = copy_out(job->second.message, out_message, message_length);
+        const int copied_identity = copy_out(job->second.identity, out_identity, identity_length);
+
+        if (NOVA_OK != copied_message || NOVA_OK != copied_identity)
+        {
+            // keep the ticket so the caller can retry with larger buffers
+            return NOVA_ERROR_BUFFER_SIZE;
+        }
+
+        const int result = job->second.result;
+
+        // the call ran on a worker, whose thread holds its error record
+        last_error() = job->second.error;
+
+        m_jobs.erase(job);
+
+        return result;
+    }
+
+    void fork_prepare()
+    {
+        m_lock.lock();
+    }
+
+    void fork_parent()
+    {
+        m_lock.unlock();
+    }
+
+    /*!
+     * Only the forking thread survives, so the pool and every ticket are
+     * forgotten and the next submit starts afresh. The eventfd is shared
+     * with the parent and must not be signalled from here.
+     */
+    void fork_child()
+    {
+        release();
+
+        m_queue.clear();
+        m_jobs.clear();
+
+        if (m_event >= 0)
+        {
+            close(m_event);
+            m_event = -1;
+        }
+
+        m_lock.unlock();
+    }
+
+private:
+    /*!
+     * Called with m_lock held
+     */
+    bool start()
+    {
+        if (NULL == m_pool)
+        {
+            m_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (m_event < 0)
+            {
+                return false;
+            }
+
+            const unsigned int cores = thread::hardware_concurrency();
+            const unsigned int count = cores < 1 ? 1 : cores > 4 ? 4 : cores;
+
+            m_pool = new Pool();
+            for (unsigned int i = 0; i < count; i++)
+            {
+                m_pool->threads.push_back(thread(&CAsync::run, this, m_pool));
+            }
+        }
+        return true;
+    }
+
+    /*!
+     * Abandons the pool in a fork child, where its threads are gone: they
+     * can be neither joined nor detached, and its condition variables may
+     * still record their waiters, so none of it is destroyed. It is leaked
+     * once per fork, and the next start() makes a fresh one.
+     */
+    void release()
+    {
+        m_pool = NULL;
+    }
+
+    void run(Pool*pool)
+    {
+        unique_lock<mutex> guard(m_lock);
+
+        for (;;)
+        {
+            pool->work.wait(guard, [this]{ return m_stop || !m_queue.empty(); });
+            if (m_stop)
+            {
+                break;
+            }
+
+            const unsigned long long ticket = m_queue.front();
+            m_queue.pop_front();
+
+            // references into an unordered_map survive rehashing
+            Job&job = m_jobs[ticket];
+            const string path = job.path;
+
+            guard.unlock();
+
+            string identity, message;
+            const int result = run_process(path, identity, message);
+
+            guard.lock();
+
+            job.identity.swap(identity);
+            job.message.swap(message);
+            job.error = last_error();
+            job.result = result;
+            job.done = true;
+
+            pool->done.notify_all();
+
+            const uint64_t signal = 1;
+            if (sizeof signal != write(m_event, &signal, sizeof signal))
+            {
+                DEBUG_PRINTLN("eventfd write failed");
+            }
+        }
+    }
+} async;
+
+static void on_fork_prepare()
+{
+    async.fork_prepare();
+}
+
+static void on_fork_parent()
+{
+    async.fork_parent();
+}
+
+static void on_fork_child()
+{
+    async.fork_child();
+}
+
+static const int async_fork = pthread_atfork(on_fork_prepare, on_fork_parent, on_fork_child);
+
+extern "C"
+{
+    int LIB_EXPORT nova_submit(const char*lic, size_t lic_length, unsigned long long*ticket)
+    {
+        if (NULL == ticket || (NULL == lic && lic_length))
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        return async.submit(lic ? string(lic, lic_length) : string(), *ticket);
+    }
+
+    int LIB_EXPORT nova_poll(unsigned long long ticket,
+                             char*out_identity, size_t*identity_length,
+                             char*out_message, size_t*message_length)
+    {
+        if (NULL == identity_length || NULL == message_length)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        return async.poll(ticket, 0, out_identity, identity_length, out_message, message_length);
+    }
+
+    int LIB_EXPORT nova_await(unsigned long long ticket, int timeout_ms,
+                              char*out_identity, size_t*identity_length,
+                              char*out_message, size_t*message_length)
+    {
+        if (NULL == identity_length || NULL == message_length)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        return async.poll(ticket, timeout_ms, out_identity, identity_length, out_message, message_length);
+    }
+
+    int LIB_EXPORT nova_event_fd(void)
+    {
+        return async.event();
+    }
+
+    LIB_EXPORT jlong JNICALL Java_com_flexera_schneider_fnesigner_Nova_submit(JNIEnv*, jobject)
+    {
+        unsigned long long ticket = 0;
+
+        if (NOVA_OK != async.submit(string(), ticket))
+        {
+            return 0;
+        }
+
+        return (jlong)ticket;
+    }
+
+    /*!
+     * Returns a NOVA_* code; message and identity are set once it is not NOVA_PENDING
+     */
+    LIB_EXPORT jint JNICALL Java_com_flexera_schneider_fnesigner_Nova_poll(JNIEnv*env, jobject object, jlong ticket)
+    {
+        char identity[1024];
+        char message[1024];
+        size_t identity_length = sizeof identity;
+        size_t message_length = sizeof message;
+
+        int result = async.poll((unsigned long long)ticket, 0, identity, &identity_length, message, &message_length);
+        if (NOVA_ERROR_BUFFER_SIZE == result)
+        {
+            vector<char> large_identity(identity_length + 1);
+            vector<char> large_message(message_length + 1);
+            identity_length = large_identity.size();
+            message_length = large_message.size();
+
+            result = async.poll((unsigned long long)ticket, 0, &large_identity[0], &identity_length, &large_message[0], &message_length);
+            if (NOVA_OK == result || NOVA_FAILED == result)
+            {
+                marshal_result(env, object, "message", &large_message[0], message_length);
+                marshal_result(env, object, "identity", &large_identity[0], identity_length);
+            }
+        }
+        else if (NOVA_OK == result || NOVA_FAILED == result)
+        {
+            marshal_result(env, object, "message", message, message_length);
+            marshal_result(env, object, "identity", identity, identity_length);
+        }
+
+        return result;
+    }
+
+    LIB_EXPORT jint JNICALL Java_com_flexera_schneider_fnesigner_Nova_eventFd(JNIEnv*, jobject)
+    {
+        return async.event();
+    }
+}
+/* extern c */
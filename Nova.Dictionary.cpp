@@ -0,0 +1,268 @@
+/*
+ * File:   Nova.Dictionary.cpp
+ * Author: jools
+ *
+ * Flat snapshots of vendor dictionaries.
+ *
+ * Reading a vendor dictionary through the SDK is a size call and then a
+ * value type call and a typed item call per index, and looking a key up
+ * means walking the items. A snapshot flattens the dictionary once into a
+ * single image: an open addressing table of 32 byte slots followed by the
+ * key and string bytes. Lookups hash the key and probe the table, and values
+ * point into the image, so nothing is copied after the snapshot is taken.
+ * The same image is what Java gets as a direct ByteBuffer.
+ */
+
+#include "Nova.Internal.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+
+#include "Nova.Abi.h"
+
+using namespace std;
+
+#include "jni.h"
+#include "com_flexera_schneider_fnesigner_Nova.h"
+
+// smallest table of a snapshot, and how full a table may get
+static const uint32_t DICTIONARY_MIN_CAPACITY = 8;
+static const uint32_t DICTIONARY_LOAD_PERCENT = 50;
+
+struct DictionaryHeader
+{
+    uint32_t capacity;
+    uint32_t count;
+};
+
+struct DictionarySlot
+{
+    uint64_t hash;
+    uint32_t key;
+    uint32_t key_length;
+    int32_t type;
+    int32_t integer;
+    uint32_t string;
+    uint32_t string_length;
+};
+
+static_assert(sizeof(DictionarySlot) == 32, "slot layout is part of the ABI");
+
+CDictionary::CDictionary() : m_size(0)
+{
+}
+
+shared_ptr<const CDictionary> CDictionary::snapshot(FlcDictionaryRef dictionary)
+{
+    struct Item
+    {
+        const FlcChar*key;
+        const FlcChar*string;
+        FlcInt32 integer;
+        int32_t type;
+    };
+
+    vector<Item> items;
+    size_t bytes = 0;
+
+    FlcUInt32 size = 0;
+    if (dictionary && FlcDictionaryGetSize(dictionary, &size, NULL))
+    {
+        items.reserve(size);
+
+        for (FlcUInt32 i = 0; i < size; i++)
+        {
+            FlcDictionaryValueType type = FLC_DICTIONARY_UNKNOWN_VALUE;
+            if (!FlcDictionaryGetValueType(dictionary, i, &type, NULL))
+            {
+                continue;
+            }
+
+            Item item = Item();
+            if (FLC_DICTIONARY_STR_VALUE == type
+                && FlcDictionaryGetStringItem(dictionary, i, &item.key, &item.string, NULL) && item.key && item.string)
+            {
+                item.type = NOVA_VALUE_STRING;
+                bytes += strlen(item.string) + 1;
+            }
+            else if (FLC_DICTIONARY_INT_VALUE == type
+                     && FlcDictionaryGetIntItem(dictionary, i, &item.key, &item.integer, NULL) && item.key)
+            {
+                item.type = NOVA_VALUE_INT;
+            }
+            else
+            {
+                continue;
+            }
+
+            bytes += strlen(item.key) + 1;
+            items.push_back(item);
+        }
+    }
+
+    uint32_t capacity = DICTIONARY_MIN_CAPACITY;
+    while (capacity * DICTIONARY_LOAD_PERCENT / 100 < items.size())
+    {
+        capacity *= 2;
+    }
+
+    const size_t table = sizeof(DictionaryHeader) + capacity * sizeof(DictionarySlot);
+
+    CDictionary*result = new CDictionary();
+    result->m_size = table + bytes;
+    result->m_image.resize((result->m_size + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+
+    char*image = (char*)&result->m_image[0];
+
+    DictionaryHeader*header = (DictionaryHeader*)image;
+    header->capacity = capacity;
+    header->count = (uint32_t)items.size();
+
+    DictionarySlot*slots = (DictionarySlot*)(image + sizeof(DictionaryHeader));
+    size_t offset = table;
+
+    for (size_t i = 0; i < items.size(); i++)
+    {
+        const size_t key_length = strlen(items[i].key);
+        const uint64_t hash = fnv1a64(items[i].key, key_length);
+
+        // keys are unique in an FlcDictionary, so no slot is ever replaced
+        uint32_t index = (uint32_t)hash & (capacity - 1);
+        while (slots[index].type)
+        {
+            index = (index + 1) & (capacity - 1);
+        }
+
+        DictionarySlot&slot = slots[index];
+        slot.hash = hash;
+        slot.type = items[i].type;
+        slot.integer = items[i].integer;
+
+        slot.key = (uint32_t)offset;
+        slot.key_length = (uint32_t)key_length;
+        memcpy(image + offset, items[i].key, key_length + 1);
+        offset += key_length + 1;
+
+        if (NOVA_VALUE_STRING == items[i].type)
+        {
+            const size_t length = strlen(items[i].string);
+            slot.string = (uint32_t)offset;
+            slot.string_length = (uint32_t)length;
+            memcpy(image + offset, items[i].string, length + 1);
+            offset += length + 1;
+        }
+    }
+
+    return shared_ptr<const CDictionary>(result);
+}
+
+bool CDictionary::find(const char*key, size_t length, nova_value&value) const
+{
+    const char*image = (const char*)&m_image[0];
+    const DictionaryHeader*header = (const DictionaryHeader*)image;
+    const DictionarySlot*slots = (const DictionarySlot*)(image + sizeof(DictionaryHeader));
+
+    const uint64_t hash = fnv1a64(key, length);
+    const uint32_t mask = header->capacity - 1;
+
+    for (uint32_t index = (uint32_t)hash & mask; slots[index].type; index = (index + 1) & mask)
+    {
+        const DictionarySlot&slot = slots[index];
+        if (slot.hash == hash && slot.key_length == length && (0 == length || 0 == memcmp(image + slot.key, key, length)))
+        {
+            value.type = slot.type;
+            value.integer = slot.integer;
+            value.string = NOVA_VALUE_STRING == slot.type ? image + slot.string : NULL;
+            value.length = slot.string_length;
+            return true;
+        }
+    }
+    return false;
+}
+
+const void* CDictionary::data() const
+{
+    return &m_image[0];
+}
+
+size_t CDictionary::size() const
+{
+    return m_size;
+}
+
+extern "C"
+{
+    int LIB_EXPORT nova_exchange_dictionary(nova_exchange*exchange, int source, nova_dictionary**dictionary)
+    {
+        if (NULL == exchange || NULL == dictionary
+            || (NOVA_DICTIONARY_STORAGE != source && NOVA_DICTIONARY_RESPONSE != source))
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        shared_ptr<const CDictionary> snapshot = exchange_dictionary(exchange, source);
+        if (!snapshot)
+        {
+            return NOVA_FAILED;
+        }
+
+        *dictionary = (nova_dictionary*)new shared_ptr<const CDictionary>(snapshot);
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_dictionary_get(const nova_dictionary*dictionary, const char*key, size_t key_length,
+                                       nova_value*value)
+    {
+        if (NULL == dictionary || (NULL == key && key_length) || NULL == value)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        const shared_ptr<const CDictionary>&snapshot = *(const shared_ptr<const CDictionary>*)dictionary;
+        return snapshot->find(key, key_length, *value) ? NOVA_OK : NOVA_FAILED;
+    }
+
+    int LIB_EXPORT nova_dictionary_image(const nova_dictionary*dictionary, const void**data, size_t*size)
+    {
+        if (NULL == dictionary || NULL == data || NULL == size)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        const shared_ptr<const CDictionary>&snapshot = *(const shared_ptr<const CDictionary>*)dictionary;
+        *data = snapshot->data();
+        *size = snapshot->size();
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_dictionary_release(nova_dictionary*dictionary)
+    {
+        if (NULL == dictionary)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        delete (shared_ptr<const CDictionary>*)dictionary;
+        return NOVA_OK;
+    }
+
+    /*!
+     * Direct ByteBuffer over the image of a nova_dictionary handle, valid
+     * until the handle is released; null if the handle is 0. The image is
+     * shared by every holder of the snapshot and must not be written.
+     */
+    LIB_EXPORT jobject JNICALL Java_com_flexera_schneider_fnesigner_Nova_dictionaryView(JNIEnv*env, jobject, jlong dictionary)
+    {
+        if (0 == dictionary)
+        {
+            return NULL;
+        }
+
+        const shared_ptr<const CDictionary>&snapshot = *(const shared_ptr<const CDictionary>*)dictionary;
+        return env->NewDirectByteBuffer(const_cast<void*>(snapshot->data()), (jlong)snapshot->size());
+    }
+}
+/* extern c */
@@ -0,0 +1,199 @@
+/*
+ * File:   Nova.Error.cpp
+ * Author: jools
+ *
+ * Errors kept as codes, formatted when someone asks.
+ *
+ * A process call used to copy FlcErrorGetMessage into a string whether or
+ * not anything had failed. Now a call records the error code and system
+ * code of its FlcErrorRef in the thread's error record, and nothing else
+ * when both are zero. On failure the status collection of the licensing
+ * environment is captured too, as codes and details, since the SDK only
+ * keeps it for the thread's last request. Text is only produced when Java
+ * or a log sink asks for it through nova_last_error_message or
+ * nova_last_error_status.
+ */
+
+#include "Nova.Internal.h"
+
+#include <string>
+#include <vector>
+#include <sstream>
+
+#include "Nova.Abi.h"
+
+using namespace std;
+
+#include "FlcErrorCodes.h"
+#include "FlcLicenseManager.h"
+#include "FlcStatus.h"
+#include "jni.h"
+#include "com_flexera_schneider_fnesigner_Nova.h"
+
+CErrorRecord::CErrorRecord() : m_code(0), m_system(0)
+{
+}
+
+CErrorRecord::~CErrorRecord()
+{
+}
+
+void CErrorRecord::capture(FlcErrorRef error, FlcLicensingRef licensing)
+{
+    m_code = error ? FlcErrorGetCode(error) : 0;
+    m_system = error ? FlcErrorGetSystemCode(error) : 0;
+
+    if (0 == m_code)
+    {
+        m_status.clear();
+        return;
+    }
+
+    capture_status(licensing);
+}
+
+void CErrorRecord::clear()
+{
+    m_code = 0;
+    m_system = 0;
+    m_status.clear();
+}
+
+bool CErrorRecord::failed() const
+{
+    return 0 != m_code;
+}
+
+FlcInt32 CErrorRecord::code() const
+{
+    return m_code;
+}
+
+FlcInt32 CErrorRecord::system() const
+{
+    return m_system;
+}
+
+string CErrorRecord::describe() const
+{
+    if (0 == m_code)
+    {
+        return string();
+    }
+
+    stringstream stream;
+
+    const FlcChar*description = FlcErrorCodeGetDescription(m_code);
+    stream << (description ? description : "error") << " (" << m_code << ")";
+
+    // as ErrDisplay.c: the system code of a server error is a back office status
+    if (FLCERR_RESPONSE_SERVER_ERROR == m_code && m_system)
+    {
+        const FlcChar*status = FlcBackOfficeErrorCodeGetDescription(m_system);
+        stream << std::endl << "Server status: (" << (status ? status : "") << ")";
+    }
+    else if (m_system)
+    {
+        stream << ", system code " << m_system;
+    }
+
+    return stream.str();
+}
+
+string CErrorRecord::status() const
+{
+    stringstream stream;
+    for (size_t i = 0; i < m_status.size(); i++)
+    {
+        const FlcChar*description = FlcStatusCodeGetDescription(m_status[i].code);
+        stream << m_status[i].code << " " << m_status[i].type << " "
+               << (description ? description : "") << ": " << m_status[i].details << std::endl;
+    }
+    return stream.str();
+}
+
+/*!
+ * Failure path only; the collection belongs to the thread's last request
+ */
+void CErrorRecord::capture_status(FlcLicensingRef licensing)
+{
+    m_status.clear();
+
+    FlcStatusCollectionRef collection = 0;
+    FlcSize size = 0;
+    if (NULL == licensing
+        || !FlcGetLastErrorStatusCollection(licensing, &collection, NULL) || NULL == collection
+        || !FlcStatusCollectionSize(collection, &size, NULL))
+    {
+        return;
+    }
+
+    for (FlcSize i = 0; i < size; i++)
+    {
+        Status item;
+        const FlcChar*details = 0;
+        if (FlcStatusCollectionGetItem(collection, (FlcUInt32)i, &item.code, &item.type, &details, NULL))
+        {
+            item.details = details ? details : "";
+            m_status.push_back(item);
+        }
+    }
+}
+
+CErrorRecord&last_error()
+{
+    static thread_local CErrorRecord record;
+    return record;
+}
+
+extern "C"
+{
+    int LIB_EXPORT nova_last_error(int*code, int*system_code)
+    {
+        if (NULL == code || NULL == system_code)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        const CErrorRecord&record = last_error();
+        *code = record.code();
+        *system_code = record.system();
+        return record.failed() ? NOVA_FAILED : NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_last_error_message(char*out_message, size_t*message_length)
+    {
+        if (NULL == message_length)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        return copy_out(last_error().describe(), out_message, message_length);
+    }
+
+    int LIB_EXPORT nova_last_error_status(char*out_status, size_t*status_length)
+    {
+        if (NULL == status_length)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        return copy_out(last_error().status(), out_status, status_length);
+    }
+
+    /*!
+     * Description and status lines of the calling thread's last process
+     * error, null if it succeeded
+     */
+    LIB_EXPORT jstring JNICALL Java_com_flexera_schneider_fnesigner_Nova_lastError(JNIEnv*env, jobject)
+    {
+        const CErrorRecord&record = last_error();
+        if (!record.failed())
+        {
+            return NULL;
+        }
+
+        return env->NewStringUTF((record.describe() + "\n" + record.status()).c_str());
+    }
+}
+/* extern c */
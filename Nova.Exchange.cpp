@@ -0,0 +1,1516 @@
+/*
+ * File:   Nova.Exchange.cpp
+ * Author: jools
+ *
+ * Pipelined capability exchange with the back office.
+ *
+ * The toolkit samples create an FlcCommRef, send one capability request
+ * synchronously and delete the handle again for every exchange. Here the
+ * configured handles are pooled per server URI, a few worker threads of an
+ * exchange keep several requests in flight, and the responses are still fed
+ * to FlcProcessCapabilityResponseData strictly in request order, as the
+ * licensing environment rejects out of order responses as stale.
+ *
+ * A loopback stand-in server that replays recorded responses lets the
+ * throughput and latency be measured without a back office.
+ */
+
+#include "Nova.Internal.h"
+
+#include <cerrno>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "Nova.Abi.h"
+
+using namespace std;
+
+#include "FlcLicenseManager.h"
+#include "FlcCapabilityRequest.h"
+#include "FlcCapabilityResponse.h"
+#include "FlcComm.h"
+#include "FlcFeature.h"
+#include "FlcCapabilityRequestOperation.h"
+#include "FlcLicenseServerInstance.h"
+#include "FlcServerUpdateInformation.h"
+
+// idle handles kept per server URI
+static const size_t EXCHANGE_MAX_POOLED = 16;
+
+// upper bound on worker threads, i.e. requests in flight, of one exchange
+static const unsigned int EXCHANGE_MAX_DEPTH = 32;
+
+// seconds, 0 would let a dead back office hang a worker for ever
+static const FlcUInt32 EXCHANGE_CONNECT_TIMEOUT = 10;
+static const FlcUInt32 EXCHANGE_TRANSFER_TIMEOUT = 30;
+
+// generated requests kept per exchange, and for how long
+static const size_t EXCHANGE_MAX_CACHED = 64;
+static const int EXCHANGE_CACHE_SECONDS = 3600;
+
+CapabilitySpec::CapabilitySpec()
+    : operation(FLC_CAPABILITY_REQUEST_OPERATION_UNKNOWN), instance(FLC_LICENSE_SERVER_DEFAULT), correlate(false)
+{
+}
+
+bool CapabilitySpec::cacheable() const
+{
+    return !correlate && correlation.empty();
+}
+
+string CapabilitySpec::canonical(FlcHostIdType host_type, const char*host_id) const
+{
+    stringstream stream;
+
+    vector<Feature> f(features);
+    sort(f.begin(), f.end());
+    stream << 'F' << f.size();
+    for (size_t i = 0; i < f.size(); i++)
+    {
+        stream << ':' << f[i].name.size() << ':' << f[i].name << f[i].version.size() << ':' << f[i].version << f[i].count;
+    }
+
+    vector<pair<string, int> > r(rights);
+    sort(r.begin(), r.end());
+    stream << 'R' << r.size();
+    for (size_t i = 0; i < r.size(); i++)
+    {
+        stream << ':' << r[i].first.size() << ':' << r[i].first << r[i].second;
+    }
+
+    vector<pair<string, string> > d(strings);
+    sort(d.begin(), d.end());
+    stream << 'S' << d.size();
+    for (size_t i = 0; i < d.size(); i++)
+    {
+        stream << ':' << d[i].first.size() << ':' << d[i].first << d[i].second.size() << ':' << d[i].second;
+    }
+
+    vector<pair<string, int> > n(integers);
+    sort(n.begin(), n.end());
+    stream << 'I' << n.size();
+    for (size_t i = 0; i < n.size(); i++)
+    {
+        stream << ':' << n[i].first.size() << ':' << n[i].first << n[i].second;
+    }
+
+    vector<pair<int, string> > h(hosts);
+    sort(h.begin(), h.end());
+    stream << 'H' << h.size();
+    for (size_t i = 0; i < h.size(); i++)
+    {
+        stream << ':' << h[i].first << ':' << h[i].second.size() << ':' << h[i].second;
+    }
+
+    const string id = host_id ? host_id : "";
+    stream << 'O' << operation << 'V' << instance << 'D' << (int)host_type << ':' << id.size() << ':' << id;
+
+    return stream.str();
+}
+
+/*!
+ * Configured FlcCommRef handles per server URI; a handle that failed a
+ * send is deleted rather than pooled
+ */
+class CCommPool
+{
+    mutex m_lock;
+    unordered_map<string, vector<FlcCommRef> > m_idle;
+
+public:
+    virtual~CCommPool()
+    {
+        for (unordered_map<string, vector<FlcCommRef> >::iterator i = m_idle.begin(); i != m_idle.end(); ++i)
+        {
+            for (size_t j = 0; j < i->second.size(); j++)
+            {
+                FlcCommDelete(&i->second[j], NULL);
+            }
+        }
+    }
+
+    FlcCommRef acquire(const string&server, FlcErrorRef error)
+    {
+        {
+            lock_guard<mutex> guard(m_lock);
+
+            vector<FlcCommRef>&idle = m_idle[server];
+            if (!idle.empty())
+            {
+                FlcCommRef comm = idle.back();
+                idle.pop_back();
+                return comm;
+            }
+        }
+
+        FlcCommRef comm = 0;
+        if (!FlcCommCreate(&comm, error))
+        {
+            return 0;
+        }
+
+        if (!FlcCommSetServer(comm, server.c_str(), error)
+            || !FlcCommSetConnectTimeout(comm, EXCHANGE_CONNECT_TIMEOUT, error)
+            || !FlcCommSetTransferTimeout(comm, EXCHANGE_TRANSFER_TIMEOUT, error))
+        {
+            FlcCommDelete(&comm, NULL);
+            return 0;
+        }
+        return comm;
+    }
+
+    void release(const string&server, FlcCommRef comm, bool healthy)
+    {
+        if (healthy)
+        {
+            lock_guard<mutex> guard(m_lock);
+
+            vector<FlcCommRef>&idle = m_idle[server];
+            if (idle.size() < EXCHANGE_MAX_POOLED)
+            {
+                idle.push_back(comm);
+                return;
+            }
+        }
+        FlcCommDelete(&comm, NULL);
+    }
+
+    void fork_prepare()
+    {
+        m_lock.lock();
+    }
+
+    void fork_parent()
+    {
+        m_lock.unlock();
+    }
+
+    /*!
+     * The pooled connections are shared with the parent, so the child
+     * forgets them without closing anything
+     */
+    void fork_child()
+    {
+        for (unordered_map<string, vector<FlcCommRef> >::iterator i = m_idle.begin(); i != m_idle.end(); ++i)
+        {
+            i->second.clear();
+        }
+        m_lock.unlock();
+    }
+} comms;
+
+static void on_fork_prepare()
+{
+    comms.fork_prepare();
+}
+
+static void on_fork_parent()
+{
+    comms.fork_parent();
+}
+
+static void on_fork_child()
+{
+    comms.fork_child();
+}
+
+static const int exchange_fork = pthread_atfork(on_fork_prepare, on_fork_parent, on_fork_child);
+
+/*!
+ * One licensing environment talking to one server. Tickets are issued in
+ * request order and responses are processed in ticket order, whichever
+ * worker happens to receive them first.
+ */
+class CExchange
+{
+    struct Exchange
+    {
+        vector<FlcUInt8> request;
+        vector<FlcUInt8> response;
+        string message;
+        function<void(int, int)> hook;
+        int instance;
+        int result;
+        bool received;
+        bool sent;
+        bool done;
+
+        Exchange() : instance(FLC_LICENSE_SERVER_DEFAULT), result(NOVA_FAILED), received(false), sent(false), done(false)
+        {
+        }
+    };
+
+    struct Cached
+    {
+        string key;
+        vector<FlcUInt8> request;
+        chrono::steady_clock::time_point generated;
+    };
+
+    FlcLicensingRef m_licensing;
+    FlcErrorRef m_error;
+    int m_node;
+    string m_server;
+    string m_record;
+
+    // serialises every SDK call on m_licensing, and guards the cache
+    mutex m_sdk;
+    unordered_map<uint64_t, Cached> m_cache;
+    // of the trusted storage features the cached requests were made against
+    uint64_t m_storage;
+    unsigned long long m_cache_hits;
+    unsigned long long m_cache_misses;
+    FlcUInt32 m_renew_interval;
+    unsigned long long m_host;
+    FlcHostIdType m_host_type;
+    string m_host_id;
+    shared_ptr<const CDictionary> m_storage_dictionary;
+    shared_ptr<const CDictionary> m_response_dictionary;
+
+    mutex m_lock;
+    condition_variable m_work;
+    condition_variable m_done;
+    deque<unsigned long long> m_queue;
+    map<unsigned long long, Exchange> m_exchanges;
+    unsigned long long m_next;
+    unsigned long long m_processed;
+    bool m_processing;
+    bool m_stop;
+    vector<thread> m_threads;
+
+public:
+    CExchange(int node, const string&server)
+        : m_licensing(0), m_error(0), m_node(node), m_server(server)
+        , m_storage(0), m_cache_hits(0), m_cache_misses(0), m_renew_interval(0), m_host(0), m_host_type(FLC_HOSTID_TYPE_UNKNOWN)
+        , m_next(0), m_processed(0), m_processing(false), m_stop(false)
+    {
+    }
+
+    virtual~CExchange()
+    {
+        {
+            lock_guard<mutex> guard(m_lock);
+            m_stop = true;
+        }
+        m_work.notify_all();
+        m_done.notify_all();
+
+        for (size_t i = 0; i < m_threads.size(); i++)
+        {
+            m_threads[i].join();
+        }
+
+        tra.release_licensing(m_node, &m_licensing);
+
+        if (m_error)
+        {
+            FlcErrorDelete(&m_error);
+        }
+    }
+
+    int open(const string&path, unsigned int depth)
+    {
+        if (!FlcErrorCreate(&m_error)
+            || !create_licensing(m_node, &m_licensing, m_error)
+            || (!path.empty() && !add_license_sources(m_licensing, path, m_error)))
+        {
+            return NOVA_FAILED;
+        }
+
+        for (unsigned int i = 0; i < depth; i++)
+        {
+            m_threads.push_back(thread(&CExchange::run, this));
+        }
+        return NOVA_OK;
+    }
+
+    const char* message()
+    {
+        return m_error ? FlcErrorGetMessage(m_error) : "";
+    }
+
+    void cache_statistics(unsigned long long&hits, unsigned long long&misses)
+    {
+        lock_guard<mutex> guard(m_sdk);
+        hits = m_cache_hits;
+        misses = m_cache_misses;
+    }
+
+    /*!
+     * Set before the first submit; each response received is then saved
+     * as <ticket>.bin for the stand-in server to replay
+     */
+    void record(const string&directory)
+    {
+        lock_guard<mutex> guard(m_lock);
+        m_record = directory;
+    }
+
+    /*!
+     * Generate a request on the calling thread and queue it for sending
+     */
+    int submit(const CapabilitySpec&spec, unsigned long long&ticket, string&message)
+    {
+        return submit(spec, function<void(int, int)>(), ticket, message);
+    }
+
+    /*!
+     * Submit whose completion goes to hook instead of a waiter
+     */
+    int refresh(const CapabilitySpec&spec, const function<void(int, int)>&hook)
+    {
+        unsigned long long ticket = 0;
+        string message;
+        return submit(spec, hook, ticket, message);
+    }
+
+    /*!
+     * From trusted storage, else the renew interval of the last response
+     */
+    int next_update(int instance)
+    {
+        lock_guard<mutex> guard(m_sdk);
+
+        FlcInt32 seconds = 0;
+        const FlcBool known = FLC_LICENSE_SERVER_DEFAULT == instance
+            ? FlcServerUpdateGetNextTime(m_licensing, &seconds, m_error)
+            : FlcServerInstanceGetSecondsUntilNextUpdate(m_licensing, (FlcLicenseServerInstance)instance, &seconds, m_error);
+
+        if (known)
+        {
+            // negative when already overdue
+            return seconds < 0 ? 0 : seconds;
+        }
+
+        return m_renew_interval ? (int)m_renew_interval : -1;
+    }
+
+    int wait(unsigned long long ticket, int timeout_ms, char*out_message, size_t*message_length)
+    {
+        unique_lock<mutex> guard(m_lock);
+
+        if (m_exchanges.end() == m_exchanges.find(ticket))
+        {
+            return NOVA_ERROR_TICKET;
+        }
+
+        // waiting drops m_lock, and another waiter or drain() may erase the
+        // ticket meanwhile, so look it up each time
+        const auto finished = [&]
+        {
+            map<unsigned long long, Exchange>::const_iterator exchange = m_exchanges.find(ticket);
+            return m_stop || exchange == m_exchanges.end() || exchange->second.done;
+        };
+
+        if (timeout_ms < 0)
+        {
+            m_done.wait(guard, finished);
+        }
+        else if (timeout_ms)
+        {
+            m_done.wait_for(guard, chrono::milliseconds(timeout_ms), finished);
+        }
+
+        map<unsigned long long, Exchange>::iterator exchange = m_exchanges.find(ticket);
+        if (exchange == m_exchanges.end())
+        {
+            // another waiter took the result, or drain() dropped it, meanwhile
+            return NOVA_ERROR_TICKET;
+        }
+
+        if (!exchange->second.done)
+        {
+            return NOVA_PENDING;
+        }
+
+        if (NOVA_OK != copy_out(exchange->second.message, out_message, message_length))
+        {
+            // keep the ticket so the caller can retry with a larger buffer
+            return NOVA_ERROR_BUFFER_SIZE;
+        }
+
+        const int result = exchange->second.result;
+
+        m_exchanges.erase(exchange);
+
+        return result;
+    }
+
+    int undo_seconds(const string&feature, const string&version)
+    {
+        lock_guard<mutex> guard(m_sdk);
+
+        FlcFeatureCollectionRef features = 0;
+        if (!FlcGetTrustedStorageFeatureCollection(m_licensing, &features, FLC_FALSE, NULL))
+        {
+            return 0;
+        }
+
+        FlcUInt32 most = 0;
+        FlcFeatureRef match = 0;
+        for (FlcUInt32 index = 0; FlcFeatureCollectionFind(features, &match, &index, feature.c_str(), index, NULL); index++)
+        {
+            const FlcChar*found = 0;
+            FlcUInt32 seconds = 0;
+            if (FlcFeatureGetVersion(match, &found, NULL) && version == found
+                && FlcFeatureGetSecondsLeftInUndoInterval(match, &seconds, NULL) && seconds > most)
+            {
+                most = seconds;
+            }
+        }
+
+        FlcFeatureCollectionDelete(&features, NULL);
+
+        return (int)most;
+    }
+
+    /*!
+     * The trusted storage snapshot is taken on first use after a response
+     */
+    shared_ptr<const CDictionary> dictionary(int source)
+    {
+        lock_guard<mutex> guard(m_sdk);
+
+        if (NOVA_DICTIONARY_RESPONSE == source)
+        {
+            if (!m_response_dictionary)
+            {
+                m_response_dictionary = CDictionary::snapshot(NULL);
+            }
+            return m_response_dictionary;
+        }
+
+        if (!m_storage_dictionary)
+        {
+            FlcDictionaryRef dictionary = 0;
+            FlcGetTrustedStorageVendorDictionary(m_licensing, &dictionary, NULL);
+            m_storage_dictionary = CDictionary::snapshot(dictionary);
+        }
+        return m_storage_dictionary;
+    }
+
+private:
+    int submit(const CapabilitySpec&spec, const function<void(int, int)>&hook, unsigned long long&ticket, string&message)
+    {
+        vector<FlcUInt8> request;
+        if (!generate(spec, request, message))
+        {
+            return NOVA_FAILED;
+        }
+
+        {
+            lock_guard<mutex> guard(m_lock);
+
+            ticket = ++m_next;
+
+            Exchange&exchange = m_exchanges[ticket];
+            exchange.request.swap(request);
+            exchange.hook = hook;
+            exchange.instance = spec.instance;
+
+            m_queue.push_back(ticket);
+        }
+        m_work.notify_one();
+
+        return NOVA_OK;
+    }
+
+    /*!
+     * Signed request for spec, reused while nothing that goes into it has
+     * changed: neither the spec, the default host ID nor trusted storage
+     */
+    bool generate(const CapabilitySpec&spec, vector<FlcUInt8>&request, string&message)
+    {
+        lock_guard<mutex> guard(m_sdk);
+
+        FlcErrorRef error = 0;
+        if (!FlcErrorCreate(&error))
+        {
+            return false;
+        }
+
+        string key;
+        uint64_t hash = 0;
+
+        // an exchange outlives link changes, so follow the host identity cache
+        if (m_host != host_generation())
+        {
+            m_host = host_prepare(m_licensing, false, &m_host_type, &m_host_id);
+        }
+
+        if (spec.cacheable())
+        {
+            key = spec.canonical(m_host_type, m_host_id.c_str());
+            hash = fnv1a64(key.data(), key.size());
+
+            unordered_map<uint64_t, Cached>::iterator cached = m_cache.find(hash);
+            if (cached != m_cache.end() && cached->second.key == key
+                && chrono::steady_clock::now() - cached->second.generated < chrono::seconds(EXCHANGE_CACHE_SECONDS))
+            {
+                m_cache_hits++;
+                request = cached->second.request;
+                FlcErrorDelete(&error);
+                return true;
+            }
+            m_cache_misses++;
+        }
+
+        FlcCapabilityRequestRef capability = 0;
+        FlcUInt8*data = 0;
+        FlcSize size = 0;
+        const FlcChar*generated = 0;
+
+        bool result = FlcCapabilityRequestCreate(m_licensing, &capability, error);
+
+        for (size_t i = 0; result && i < spec.features.size(); i++)
+        {
+            const CapabilitySpec::Feature&feature = spec.features[i];
+            result = FlcCapabilityRequestAddDesiredFeature(m_licensing, capability, feature.name.c_str(), feature.version.c_str(), feature.count, error);
+        }
+        for (size_t i = 0; result && i < spec.rights.size(); i++)
+        {
+            result = FlcCapabilityRequestAddRightsId(m_licensing, capability, spec.rights[i].first.c_str(), spec.rights[i].second, error);
+        }
+        for (size_t i = 0; result && i < spec.strings.size(); i++)
+        {
+            result = FlcCapabilityRequestAddVendorDictionaryStringItem(m_licensing, capability, spec.strings[i].first.c_str(), spec.strings[i].second.c_str(), error);
+        }
+        for (size_t i = 0; result && i < spec.integers.size(); i++)
+        {
+            result = FlcCapabilityRequestAddVendorDictionaryIntItem(m_licensing, capability, spec.integers[i].first.c_str(), spec.integers[i].second, error);
+        }
+        for (size_t i = 0; result && i < spec.hosts.size(); i++)
+        {
+            result = FlcCapabilityRequestAddAuxiliaryHostId(m_licensing, capability, (FlcHostIdType)spec.hosts[i].first, spec.hosts[i].second.c_str(), error);
+        }
+
+        if (result && FLC_LICENSE_SERVER_DEFAULT != spec.instance)
+        {
+            result = FlcCapabilityRequestSetServerInstance(m_licensing, capability, (FlcLicenseServerInstance)spec.instance, error);
+        }
+
+        if (result && FLC_CAPABILITY_REQUEST_OPERATION_UNKNOWN != spec.operation)
+        {
+            result = FlcCapabilityRequestSetOperation(m_licensing, capability, spec.operation, error);
+        }
+
+        // regenerated on every submit, see CapabilitySpec::cacheable
+        if (result && spec.correlate)
+        {
+            result = FlcCapabilityRequestGenerateCorrelationId(m_licensing, capability, &generated, error);
+        }
+        else if (result && !spec.correlation.empty())
+        {
+            result = FlcCapabilityRequestSetCorrelationId(m_licensing, capability, spec.correlation.c_str(), error);
+        }
+
+        result = result && FlcCapabilityRequestGenerate(m_licensing, capability, &data, &size, error);
+
+        if (result)
+        {
+            request.assign(data, data + size);
+
+            if (spec.cacheable())
+            {
+                if (m_cache.size() >= EXCHANGE_MAX_CACHED)
+                {
+                    m_cache.clear();
+                }
+
+                Cached&cached = m_cache[hash];
+                cached.key.swap(key);
+                cached.request = request;
+                cached.generated = chrono::steady_clock::now();
+            }
+        }
+        else
+        {
+            message = FlcErrorGetMessage(error);
+        }
+
+        if (data)
+        {
+            FlcMemoryFree(data);
+        }
+        if (capability)
+        {
+            FlcCapabilityRequestDelete(m_licensing, &capability, NULL);
+        }
+        FlcErrorDelete(&error);
+
+        return result;
+    }
+
+    void run()
+    {
+        FlcErrorRef error = 0;
+        FlcErrorCreate(&error);
+
+        unique_lock<mutex> guard(m_lock);
+
+        for (;;)
+        {
+            m_work.wait(guard, [this]{ return m_stop || !m_queue.empty(); });
+            if (m_stop)
+            {
+                break;
+            }
+
+            const unsigned long long ticket = m_queue.front();
+            m_queue.pop_front();
+
+            // map references survive inserts and erases of other tickets
+            Exchange&exchange = m_exchanges[ticket];
+            const string record = m_record;
+
+            guard.unlock();
+
+            send(exchange, error);
+            if (exchange.received && !record.empty())
+            {
+                save(record, ticket, exchange.response);
+            }
+
+            guard.lock();
+
+            exchange.sent = true;
+
+            drain(guard);
+        }
+
+        guard.unlock();
+
+        if (error)
+        {
+            FlcErrorDelete(&error);
+        }
+    }
+
+    void send(Exchange&exchange, FlcErrorRef error)
+    {
+        FlcCommRef comm = error ? comms.acquire(m_server, error) : 0;
+        if (NULL == comm)
+        {
+            exchange.message = error ? FlcErrorGetMessage(error) : "FlcErrorCreate failed";
+            return;
+        }
+
+        void*data = 0;
+        FlcSize size = 0;
+
+        exchange.received = FlcCommSendBinaryMessage(comm, &exchange.request[0], exchange.request.size(), &data, &size, error);
+
+        comms.release(m_server, comm, exchange.received);
+
+        if (exchange.received)
+        {
+            exchange.response.assign((const FlcUInt8*)data, (const FlcUInt8*)data + size);
+        }
+        else
+        {
+            exchange.message = FlcErrorGetMessage(error);
+        }
+
+        if (data)
+        {
+            FlcMemoryFree(data);
+        }
+    }
+
+    /*!
+     * Called with m_lock held. Whoever finds the next ticket in sequence
+     * sent takes over processing until the sequence has a gap again.
+     */
+    void drain(unique_lock<mutex>&guard)
+    {
+        if (m_processing)
+        {
+            return;
+        }
+        m_processing = true;
+
+        for (;;)
+        {
+            map<unsigned long long, Exchange>::iterator next = m_exchanges.find(m_processed + 1);
+            if (next == m_exchanges.end() || !next->second.sent)
+            {
+                break;
+            }
+
+            Exchange&exchange = next->second;
+
+            guard.unlock();
+            process(exchange);
+            const int seconds = exchange.hook ? next_update(exchange.instance) : -1;
+            guard.lock();
+
+            m_processed++;
+
+            if (exchange.hook)
+            {
+                // nobody waits on a refresh, its ticket ends here
+                function<void(int, int)> hook;
+                hook.swap(exchange.hook);
+                const int result = exchange.result;
+
+                m_exchanges.erase(next);
+
+                guard.unlock();
+                hook(result, seconds);
+                guard.lock();
+                continue;
+            }
+
+            exchange.done = true;
+
+            m_done.notify_all();
+        }
+
+        m_processing = false;
+    }
+
+    void process(Exchange&exchange)
+    {
+        if (!exchange.received)
+        {
+            exchange.result = NOVA_FAILED;
+            return;
+        }
+
+        // an empty response means nothing changed since the last one
+        if (exchange.response.empty())
+        {
+            exchange.result = NOVA_OK;
+            return;
+        }
+
+        lock_guard<mutex> guard(m_sdk);
+
+        FlcCapabilityResponseRef response = 0;
+        if (FlcProcessCapabilityResponseData(m_licensing, &response, &exchange.response[0], exchange.response.size(), m_error))
+        {
+            // only a response that changed the features in trusted storage
+            // may change a request; a refresh that renews the same ones
+            // keeps the cache
+            uint64_t storage = 0;
+            if (!storage_fingerprint(storage) || storage != m_storage)
+            {
+                m_cache.clear();
+                m_storage = storage;
+            }
+            m_storage_dictionary.reset();
+
+            FlcDictionaryRef dictionary = 0;
+            FlcCapabilityResponseGetVendorDictionary(response, &dictionary, NULL);
+            m_response_dictionary = CDictionary::snapshot(dictionary);
+
+            FlcUInt32 interval = 0;
+            if (FlcCapabilityResponseGetRenewInterval(response, &interval, NULL))
+            {
+                m_renew_interval = interval;
+            }
+
+            exchange.result = NOVA_OK;
+            FlcCapabilityResponseDelete(m_licensing, &response, NULL);
+            return;
+        }
+
+        exchange.message = FlcErrorGetMessage(m_error);
+
+        switch (FlcErrorGetCode(m_error))
+        {
+        // not applied, but the licensing environment is still sound
+        case FLCERR_RESPONSE_STALE:
+        case FLCERR_RESPONSE_EXPIRED:
+        case FLCERR_PREVIEW_RESPONSE_NOT_PROCESSED:
+            exchange.result = NOVA_OK;
+            break;
+
+        default:
+            exchange.result = NOVA_FAILED;
+            break;
+        }
+    }
+
+    /*!
+     * Hash of the name, version, count and serial number of every feature in
+     * trusted storage, which a renewal leaves as they were; expirations are
+     * left out, a renewal moves them but no request carries them. Called
+     * with m_sdk held.
+     */
+    bool storage_fingerprint(uint64_t&fingerprint)
+    {
+        FlcFeatureCollectionRef features = 0;
+        if (!FlcGetTrustedStorageFeatureCollection(m_licensing, &features, FLC_FALSE, NULL))
+        {
+            return false;
+        }
+
+        FlcSize size = 0;
+        bool result = FlcFeatureCollectionSize(features, &size, NULL);
+
+        stringstream stream;
+        for (FlcSize i = 0; result && i < size; i++)
+        {
+            FlcFeatureRef feature = 0;
+            const FlcChar*name = 0;
+            const FlcChar*version = 0;
+            const FlcChar*serial = 0;
+            FlcInt32 count = 0;
+
+            result = FlcFeatureCollectionGet(features, &feature, i, NULL)
+                && FlcFeatureGetName(feature, &name, NULL)
+                && FlcFeatureGetVersion(feature, &version, NULL)
+                && FlcFeatureGetCount(feature, &count, NULL);
+            if (result)
+            {
+                FlcFeatureGetSerialNumber(feature, &serial, NULL);
+
+                stream << name << '\n' << version << '\n' << count << '\n' << (serial ? serial : "") << '\n';
+            }
+        }
+
+        FlcFeatureCollectionDelete(&features, NULL);
+
+        if (result)
+        {
+            const string fields = stream.str();
+            fingerprint = fnv1a64(fields.data(), fields.size());
+        }
+        return result;
+    }
+
+    static void save(const string&directory, unsigned long long ticket, const vector<FlcUInt8>&response)
+    {
+        char name[32];
+        snprintf(name, sizeof name, "/%012llu.bin", ticket);
+
+        FILE*file = fopen((directory + name).c_str(), "wb");
+        if (file)
+        {
+            if (!response.empty() && 1 != fwrite(&response[0], response.size(), 1, file))
+            {
+                DEBUG_PRINTLN("response record failed");
+            }
+            fclose(file);
+        }
+    }
+};
+
+/*!
+ * Loopback HTTP server answering every POST with the next recorded
+ * response, round robin, after an optional fixed delay
+ */
+class CStandIn
+{
+    mutex m_lock;
+    vector<vector<unsigned char> > m_responses;
+    atomic<size_t> m_served;
+    int m_delay_ms;
+    int m_listen;
+    thread m_acceptor;
+    vector<thread> m_connections;
+    vector<int> m_sockets;
+
+public:
+    CStandIn() : m_served(0), m_delay_ms(0), m_listen(-1)
+    {
+    }
+
+    virtual~CStandIn()
+    {
+        size_t served = 0;
+        stop(served);
+    }
+
+    int start(const string&directory, int port, int delay_ms, int&bound_port)
+    {
+        lock_guard<mutex> guard(m_lock);
+
+        if (m_listen >= 0)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        m_responses.clear();
+        read_files(list_files(directory, ".bin"), [&](const string&, const unsigned char*data, size_t size, int failure)
+        {
+            if (!failure)
+            {
+                m_responses.push_back(vector<unsigned char>(data, data + size));
+            }
+        });
+
+        if (m_responses.empty())
+        {
+            return NOVA_FAILED;
+        }
+
+        const int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listener < 0)
+        {
+            return NOVA_ERROR_SYSTEM;
+        }
+
+        const int on = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+
+        sockaddr_in address;
+        memset(&address, 0, sizeof address);
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons((unsigned short)port);
+
+        socklen_t length = sizeof address;
+        if (bind(listener, (sockaddr*)&address, sizeof address)
+            || listen(listener, 64)
+            || getsockname(listener, (sockaddr*)&address, &length))
+        {
+            close(listener);
+            return NOVA_ERROR_SYSTEM;
+        }
+
+        bound_port = ntohs(address.sin_port);
+
+        m_listen = listener;
+        m_delay_ms = delay_ms;
+        m_served = 0;
+        m_acceptor = thread(&CStandIn::accept_loop, this);
+
+        return NOVA_OK;
+    }
+
+    int stop(size_t&served)
+    {
+        if (m_listen < 0)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        // wakes the acceptor with EINVAL
+        shutdown(m_listen, SHUT_RDWR);
+        m_acceptor.join();
+
+        {
+            lock_guard<mutex> guard(m_lock);
+            for (size_t i = 0; i < m_sockets.size(); i++)
+            {
+                if (m_sockets[i] >= 0)
+                {
+                    shutdown(m_sockets[i], SHUT_RDWR);
+                }
+            }
+        }
+
+        for (size_t i = 0; i < m_connections.size(); i++)
+        {
+            m_connections[i].join();
+        }
+
+        served = m_served.load();
+
+        lock_guard<mutex> guard(m_lock);
+
+        m_connections.clear();
+        m_sockets.clear();
+        close(m_listen);
+        m_listen = -1;
+
+        return NOVA_OK;
+    }
+
+private:
+    void accept_loop()
+    {
+        for (;;)
+        {
+            const int connection = accept4(m_listen, NULL, NULL, SOCK_CLOEXEC);
+            if (connection < 0)
+            {
+                if (EINTR == errno || ECONNABORTED == errno)
+                {
+                    continue;
+                }
+                break;
+            }
+
+            lock_guard<mutex> guard(m_lock);
+            m_sockets.push_back(connection);
+            m_connections.push_back(thread(&CStandIn::serve, this, m_sockets.size() - 1));
+        }
+    }
+
+    void serve(size_t slot)
+    {
+        int connection;
+        {
+            lock_guard<mutex> guard(m_lock);
+            connection = m_sockets[slot];
+        }
+
+        string buffer;
+        char chunk[16384];
+
+        for (bool open = true; open;)
+        {
+            size_t end;
+            while (string::npos == (end = buffer.find("\r\n\r\n")))
+            {
+                const ssize_t got = recv(connection, chunk, sizeof chunk, 0);
+                if (got <= 0)
+                {
+                    open = false;
+                    break;
+                }
+                buffer.append(chunk, got);
+            }
+            if (!open)
+            {
+                break;
+            }
+
+            string header = buffer.substr(0, end);
+            buffer.erase(0, end + 4);
+            transform(header.begin(), header.end(), header.begin(), ::tolower);
+
+            size_t body = 0;
+            const size_t length = header.find("\r\ncontent-length:");
+            if (string::npos != length)
+            {
+                body = strtoul(header.c_str() + length + 17, NULL, 10);
+            }
+
+            // libcurl waits for this before sending larger bodies
+            if (string::npos != header.find("\r\nexpect: 100-continue"))
+            {
+                static const char proceed[] = "HTTP/1.1 100 Continue\r\n\r\n";
+                send(connection, proceed, sizeof proceed - 1, MSG_NOSIGNAL);
+            }
+
+            while (buffer.size() < body)
+            {
+                const ssize_t got = recv(connection, chunk, sizeof chunk, 0);
+                if (got <= 0)
+                {
+                    open = false;
+                    break;
+                }
+                buffer.append(chunk, got);
+            }
+            if (!open)
+            {
+                break;
+            }
+            buffer.erase(0, body);
+
+            if (m_delay_ms > 0)
+            {
+                this_thread::sleep_for(chrono::milliseconds(m_delay_ms));
+            }
+
+            const vector<unsigned char>&response = m_responses[m_served++ % m_responses.size()];
+
+            char status[128];
+            const int status_length = snprintf(status, sizeof status,
+                "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\nContent-Length: %lu\r\n\r\n",
+                (unsigned long)response.size());
+
+            open = send(connection, status, status_length, MSG_NOSIGNAL) == status_length
+                && (response.empty() || send(connection, &response[0], response.size(), MSG_NOSIGNAL) == (ssize_t)response.size())
+                && string::npos == header.find("\r\nconnection: close");
+        }
+
+        lock_guard<mutex> guard(m_lock);
+        close(connection);
+        m_sockets[slot] = -1;
+    }
+} standin;
+
+int exchange_post(nova_exchange*exchange, const CapabilitySpec&spec,
+                  const function<void(int result, int seconds)>&done)
+{
+    return ((CExchange*)exchange)->refresh(spec, done);
+}
+
+int exchange_undo_seconds(nova_exchange*exchange, const string&feature, const string&version)
+{
+    return ((CExchange*)exchange)->undo_seconds(feature, version);
+}
+
+shared_ptr<const CDictionary> exchange_dictionary(nova_exchange*exchange, int source)
+{
+    return ((CExchange*)exchange)->dictionary(source);
+}
+
+int exchange_next_update(nova_exchange*exchange, int instance)
+{
+    return ((CExchange*)exchange)->next_update(instance);
+}
+
+extern "C"
+{
+    int LIB_EXPORT nova_exchange_open(const char*lic, size_t lic_length,
+                                      const char*server, unsigned int depth,
+                                      nova_exchange**exchange)
+    {
+        if ((NULL == lic && lic_length) || NULL == server || 0 == depth || depth > EXCHANGE_MAX_DEPTH || NULL == exchange)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        TraScope scope;
+
+        CExchange*engine = new CExchange(tra.node(), server);
+
+        const int result = engine->open(lic ? string(lic, lic_length) : string(), depth);
+        if (NOVA_OK != result)
+        {
+            DEBUG_PRINT("### exchange open %s\n", engine->message());
+            delete engine;
+            return result;
+        }
+
+        *exchange = (nova_exchange*)engine;
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_exchange_record(nova_exchange*exchange, const char*dir, size_t dir_length)
+    {
+        if (NULL == exchange || (NULL == dir && dir_length))
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        ((CExchange*)exchange)->record(dir ? string(dir, dir_length) : string());
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_request_create(nova_request**request)
+    {
+        if (NULL == request)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        *request = (nova_request*)new CapabilitySpec();
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_request_add_feature(nova_request*request, const char*feature, const char*version, int count)
+    {
+        if (NULL == request || NULL == feature || NULL == version)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        CapabilitySpec::Feature desired;
+        desired.name = feature;
+        desired.version = version;
+        desired.count = count;
+        ((CapabilitySpec*)request)->features.push_back(desired);
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_request_add_rights_id(nova_request*request, const char*rights_id, int count)
+    {
+        if (NULL == request || NULL == rights_id)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        ((CapabilitySpec*)request)->rights.push_back(make_pair(string(rights_id), count));
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_request_add_dictionary_string(nova_request*request, const char*key, const char*value)
+    {
+        if (NULL == request || NULL == key || NULL == value)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        ((CapabilitySpec*)request)->strings.push_back(make_pair(string(key), string(value)));
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_request_add_dictionary_int(nova_request*request, const char*key, int value)
+    {
+        if (NULL == request || NULL == key)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        ((CapabilitySpec*)request)->integers.push_back(make_pair(string(key), value));
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_request_add_host_id(nova_request*request, int type, const char*id)
+    {
+        if (NULL == request || NULL == id)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        ((CapabilitySpec*)request)->hosts.push_back(make_pair(type, string(id)));
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_request_set_operation(nova_request*request, int operation)
+    {
+        if (NULL == request)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        ((CapabilitySpec*)request)->operation = operation;
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_request_set_server_instance(nova_request*request, int instance)
+    {
+        if (NULL == request || instance < FLC_LICENSE_SERVER_DEFAULT || instance > FLC_LICENSE_SERVER_MAX)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        ((CapabilitySpec*)request)->instance = instance;
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_request_set_correlation_id(nova_request*request, const char*correlation_id)
+    {
+        if (NULL == request)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        CapabilitySpec&spec = *(CapabilitySpec*)request;
+        spec.correlate = NULL == correlation_id;
+        spec.correlation = correlation_id ? correlation_id : "";
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_request_delete(nova_request*request)
+    {
+        if (NULL == request)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        delete (CapabilitySpec*)request;
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_exchange_submit(nova_exchange*exchange,
+                                        const char*feature, const char*version, int count,
+                                        unsigned long long*ticket)
+    {
+        if (NULL == exchange || NULL == ticket || (NULL != feature && NULL == version))
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        CapabilitySpec spec;
+        if (feature)
+        {
+            CapabilitySpec::Feature desired;
+            desired.name = feature;
+            desired.version = version;
+            desired.count = count;
+            spec.features.push_back(desired);
+        }
+
+        string message;
+        const int result = ((CExchange*)exchange)->submit(spec, *ticket, message);
+        if (NOVA_OK != result)
+        {
+            DEBUG_PRINT("### exchange submit %s\n", message.c_str());
+        }
+        return result;
+    }
+
+    int LIB_EXPORT nova_exchange_submit_request(nova_exchange*exchange, const nova_request*request,
+                                                unsigned long long*ticket)
+    {
+        if (NULL == exchange || NULL == request || NULL == ticket)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        string message;
+        const int result = ((CExchange*)exchange)->submit(*(const CapabilitySpec*)request, *ticket, message);
+        if (NOVA_OK != result)
+        {
+            DEBUG_PRINT("### exchange submit %s\n", message.c_str());
+        }
+        return result;
+    }
+
+    int LIB_EXPORT nova_exchange_wait(nova_exchange*exchange, unsigned long long ticket, int timeout_ms,
+                                      char*out_message, size_t*message_length)
+    {
+        if (NULL == exchange || NULL == message_length)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        return ((CExchange*)exchange)->wait(ticket, timeout_ms, out_message, message_length);
+    }
+
+    int LIB_EXPORT nova_exchange_close(nova_exchange*exchange)
+    {
+        if (NULL == exchange)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        refresh_forget(exchange);
+
+        TraScope scope;
+
+        delete (CExchange*)exchange;
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_standin_start(const char*dir, size_t dir_length, int port, int delay_ms, int*bound_port)
+    {
+        if (NULL == dir || port < 0 || port > 65535 || NULL == bound_port)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        return standin.start(string(dir, dir_length), port, delay_ms, *bound_port);
+    }
+
+    int LIB_EXPORT nova_standin_stop(unsigned int*served)
+    {
+        size_t count = 0;
+
+        const int result = standin.stop(count);
+        if (NOVA_OK == result && served)
+        {
+            *served = (unsigned int)count;
+        }
+        return result;
+    }
+
+    bool LIB_EXPORT TestExchange(const string&licenseFilePath, const string&responses, stringstream&stream)
+    {
+        const int requests = 200;
+        const unsigned int depths[] = { 1, 4, 16 };
+
+        int port = 0;
+        if (NOVA_OK != standin.start(responses, 0, 2, port))
+        {
+            stream << "no recorded responses in " << responses << std::endl;
+            return false;
+        }
+
+        char server[64];
+        snprintf(server, sizeof server, "http://127.0.0.1:%d/request", port);
+
+        bool result = true;
+
+        for (size_t d = 0; d < sizeof depths / sizeof depths[0]; d++)
+        {
+            nova_exchange*exchange = 0;
+            if (NOVA_OK != nova_exchange_open(licenseFilePath.c_str(), licenseFilePath.size(), server, depths[d], &exchange))
+            {
+                stream << "exchange open failed" << std::endl;
+                result = false;
+                break;
+            }
+
+            CExchange&engine = *(CExchange*)exchange;
+
+            vector<unsigned long long> tickets(requests);
+            vector<chrono::steady_clock::time_point> submitted(requests);
+            vector<double> latency;
+
+            const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+            int failed = 0;
+            string message;
+            for (int i = 0; i < requests; i++)
+            {
+                submitted[i] = chrono::steady_clock::now();
+                if (NOVA_OK != engine.submit(CapabilitySpec(), tickets[i], message))
+                {
+                    tickets[i] = 0;
+                    failed++;
+                }
+            }
+
+            // responses complete in ticket order, so waiting in order measures each one
+            for (int i = 0; i < requests; i++)
+            {
+                if (tickets[i])
+                {
+                    char reason[256];
+                    size_t reason_length = sizeof reason;
+                    if (NOVA_OK != engine.wait(tickets[i], -1, reason, &reason_length))
+                    {
+                        message.assign(reason, reason_length < sizeof reason ? reason_length : 0);
+                        failed++;
+                    }
+                    const chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - submitted[i];
+                    latency.push_back(elapsed.count());
+                }
+            }
+
+            const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+            unsigned long long hits = 0, misses = 0;
+            engine.cache_statistics(hits, misses);
+
+            nova_exchange_close(exchange);
+
+            sort(latency.begin(), latency.end());
+
+            stream << "depth " << depths[d] << ": "
+                   << (long)(elapsed.count() > 0 ? requests / elapsed.count() : 0) << " exchanges/s";
+            if (!latency.empty())
+            {
+                stream << ", p50 " << latency[latency.size() / 2] << " ms"
+                       << ", p99 " << latency[latency.size() * 99 / 100] << " ms";
+            }
+            stream << ", requests cached " << hits << "/" << (hits + misses);
+            if (failed)
+            {
+                stream << ", failures " << failed << " (" << message << ")";
+            }
+            stream << std::endl;
+
+            result = result && 0 == failed;
+        }
+
+        size_t served = 0;
+        standin.stop(served);
+        stream << "stand-in served " << served << std::endl;
+
+        return result;
+    }
+}
+/* extern c */
@@ -0,0 +1,501 @@
+/*
+ * File:   Nova.Host.cpp
+ * Author: jools
+ *
+ * Process-wide cache of the host identity.
+ *
+ * FlcGetHostIds, FlcGetDefaultHostId, the virtual machine queries and
+ * FlcIsContainerized walk the network interfaces, DMI tables and hypervisor
+ * interfaces of the machine, and every new licensing environment would do
+ * so again. Here the first environment created is probed once and the
+ * result is kept; every environment handed out after it is given the cached
+ * default host ID, and on physical machines VM detection is switched off, so
+ * taking an environment does no hardware probing. A netlink socket
+ * subscribed to link events marks the cache stale when an interface
+ * appears, disappears or changes, and the next environment handed out is
+ * then created afresh and probed again rather than taken from the pool.
+ */
+
+#include "Nova.Internal.h"
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "Nova.Abi.h"
+
+using namespace std;
+
+#include "FlcLicenseManager.h"
+#include "FlcHostIds.h"
+#include "FlcMachineType.h"
+#include "FlcDictionary.h"
+
+class CHost
+{
+    /*!
+     * The link watcher thread and its two descriptors, held together so a
+     * fork child can abandon the thread (see release)
+     */
+    struct Watcher
+    {
+        int netlink;
+        int stop;
+        thread runner;
+
+        Watcher(int netlink, int stop) : netlink(netlink), stop(stop)
+        {
+        }
+
+        virtual~Watcher()
+        {
+            close(netlink);
+            close(stop);
+        }
+    };
+
+    mutex m_lock;
+    atomic<unsigned long long> m_generation;
+    bool m_stale;
+    bool m_probed;
+
+    vector<pair<int, string> > m_ids;
+    FlcHostIdType m_default_type;
+    string m_default_id;
+    bool m_has_default;
+    FlcMachineType m_machine;
+    vector<pair<string, string> > m_vm_info;
+    bool m_containerized;
+
+    Watcher*m_watcher;
+    bool m_unwatched;
+
+public:
+    CHost() : m_generation(0), m_stale(true), m_probed(false), m_default_type(FLC_HOSTID_TYPE_UNKNOWN)
+        , m_has_default(false), m_machine(FLC_MACHINE_TYPE_UNKNOWN), m_containerized(false), m_watcher(NULL)
+        , m_unwatched(false)
+    {
+    }
+
+    virtual~CHost()
+    {
+        if (NULL == m_watcher)
+        {
+            return;
+        }
+
+        const uint64_t one = 1;
+        if (sizeof one != write(m_watcher->stop, &one, sizeof one))
+        {
+            // still polling its descriptors, so they stay open
+            m_watcher->runner.detach();
+            return;
+        }
+
+        m_watcher->runner.join();
+        delete m_watcher;
+    }
+
+    unsigned long long generation()
+    {
+        return m_generation.load(memory_order_acquire);
+    }
+
+    void invalidate()
+    {
+        lock_guard<mutex> guard(m_lock);
+        m_stale = true;
+    }
+
+    bool stale()
+    {
+        lock_guard<mutex> guard(m_lock);
+        return m_stale;
+    }
+
+    /*!
+     * Probe with a fresh licensing environment if the cache is stale, then
+     * give licensing the cached identity. Returns the generation applied.
+     */
+    unsigned long long prepare(FlcLicensingRef licensing, bool fresh, FlcHostIdType*type, string*id)
+    {
+        lock_guard<mutex> guard(m_lock);
+
+        // a used environment has the old identity set, or detection off
+        if (m_stale && fresh)
+        {
+            probe(licensing);
+
+            m_stale = false;
+            m_probed = true;
+            m_generation.fetch_add(1, memory_order_release);
+        }
+
+        watch();
+
+        if (m_has_default)
+        {
+            FlcSetDefaultHostId(licensing, m_default_type, m_default_id.c_str(), NULL);
+        }
+        if (FLC_MACHINE_TYPE_VIRTUAL != m_machine)
+        {
+            FlcSetVmDetectionEnabled(licensing, FLC_FALSE, NULL);
+        }
+
+        if (type && id)
+        {
+            *type = m_has_default ? m_default_type : FLC_HOSTID_TYPE_UNKNOWN;
+            *id = m_default_id;
+        }
+        return m_generation.load(memory_order_relaxed);
+    }
+
+    bool probed()
+    {
+        lock_guard<mutex> guard(m_lock);
+        return m_probed;
+    }
+
+    /*!
+     * "<type> <value>" lines, the default host ID first
+     */
+    string ids()
+    {
+        lock_guard<mutex> guard(m_lock);
+
+        stringstream stream;
+        if (m_has_default)
+        {
+            stream << m_default_type << ' ' << m_default_id << '\n';
+        }
+        for (size_t i = 0; i < m_ids.size(); i++)
+        {
+            stream << m_ids[i].first << ' ' << m_ids[i].second << '\n';
+        }
+        return stream.str();
+    }
+
+    /*!
+     * "key=value" lines of the virtual machine information
+     */
+    string machine(int&type, int&containerized)
+    {
+        lock_guard<mutex> guard(m_lock);
+
+        type = m_machine;
+        containerized = m_containerized ? 1 : 0;
+
+        stringstream stream;
+        for (size_t i = 0; i < m_vm_info.size(); i++)
+        {
+            stream << m_vm_info[i].first << '=' << m_vm_info[i].second << '\n';
+        }
+        return stream.str();
+    }
+
+    void fork_prepare()
+    {
+        m_lock.lock();
+    }
+
+    void fork_parent()
+    {
+        m_lock.unlock();
+    }
+
+    /*!
+     * The cached identity is the parent's machine and stays. The watcher is
+     * gone and its socket belongs to the parent, so the next prepare starts
+     * a watcher of the child's own.
+     */
+    void fork_child()
+    {
+        release();
+
+        m_lock.unlock();
+    }
+
+private:
+    /*!
+     * Abandons the watcher in a fork child, where its thread is gone and can
+     * be neither joined nor detached, so the Watcher is leaked once per
+     * fork. Its descriptors are the child's copies of the parent's and are
+     * closed; the next watch() starts a fresh one.
+     */
+    void release()
+    {
+        if (m_watcher)
+        {
+            close(m_watcher->netlink);
+            close(m_watcher->stop);
+            m_watcher = NULL;
+        }
+    }
+
+    /*!
+     * Called with m_lock held. What could not be read is left empty rather
+     * than failing the environment that triggered the probe.
+     */
+    void probe(FlcLicensingRef licensing)
+    {
+        m_ids.clear();
+        m_vm_info.clear();
+
+        FlcHostIdsRef ids = 0;
+        if (FlcGetHostIds(licensing, &ids, NULL) && ids)
+        {
+            FlcUInt32 count = 0;
+            FlcHostIdsGetIdCount(ids, &count, NULL);
+
+            for (FlcUInt32 i = 0; i < count; i++)
+            {
+                FlcInt32 type = 0;
+                const FlcChar*value = 0;
+                if (FlcHostIdsGetId(ids, i, &type, &value, NULL) && value)
+                {
+                    m_ids.push_back(make_pair((int)type, string(value)));
+                }
+            }
+            FlcHostIdsDelete(&ids, NULL);
+        }
+
+        const FlcChar*value = 0;
+        m_has_default = FlcGetDefaultHostId(licensing, &m_default_type, &value, NULL) && value;
+        m_default_id = m_has_default ? value : "";
+
+        m_machine = FLC_MACHINE_TYPE_UNKNOWN;
+        FlcGetVirtualMachineType(licensing, &m_machine, NULL);
+
+        FlcDictionaryRef info = 0;
+        if (FLC_MACHINE_TYPE_VIRTUAL == m_machine && FlcGetVirtualMachineInfo(licensing, &info, NULL) && info)
+        {
+            FlcUInt32 size = 0;
+            FlcDictionaryGetSize(info, &size, NULL);
+
+            for (FlcUInt32 i = 0; i < size; i++)
+            {
+                FlcDictionaryValueType type = FLC_DICTIONARY_UNKNOWN_VALUE;
+                const FlcChar*key = 0;
+                if (!FlcDictionaryGetValueType(info, i, &type, NULL))
+                {
+                    continue;
+                }
+
+                if (FLC_DICTIONARY_STR_VALUE == type)
+                {
+                    const FlcChar*text = 0;
+                    if (FlcDictionaryGetStringItem(info, i, &key, &text, NULL) && key && text)
+                    {
+                        m_vm_info.push_back(make_pair(string(key), string(text)));
+                    }
+                }
+                else if (FLC_DICTIONARY_INT_VALUE == type)
+                {
+                    FlcInt32 number = 0;
+                    if (FlcDictionaryGetIntItem(info, i, &key, &number, NULL) && key)
+                    {
+                        m_vm_info.push_back(make_pair(string(key), to_string(number)));
+                    }
+                }
+            }
+            // owned by the licensing environment
+        }
+
+        FlcBool containerized = FLC_FALSE;
+        FlcIsContainerized(licensing, &containerized, NULL);
+        m_containerized = FLC_TRUE == containerized;
+    }
+
+    /*!
+     * Called with m_lock held. Starts the link watcher once; without
+     * netlink the cache only changes on nova_host_refresh.
+     */
+    void watch()
+    {
+        if (m_watcher || m_unwatched)
+        {
+            return;
+        }
+
+        const int netlink = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+        const int stop = eventfd(0, EFD_CLOEXEC);
+
+        sockaddr_nl address = sockaddr_nl();
+        address.nl_family = AF_NETLINK;
+        address.nl_groups = RTMGRP_LINK;
+
+        if (netlink < 0 || stop < 0 || bind(netlink, (sockaddr*)&address, sizeof address) < 0)
+        {
+            DEBUG_PRINTLN("netlink unavailable");
+            m_unwatched = true;
+            if (netlink >= 0)
+            {
+                close(netlink);
+            }
+            if (stop >= 0)
+            {
+                close(stop);
+            }
+            return;
+        }
+
+        m_watcher = new Watcher(netlink, stop);
+        m_watcher->runner = thread(&CHost::run, this, netlink, stop);
+    }
+
+    void run(int netlink, int stop)
+    {
+        alignas(nlmsghdr) char buffer[8192];
+
+        pollfd fds[2];
+        fds[0].fd = netlink;
+        fds[0].events = POLLIN;
+        fds[1].fd = stop;
+        fds[1].events = POLLIN;
+
+        for (;;)
+        {
+            if (poll(fds, 2, -1) < 0)
+            {
+                if (EINTR == errno)
+                {
+                    continue;
+                }
+                return;
+            }
+
+            if (fds[1].revents)
+            {
+                return;
+            }
+
+            const ssize_t length = recv(netlink, buffer, sizeof buffer, 0);
+            if (length < 0)
+            {
+                // ENOBUFS: events were dropped, so assume the worst
+                if (ENOBUFS == errno)
+                {
+                    invalidate();
+                }
+                continue;
+            }
+
+            bool changed = false;
+            int remaining = (int)length;
+            for (const nlmsghdr*message = (const nlmsghdr*)buffer; NLMSG_OK(message, remaining); message = NLMSG_NEXT(message, remaining))
+            {
+                changed = changed || RTM_NEWLINK == message->nlmsg_type || RTM_DELLINK == message->nlmsg_type;
+            }
+
+            if (changed)
+            {
+                DEBUG_PRINTLN("link changed, host identity stale");
+                invalidate();
+            }
+        }
+    }
+} host;
+
+static void on_fork_prepare()
+{
+    host.fork_prepare();
+}
+
+static void on_fork_parent()
+{
+    host.fork_parent();
+}
+
+static void on_fork_child()
+{
+    host.fork_child();
+}
+
+static const int host_fork = pthread_atfork(on_fork_prepare, on_fork_parent, on_fork_child);
+
+unsigned long long host_generation()
+{
+    return host.generation();
+}
+
+bool host_stale()
+{
+    return host.stale();
+}
+
+unsigned long long host_prepare(FlcLicensingRef licensing, bool fresh, FlcHostIdType*type, string*id)
+{
+    return host.prepare(licensing, fresh, type, id);
+}
+
+/*!
+ * Probe now through an environment from the pool of the caller's node
+ */
+static int host_probe()
+{
+    host.invalidate();
+
+    TraScope scope;
+
+    FlcLicensingRef licensing = 0;
+    const int node = tra.node();
+    if (!create_licensing(node, &licensing, NULL))
+    {
+        return NOVA_FAILED;
+    }
+
+    tra.release_licensing(node, &licensing);
+    return NOVA_OK;
+}
+
+extern "C"
+{
+    int LIB_EXPORT nova_host_refresh(void)
+    {
+        return host_probe();
+    }
+
+    int LIB_EXPORT nova_host_ids(char*out, size_t*out_length)
+    {
+        if (NULL == out_length)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        if (!host.probed() && NOVA_OK != host_probe())
+        {
+            return NOVA_FAILED;
+        }
+
+        return copy_out(host.ids(), out, out_length);
+    }
+
+    int LIB_EXPORT nova_host_machine(int*machine_type, int*containerized,
+                                     char*out_vm_info, size_t*vm_info_length)
+    {
+        if (NULL == machine_type || NULL == containerized || NULL == vm_info_length)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        if (!host.probed() && NOVA_OK != host_probe())
+        {
+            return NOVA_FAILED;
+        }
+
+        return copy_out(host.machine(*machine_type, *containerized), out_vm_info, vm_info_length);
+    }
+}
+/* extern c */
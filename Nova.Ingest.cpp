@@ -0,0 +1,708 @@
+/*
+ * File:   Nova.Ingest.cpp
+ * Author: jools
+ *
+ * Batched ingestion of large license directories.
+ *
+ * Reading tens of thousands of .lic files one blocking open/read/close at a
+ * time spends most of its life waiting on syscall round trips. Here opens,
+ * stats, reads and closes for a window of files are submitted together
+ * through io_uring and each completed buffer is handed straight to the SDK
+ * (FlcAddBufferLicenseSourceFromData / FlcGetFeatureCollectionFromData)
+ * while the rest of the window is still in flight. Hosts without io_uring
+ * (old kernels, seccomp filtered containers) fall back to a thread pool.
+ */
+
+#include "Nova.Internal.h"
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "Nova.Abi.h"
+
+using namespace std;
+
+#include "FlcLicenseManager.h"
+#include "FlcFeature.h"
+
+// files in flight at once, each needs up to two submission entries
+static const unsigned int INGEST_WINDOW = 64;
+
+// buffers a fallback worker may read ahead of the consumer
+static const size_t INGEST_READ_AHEAD = 64;
+
+/*!
+ * Minimal io_uring built on the raw syscalls so no liburing is needed
+ */
+class CUring
+{
+    int m_fd;
+    void*m_sq_ring;
+    size_t m_sq_size;
+    void*m_cq_ring;
+    size_t m_cq_size;
+    io_uring_sqe*m_sqes;
+    size_t m_sqes_size;
+
+    unsigned*m_sq_head;
+    unsigned*m_sq_tail;
+    unsigned*m_sq_mask;
+    unsigned*m_sq_array;
+    unsigned m_sq_entries;
+
+    unsigned*m_cq_head;
+    unsigned*m_cq_tail;
+    unsigned*m_cq_mask;
+    io_uring_cqe*m_cqes;
+
+    // tail including entries not yet published, and entries the kernel has not taken
+    unsigned m_tail;
+    unsigned m_queued;
+
+public:
+    explicit CUring(unsigned entries)
+        : m_fd(-1), m_sq_ring(MAP_FAILED), m_sq_size(0), m_cq_ring(MAP_FAILED), m_cq_size(0)
+        , m_sqes((io_uring_sqe*)MAP_FAILED), m_sqes_size(0), m_sq_entries(0), m_tail(0), m_queued(0)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof params);
+
+        m_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (m_fd < 0)
+        {
+            return;
+        }
+
+        m_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            m_sq_size = m_cq_size = max(m_sq_size, m_cq_size);
+        }
+
+        m_sq_ring = mmap(0, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+        if (MAP_FAILED == m_sq_ring)
+        {
+            return;
+        }
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            m_cq_ring = m_sq_ring;
+        }
+        else
+        {
+            m_cq_ring = mmap(0, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+            if (MAP_FAILED == m_cq_ring)
+            {
+                return;
+            }
+        }
+
+        m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        m_sqes = (io_uring_sqe*)mmap(0, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+        if (MAP_FAILED == (void*)m_sqes)
+        {
+            return;
+        }
+
+        char*sq = (char*)m_sq_ring;
+        m_sq_head = (unsigned*)(sq + params.sq_off.head);
+        m_sq_tail = (unsigned*)(sq + params.sq_off.tail);
+        m_sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+        m_sq_array = (unsigned*)(sq + params.sq_off.array);
+        m_sq_entries = params.sq_entries;
+        m_tail = *m_sq_tail;
+
+        char*cq = (char*)m_cq_ring;
+        m_cq_head = (unsigned*)(cq + params.cq_off.head);
+        m_cq_tail = (unsigned*)(cq + params.cq_off.tail);
+        m_cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+        m_cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+    }
+
+    virtual~CUring()
+    {
+        if (MAP_FAILED != (void*)m_sqes)
+        {
+            munmap(m_sqes, m_sqes_size);
+        }
+        if (MAP_FAILED != m_cq_ring && m_cq_ring != m_sq_ring)
+        {
+            munmap(m_cq_ring, m_cq_size);
+        }
+        if (MAP_FAILED != m_sq_ring)
+        {
+            munmap(m_sq_ring, m_sq_size);
+        }
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+        }
+    }
+
+    /*!
+     * Ring is mapped and the kernel knows every opcode the reader needs
+     */
+    bool valid()
+    {
+        if (MAP_FAILED == (void*)m_sqes)
+        {
+            return false;
+        }
+
+        const size_t size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+        vector<unsigned char> buffer(size);
+        io_uring_probe*probe = (io_uring_probe*)&buffer[0];
+
+        if (0 != syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_PROBE, probe, 256))
+        {
+            return false;
+        }
+
+        const unsigned char needed[] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_CLOSE };
+        for (size_t i = 0; i < sizeof needed; i++)
+        {
+            if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /*!
+     * Next free submission entry, zeroed, or NULL when the ring is full
+     */
+    io_uring_sqe* next()
+    {
+        const unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+        if (m_tail - head >= m_sq_entries)
+        {
+            return NULL;
+        }
+
+        const unsigned index = m_tail & *m_sq_mask;
+        m_sq_array[index] = index;
+        m_tail++;
+        m_queued++;
+
+        io_uring_sqe*sqe = &m_sqes[index];
+        memset(sqe, 0, sizeof *sqe);
+        return sqe;
+    }
+
+    /*!
+     * Publish queued entries, submit them and wait for at least one
+     * completion. Entries the kernel did not take, after EAGAIN, EBUSY or a
+     * short submit, stay queued for the next call.
+     */
+    int submit_and_wait(bool wait)
+    {
+        __atomic_store_n(m_sq_tail, m_tail, __ATOMIC_RELEASE);
+
+        int result;
+        do
+        {
+            result = (int)syscall(__NR_io_uring_enter, m_fd, m_queued, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+            if (result > 0)
+            {
+                m_queued -= min((unsigned)result, m_queued);
+            }
+        }
+        while ((result < 0 && EINTR == errno) || (result > 0 && m_queued > 0));
+
+        return result;
+    }
+
+    bool peek(io_uring_cqe&cqe)
+    {
+        const unsigned head = *m_cq_head;
+        if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+        {
+            return false;
+        }
+
+        cqe = m_cqes[head & *m_cq_mask];
+        __atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+};
+
+typedef function<void(const string&, const unsigned char*, size_t, int)> IngestSink;
+
+/*!
+ * One file moving through open+statx -> read... -> close
+ */
+struct IngestItem
+{
+    enum { OPEN, STATX, READ, CLOSE };
+
+    const string*path;
+    int fd;
+    int error;
+    int waiting;
+    size_t done;
+    struct statx stat;
+    vector<unsigned char> data;
+};
+
+static size_t read_files_uring(CUring&ring, const vector<string>&paths, const IngestSink&sink)
+{
+    vector<IngestItem> items(min<size_t>(INGEST_WINDOW, paths.size()));
+    vector<size_t> free_slots;
+    for (size_t i = items.size(); i > 0; i--)
+    {
+        free_slots.push_back(i - 1);
+    }
+
+    size_t next = 0;
+    size_t delivered = 0;
+    size_t succeeded = 0;
+    size_t outstanding = 0;
+
+    // helpers below never fail for want of entries: the ring holds
+    // four per window slot and a slot has at most two in flight
+    auto queue_read = [&](size_t slot)
+    {
+        IngestItem&item = items[slot];
+        io_uring_sqe*sqe = ring.next();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = item.fd;
+        sqe->addr = (unsigned long long)(&item.data[0] + item.done);
+        sqe->len = (unsigned)(item.data.size() - item.done);
+        sqe->off = item.done;
+        sqe->user_data = slot * 4 + IngestItem::READ;
+        outstanding++;
+    };
+
+    auto finish = [&](size_t slot)
+    {
+        IngestItem&item = items[slot];
+        if (item.fd >= 0)
+        {
+            io_uring_sqe*sqe = ring.next();
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = item.fd;
+            sqe->user_data = slot * 4 + IngestItem::CLOSE;
+            outstanding++;
+            item.fd = -1;
+        }
+
+        sink(*item.path, item.data.empty() ? NULL : &item.data[0], item.done, item.error);
+        if (0 == item.error)
+        {
+            succeeded++;
+        }
+        delivered++;
+
+        vector<unsigned char>().swap(item.data);
+        free_slots.push_back(slot);
+    };
+
+    while (delivered < paths.size())
+    {
+        while (next < paths.size() && !free_slots.empty())
+        {
+            const size_t slot = free_slots.back();
+            free_slots.pop_back();
+
+            IngestItem&item = items[slot];
+            item.path = &paths[next++];
+            item.fd = -1;
+            item.error = 0;
+            item.waiting = 2;
+            item.done = 0;
+
+            io_uring_sqe*sqe = ring.next();
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (unsigned long long)item.path->c_str();
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+            sqe->user_data = slot * 4 + IngestItem::OPEN;
+
+            sqe = ring.next();
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (unsigned long long)item.path->c_str();
+            sqe->len = STATX_SIZE;
+            sqe->off = (unsigned long long)&item.stat;
+            sqe->user_data = slot * 4 + IngestItem::STATX;
+
+            outstanding += 2;
+        }
+
+        // on EAGAIN or EBUSY the entries stay queued; reap completions to make room
+        if (ring.submit_and_wait(outstanding > 0) < 0 && EAGAIN != errno && EBUSY != errno)
+        {
+            // the ring is unusable: report everything not yet delivered
+            const int failure = errno;
+            for (size_t slot = 0; slot < items.size(); slot++)
+            {
+                if (find(free_slots.begin(), free_slots.end(), slot) == free_slots.end())
+                {
+                    if (items[slot].fd >= 0)
+                    {
+                        close(items[slot].fd);
+                    }
+                    sink(*items[slot].path, NULL, 0, failure);
+                }
+            }
+            for (; next < paths.size(); next++)
+            {
+                sink(paths[next], NULL, 0, failure);
+            }
+            return succeeded;
+        }
+
+        io_uring_cqe cqe;
+        while (ring.peek(cqe))
+        {
+            outstanding--;
+
+            const size_t slot = (size_t)(cqe.user_data / 4);
+            const int operation = (int)(cqe.user_data % 4);
+            IngestItem&item = items[slot];
+
+            switch (operation)
+            {
+            case IngestItem::OPEN:
+            case IngestItem::STATX:
+                if (cqe.res < 0)
+                {
+                    item.error = -cqe.res;
+                }
+                else if (IngestItem::OPEN == operation)
+                {
+                    item.fd = cqe.res;
+                }
+
+                if (0 == --item.waiting)
+                {
+                    if (item.error || 0 == item.stat.stx_size)
+                    {
+                        finish(slot);
+                    }
+                    else
+                    {
+                        item.data.resize((size_t)item.stat.stx_size);
+                        queue_read(slot);
+                    }
+                }
+                break;
+
+            case IngestItem::READ:
+                if (cqe.res < 0)
+                {
+                    item.error = -cqe.res;
+                    finish(slot);
+                }
+                else if (0 == cqe.res || item.done + cqe.res >= item.data.size())
+                {
+                    // a short final read means the file shrank under us
+                    item.done += cqe.res;
+                    finish(slot);
+                }
+                else
+                {
+                    item.done += cqe.res;
+                    queue_read(slot);
+                }
+                break;
+
+            default:
+                break;
+            }
+        }
+    }
+
+    // drain the trailing closes
+    while (outstanding > 0)
+    {
+        if (ring.submit_and_wait(true) < 0 && EAGAIN != errno && EBUSY != errno)
+        {
+            break;
+        }
+
+        io_uring_cqe cqe;
+        while (ring.peek(cqe))
+        {
+            outstanding--;
+        }
+    }
+
+    return succeeded;
+}
+
+/*!
+ * Blocking read of a whole file, used by the fallback pool
+ */
+static int read_file(const string&path, vector<unsigned char>&data)
+{
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return errno;
+    }
+
+    int error = 0;
+    struct stat info;
+    if (0 != fstat(fd, &info))
+    {
+        error = errno;
+    }
+    else
+    {
+        data.resize((size_t)info.st_size);
+
+        size_t done = 0;
+        while (done < data.size())
+        {
+            const ssize_t count = read(fd, &data[done], data.size() - done);
+            if (count < 0 && EINTR == errno)
+            {
+                continue;
+            }
+            if (count < 0)
+            {
+                error = errno;
+                break;
+            }
+            if (0 == count)
+            {
+                break;
+            }
+            done += (size_t)count;
+        }
+        data.resize(done);
+    }
+
+    close(fd);
+    return error;
+}
+
+static size_t read_files_pool(const vector<string>&paths, const IngestSink&sink)
+{
+    struct Result
+    {
+        size_t index;
+        int error;
+        vector<unsigned char> data;
+    };
+
+    mutex lock;
+    condition_variable ready;
+    condition_variable space;
+    deque<Result> results;
+    atomic<size_t> next(0);
+
+    const unsigned int cores = thread::hardware_concurrency();
+    const unsigned int count = min<size_t>(paths.size(), cores < 2 ? 2 : cores > 8 ? 8 : cores);
+
+    vector<thread> workers;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        workers.push_back(thread([&]
+        {
+            for (size_t index = next++; index < paths.size(); index = next++)
+            {
+                Result result;
+                result.index = index;
+                result.error = read_file(paths[index], result.data);
+
+                unique_lock<mutex> guard(lock);
+                space.wait(guard, [&]{ return results.size() < INGEST_READ_AHEAD; });
+                results.push_back(Result());
+                results.back().index = result.index;
+                results.back().error = result.error;
+                results.back().data.swap(result.data);
+                ready.notify_one();
+            }
+        }));
+    }
+
+    size_t succeeded = 0;
+    for (size_t delivered = 0; delivered < paths.size(); delivered++)
+    {
+        Result result;
+        {
+            unique_lock<mutex> guard(lock);
+            ready.wait(guard, [&]{ return !results.empty(); });
+            result.index = results.front().index;
+            result.error = results.front().error;
+            result.data.swap(results.front().data);
+            results.pop_front();
+            space.notify_one();
+        }
+
+        sink(paths[result.index], result.data.empty() ? NULL : &result.data[0], result.data.size(), result.error);
+        if (0 == result.error)
+        {
+            succeeded++;
+        }
+    }
+
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+
+    return succeeded;
+}
+
+size_t read_files(const vector<string>&paths, const IngestSink&sink)
+{
+    if (paths.empty())
+    {
+        return 0;
+    }
+
+    CUring ring(INGEST_WINDOW * 4);
+    if (ring.valid())
+    {
+        DEBUG_PRINTLN("read_files io_uring");
+        return read_files_uring(ring, paths, sink);
+    }
+
+    DEBUG_PRINTLN("read_files thread pool");
+    return read_files_pool(paths, sink);
+}
+
+vector<string> list_licenses(const string&directory)
+{
+    return list_files(directory, ".lic");
+}
+
+vector<string> list_files(const string&directory, const char*suffix)
+{
+    vector<string> paths;
+    const size_t suffix_length = strlen(suffix);
+
+    DIR*dir = opendir(directory.c_str());
+    if (dir)
+    {
+        const string prefix = directory.empty() || '/' == directory[directory.size() - 1] ? directory : directory + "/";
+
+        for (dirent*entry = readdir(dir); entry; entry = readdir(dir))
+        {
+            const size_t length = strlen(entry->d_name);
+            if (length > suffix_length && 0 == strcmp(entry->d_name + length - suffix_length, suffix))
+            {
+                paths.push_back(prefix + entry->d_name);
+            }
+        }
+        closedir(dir);
+
+        sort(paths.begin(), paths.end());
+    }
+    return paths;
+}
+
+bool is_directory(const string&path)
+{
+    struct stat info;
+    return 0 == stat(path.c_str(), &info) && S_ISDIR(info.st_mode);
+}
+
+extern "C"
+{
+    int LIB_EXPORT nova_audit_directory(const char*dir, size_t dir_length, char*out, size_t*out_length)
+    {
+        if (NULL == dir || NULL == out_length)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        TraScope scope;
+
+        const int node = tra.node();
+
+        FlcErrorRef error = 0;
+        FlcLicensingRef licensing = 0;
+
+        if (!FlcErrorCreate(&error))
+        {
+            return NOVA_ERROR_SYSTEM;
+        }
+
+        stringstream stream;
+        int result = NOVA_FAILED;
+
+        if (create_licensing(node, &licensing, error))
+        {
+            const vector<string> paths = list_licenses(string(dir, dir_length));
+
+            size_t parsed = 0;
+            read_files(paths, [&](const string&path, const unsigned char*data, size_t size, int failure)
+            {
+                if (failure)
+                {
+                    stream << path << ": error: " << strerror(failure) << std::endl;
+                    return;
+                }
+
+                FlcFeatureCollectionRef features = 0;
+                FlcSize count = 0;
+                if (FlcGetFeatureCollectionFromData(licensing, &features, FLC_FALSE, data, size, error)
+                    && FlcFeatureCollectionSize(features, &count, error))
+                {
+                    for (FlcSize i = 0; i < count; i++)
+                    {
+                        FlcFeatureRef feature = 0;
+                        const FlcChar*name = 0;
+                        const FlcChar*version = 0;
+                        if (FlcFeatureCollectionGet(features, &feature, i, error)
+                            && FlcFeatureGetName(feature, &name, error)
+                            && FlcFeatureGetVersion(feature, &version, error))
+                        {
+                            stream << path << ": " << name << " - " << version << std::endl;
+                        }
+                    }
+                    parsed++;
+                }
+                else
+                {
+                    stream << path << ": error: " << FlcErrorGetMessage(error) << std::endl;
+                }
+
+                if (features)
+                {
+                    FlcFeatureCollectionDelete(&features, NULL);
+                }
+            });
+
+            result = parsed == paths.size() ? NOVA_OK : NOVA_FAILED;
+
+            tra.release_licensing(node, &licensing);
+        }
+        else
+        {
+            stream << "error: " << FlcErrorGetMessage(error) << std::endl;
+        }
+
+        FlcErrorDelete(&error);
+
+        const int copied = copy_out(stream.str(), out, out_length);
+
+        return NOVA_OK != copied ? copied : result;
+    }
+}
+/* extern c */
@@ -0,0 +1,561 @@
+/*
+ * File:   Nova.Internal.h
+ * Author: jools
+ *
+ * Declarations shared between the translation units of libnova-jni.
+ * Nothing in here is exported from the shared library.
+ */
+
+#ifndef NOVA_INTERNAL_H
+#define NOVA_INTERNAL_H
+
+#define DUMP
+#undef DUMP
+
+#define LIB_EXPORT __attribute__ ((visibility ("default")))
+
+#ifdef DUMP
+#include <cstdio>
+#define DEBUG_PRINT(format, ...) printf(format, ##__VA_ARGS__)
+#define DEBUG_PRINTLN(a) printf("%s...\n", a);
+#define COUT cout
+#else
+#define DEBUG_PRINT(format, ...) //
+#define DEBUG_PRINTLN(a) //
+#endif
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <utility>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+
+#include "tra.h"
+#include "tra_gen/nova_declarative_data.h"
+#include "FlcLicensing.h"
+#include "FlcHostIdType.h"
+#include "FlcDictionary.h"
+#include "jni.h"
+
+#include "Nova.Abi.h"
+#include "Nova.Trace.h"
+
+/*!
+ * 64 bit FNV-1a of length bytes at data. The dictionary image and the trace
+ * format document this hash, so it must not change.
+ */
+inline uint64_t fnv1a64(const void*data, size_t length)
+{
+    const unsigned char*bytes = static_cast<const unsigned char*>(data);
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*!
+ * Nanoseconds on clock, from the vDSO
+ */
+inline unsigned long long clock_ns(clockid_t clock)
+{
+    timespec now;
+    clock_gettime(clock, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+}
+
+/*!
+ * Nanoseconds on CLOCK_MONOTONIC, for every duration the library measures
+ */
+inline unsigned long long monotonic_ns()
+{
+    return clock_ns(CLOCK_MONOTONIC);
+}
+
+/*!
+ * Owner of the TRA states and pooled licensing environments.
+ *
+ * There is one TRA state and one session pool per NUMA node, each created
+ * by a thread pinned to that node so the Lua heap and SDK allocations are
+ * first touched locally. Entry points open a TraScope which binds the state
+ * of the caller's node for the whole call; TDT objects must never be mixed
+ * between states, so nothing is rebound while a scope is open.
+ */
+class CTra
+{
+    struct Node;
+
+    Node*m_nodes;
+    int m_count;
+
+public:
+    CTra();
+    virtual~CTra();
+
+    /*!
+     * State bound by the innermost TraScope, else the calling node's state
+     */
+    operator tra_State* ();
+
+    /*!
+     * Perform lazy load of the TRA engine for a node
+     */
+    tra_State* node_state(int node);
+
+    /*!
+     * Node of the bound state, else of the calling CPU
+     */
+    int node();
+
+    /*!
+     * Take a licensing environment from the node pool, creating one on the node if empty
+     */
+    FlcBool acquire_licensing(int node, FlcLicensingRef*licensing, const FlcUInt8*identity, FlcSize size, FlcErrorRef error);
+
+    /*!
+     * Reset a licensing environment and put it back in the pool of its node
+     */
+    void release_licensing(int node, FlcLicensingRef*licensing);
+
+    /*!
+     * Load the state of every node, typically in a parent before it forks
+     */
+    void prewarm();
+
+    /*!
+     * pthread_atfork hooks; see Nova.State.cpp
+     */
+    void fork_prepare();
+    void fork_parent();
+    void fork_child(bool rebuild_all);
+};
+
+extern CTra tra;
+
+/*!
+ * TRA lock acquisitions of one thread, counted by the lock wraps in
+ * Nova.State.cpp; contended ones had to wait for another thread
+ */
+struct TraLockCounts
+{
+    unsigned long long acquired;
+    unsigned long long contended;
+    unsigned long long wait_nanoseconds;
+};
+
+/*!
+ * The calling thread's counts so far
+ */
+TraLockCounts tra_lock_counts();
+
+/*!
+ * Bind the caller's node-local TRA state for the duration of a native call
+ */
+class TraScope
+{
+    tra_State*m_previous;
+    int m_previous_node;
+
+public:
+    TraScope();
+    virtual~TraScope();
+};
+
+/*!
+ * Scratch memory from the calling thread's arena, valid until the
+ * outermost TraScope of the thread closes (see Nova.Arena.cpp)
+ */
+void*arena_allocate(size_t size);
+
+/*!
+ * Rewind the calling thread's arena; done by the outermost TraScope
+ */
+void arena_reset();
+
+/*!
+ * Chunks the calling thread's arena has taken from the heap so far
+ */
+size_t arena_heap_allocations();
+
+/*!
+ * Allocator over the thread arena; deallocation is a no-op
+ */
+template<typename T>
+struct ArenaAllocator
+{
+    typedef T value_type;
+
+    ArenaAllocator()
+    {
+    }
+
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>&)
+    {
+    }
+
+    T*allocate(size_t count)
+    {
+        return static_cast<T*>(arena_allocate(count * sizeof(T)));
+    }
+
+    void deallocate(T*, size_t)
+    {
+    }
+};
+
+template<typename T, typename U>
+bool operator==(const ArenaAllocator<T>&, const ArenaAllocator<U>&)
+{
+    return true;
+}
+
+template<typename T, typename U>
+bool operator!=(const ArenaAllocator<T>&, const ArenaAllocator<U>&)
+{
+    return false;
+}
+
+/*!
+ * String for the lifetime of one native call; never keep one past the
+ * TraScope it was made in
+ */
+typedef std::basic_string<char, std::char_traits<char>, ArenaAllocator<char> > arena_string;
+
+/*!
+ * TDT constant for alias on the bound state, created on first use by the
+ * calling thread and kept for the life of the thread and the state
+ */
+const TFT&tra_constant(TRA_VARIABLE_INDEX alias);
+
+/*!
+ * Status TDT for the length of a call, starting out as the value of alias.
+ * The object is reused by the next TraLocal on this thread and state rather
+ * than created and deleted each time. Only valid inside a TraScope.
+ */
+class TraLocal
+{
+    TFT*m_value;
+
+    TraLocal(const TraLocal&);
+    TraLocal&operator=(const TraLocal&);
+
+public:
+    explicit TraLocal(TRA_VARIABLE_INDEX alias);
+    virtual~TraLocal();
+
+    TFT&operator*() const;
+};
+
+/*!
+ * Licensing environment for the fnedemo identity from the pool of a node
+ */
+FlcBool create_licensing(int node, FlcLicensingRef*licensing, FlcErrorRef error);
+
+/*!
+ * True until the host identity has been probed, and again after a link
+ * change or nova_host_refresh; a fresh environment is needed then
+ */
+bool host_stale();
+
+/*!
+ * Give a licensing environment the cached host identity, probing it first
+ * if stale and the environment is freshly created. The default host ID
+ * applied is returned in type and id when given, with the generation of
+ * the cache, which changes on every probe.
+ */
+unsigned long long host_prepare(FlcLicensingRef licensing, bool fresh, FlcHostIdType*type, std::string*id);
+
+/*!
+ * Generation of the cached host identity
+ */
+unsigned long long host_generation();
+
+/*!
+ * Add path as a buffer license source, or every .lic file in it when path
+ * is a directory. Unreadable files are skipped, malformed ones fail. The
+ * file buffers are freed on return: the SDK copies buffer source data.
+ */
+FlcBool add_license_sources(FlcLicensingRef licensing, const std::string&path, FlcErrorRef error);
+
+/*!
+ * Read many files through batched io_uring submissions, or a thread pool
+ * where io_uring is unavailable. Each buffer is handed to sink on the
+ * calling thread as soon as it completes, with an errno value on failure.
+ * Returns the number of files read without error.
+ */
+size_t read_files(const std::vector<std::string>&paths,
+                  const std::function<void(const std::string&, const unsigned char*, size_t, int)>&sink);
+
+/*!
+ * Sorted paths of the .lic files in a directory
+ */
+std::vector<std::string> list_licenses(const std::string&directory);
+
+/*!
+ * Sorted paths of the files in a directory whose names end in suffix
+ */
+std::vector<std::string> list_files(const std::string&directory, const char*suffix);
+
+bool is_directory(const std::string&path);
+
+/*!
+ * NUMA topology, a single node when /sys does not describe any
+ */
+int node_count();
+
+int current_node();
+
+/*!
+ * Everything that goes into a capability request, behind nova_request
+ */
+struct CapabilitySpec
+{
+    struct Feature
+    {
+        std::string name;
+        std::string version;
+        int count;
+
+        bool operator<(const Feature&other) const
+        {
+            return name != other.name ? name < other.name : version != other.version ? version < other.version : count < other.count;
+        }
+    };
+
+    std::vector<Feature> features;
+    std::vector<std::pair<std::string, int> > rights;
+    std::vector<std::pair<std::string, std::string> > strings;
+    std::vector<std::pair<std::string, int> > integers;
+    std::vector<std::pair<int, std::string> > hosts;
+    int operation;
+    int instance;
+    std::string correlation;
+    bool correlate;
+
+    CapabilitySpec();
+
+    /*!
+     * A correlation ID names one transaction, so such a request must be
+     * signed afresh every time and is never served from the cache
+     */
+    bool cacheable() const;
+
+    /*!
+     * Length prefixed dump of the sorted items; the order items were
+     * added in does not change the generated request
+     */
+    std::string canonical(FlcHostIdType host_type, const char*host_id) const;
+};
+
+/*!
+ * Immutable flat copy of an FlcDictionaryRef. The whole snapshot is one
+ * image, laid out as documented at nova_dictionary_image, so a lookup is a
+ * hash and a probe and the image can be handed to Java as it is.
+ */
+class CDictionary
+{
+    std::vector<uint64_t> m_image;
+    size_t m_size;
+
+    CDictionary();
+
+public:
+    /*!
+     * Flatten dictionary, which may be NULL for an empty snapshot
+     */
+    static std::shared_ptr<const CDictionary> snapshot(FlcDictionaryRef dictionary);
+
+    /*!
+     * Point value into the image, false if key is absent
+     */
+    bool find(const char*key, size_t length, nova_value&value) const;
+
+    const void* data() const;
+    size_t size() const;
+};
+
+/*!
+ * Vendor dictionary of trusted storage (NOVA_DICTIONARY_STORAGE) or of the
+ * last response processed (NOVA_DICTIONARY_RESPONSE) of an exchange; the
+ * same snapshot is returned until the exchange processes a response
+ */
+std::shared_ptr<const CDictionary> exchange_dictionary(nova_exchange*exchange, int source);
+
+/*!
+ * Queue a capability request on an exchange without a ticket to wait on,
+ * for the refresh scheduler and the usage aggregator. done runs on an exchange worker, without any exchange lock held, with
+ * the NOVA_* result and the seconds until the next update is due (-1 if
+ * the licensing environment does not say). It does not run at all if the
+ * exchange is closed first.
+ */
+int exchange_post(nova_exchange*exchange, const CapabilitySpec&spec,
+                  const std::function<void(int result, int seconds)>&done);
+
+/*!
+ * Seconds until the next update is due for a server instance, or -1
+ */
+int exchange_next_update(nova_exchange*exchange, int instance);
+
+/*!
+ * Most seconds left in the undo interval of any trusted storage feature
+ * matching name and version, 0 if none can still be undone
+ */
+int exchange_undo_seconds(nova_exchange*exchange, const std::string&feature, const std::string&version);
+
+/*!
+ * Drop every refresh of an exchange about to be closed
+ */
+void refresh_forget(nova_exchange*exchange);
+
+/*!
+ * Body of Nova.process() without any marshalling
+ *
+ * Returns NOVA_OK or NOVA_FAILED from Nova.Abi.h
+ */
+int run_process(const std::string&path, std::string&identity, std::string&message);
+
+/*!
+ * As run_process, taking the license from size bytes at data instead of
+ * path when data is set; the bytes are read in place
+ */
+int run_process(const std::string&path, const unsigned char*data, size_t size, std::string&identity, std::string&message);
+
+/*!
+ * The license check of UserData::initialize on its own: error and licensing
+ * environment, the license sources of path, and the feature checkout.
+ * Returns NOVA_OK or NOVA_FAILED; message is the SDK's on failure.
+ */
+int run_license(const std::string&path, std::string&message);
+
+/*!
+ * Error of a native call as codes; text is only built on request (see
+ * Nova.Error.cpp)
+ */
+class CErrorRecord
+{
+    struct Status
+    {
+        FlcInt32 code;
+        FlcInt32 type;
+        std::string details;
+    };
+
+    FlcInt32 m_code;
+    FlcInt32 m_system;
+    std::vector<Status> m_status;
+
+public:
+    CErrorRecord();
+    virtual~CErrorRecord();
+
+    /*!
+     * Record the codes of error, and on failure the last error status
+     * collection of licensing
+     */
+    void capture(FlcErrorRef error, FlcLicensingRef licensing);
+
+    void clear();
+
+    bool failed() const;
+
+    FlcInt32 code() const;
+
+    FlcInt32 system() const;
+
+    /*!
+     * Description of the codes, empty if nothing failed
+     */
+    std::string describe() const;
+
+    /*!
+     * The captured status collection, a line per item
+     */
+    std::string status() const;
+
+private:
+    void capture_status(FlcLicensingRef licensing);
+};
+
+/*!
+ * Error record of the calling thread's last process call, or of the last
+ * async result it collected
+ */
+CErrorRecord&last_error();
+
+/*!
+ * Set the message or identity result of a Nova object, reusing a cached
+ * String or writing into its byte[] field (see Nova.Marshal.cpp). Returns
+ * false if the object has neither field.
+ */
+bool marshal_result(JNIEnv*env, jobject object, const char*name, const char*value, size_t length);
+
+/*!
+ * Native stages ProfileStage can measure
+ */
+enum ProfileStageId
+{
+    PROFILE_PROCESS,
+    PROFILE_TRA_LOAD,
+    PROFILE_TRA_SNIF,
+    PROFILE_INITIALIZE,
+    PROFILE_FNE,
+    PROFILE_DUMP,
+    PROFILE_MARSHAL,
+    PROFILE_STAGES
+};
+
+/*!
+ * Counts, times and, where perf_event_open is allowed, reads the hardware
+ * counters of a stage while profiling is on (see Nova.Profile.cpp)
+ */
+class ProfileStage
+{
+    int m_stage;
+    bool m_active;
+    bool m_counted;
+    unsigned long long m_start;
+    unsigned long long m_counters[4];
+
+public:
+    explicit ProfileStage(int stage);
+    virtual~ProfileStage();
+};
+
+/*!
+ * Whether a trace is running, for callers that must prepare the data a
+ * TraceCall hashes
+ */
+bool trace_active();
+
+/*!
+ * Adds a call record to the running trace, if any, when it goes out of
+ * scope (see Nova.Trace.cpp). entry is a NOVA_TRACE_ entry point; the
+ * license is hashed at construction, while data is still valid.
+ */
+class TraceCall
+{
+    bool m_active;
+    int m_result;
+    unsigned long long m_start;
+    nova_trace_record m_record;
+
+public:
+    TraceCall(int entry, const std::string&path, const unsigned char*data, size_t size);
+    virtual~TraceCall();
+
+    void result(int result);
+};
+
+/*!
+ * Copy a value into a caller allocated buffer (see Nova.Abi.h)
+ */
+int copy_out(const std::string&value, char*out, size_t*length);
+
+#endif /* NOVA_INTERNAL_H */
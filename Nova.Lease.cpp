@@ -0,0 +1,383 @@
+/*
+ * File:   Nova.Lease.cpp
+ * Author: jools
+ *
+ * Count-block leasing of a counted feature.
+ *
+ * Taking one count per job through FlcAcquireLicense/FlcReturnLicense puts
+ * every job through the SDK's license bookkeeping. A lease manager instead
+ * takes a block of N counts with one FlcAcquireLicenses call and hands the
+ * counts out one at a time from per-core lock-free free lists. A block goes
+ * back to the SDK with a single FlcReturnLicenses once every one of its
+ * counts is free again, on nova_lease_trim (idle) or nova_lease_close.
+ */
+
+#include "Nova.Internal.h"
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <new>
+#include <cstdint>
+#include <cstdlib>
+#include <climits>
+
+#include <sched.h>
+
+#include "Nova.Abi.h"
+
+using namespace std;
+
+#include "FlcLicenseManager.h"
+
+// upper bound on blocks held at once by one manager
+static const unsigned int LEASE_MAX_BLOCKS = 64;
+
+// upper bound on a block, so every count index fits the list heads
+static const unsigned int LEASE_MAX_BLOCK_SIZE = INT_MAX / LEASE_MAX_BLOCKS;
+
+/*!
+ * Treiber stack of count indices. The head packs a generation tag in the
+ * upper half so a pop racing a pop/push of the same index cannot succeed.
+ * One per core, each on a cache line of its own; C++11 containers do not
+ * honour the alignment, so they live in a posix_memalign block.
+ */
+struct alignas(64) LeaseList
+{
+    atomic<uint64_t> head;
+
+    LeaseList() : head(0)
+    {
+    }
+};
+
+class CLease
+{
+    struct Block
+    {
+        FlcLicenseRef license;
+        unsigned int count;
+        bool live;
+
+        Block() : license(0), count(0), live(false)
+        {
+        }
+    };
+
+    FlcLicensingRef m_licensing;
+    FlcErrorRef m_error;
+    int m_node;
+    string m_feature;
+    string m_version;
+    unsigned int m_block_size;
+
+    mutex m_lock;
+    Block m_blocks[LEASE_MAX_BLOCKS];
+    atomic<uint32_t>*m_next;
+    size_t m_next_count;
+    LeaseList*m_lists;
+    size_t m_list_count;
+
+public:
+    CLease(int node, const string&feature, const string&version, unsigned int block_size)
+        : m_licensing(0), m_error(0), m_node(node), m_feature(feature), m_version(version)
+        , m_block_size(block_size), m_next(0), m_next_count((size_t)block_size * LEASE_MAX_BLOCKS)
+        , m_lists(0), m_list_count(thread::hardware_concurrency() ? thread::hardware_concurrency() : 1)
+    {
+    }
+
+    virtual~CLease()
+    {
+        if (m_lists)
+        {
+            for (size_t i = 0; i < m_list_count; i++)
+            {
+                m_lists[i].~LeaseList();
+            }
+            free(m_lists);
+        }
+
+        delete[] m_next;
+
+        for (unsigned int i = 0; i < LEASE_MAX_BLOCKS; i++)
+        {
+            if (m_blocks[i].live)
+            {
+                FlcReturnLicenses(m_licensing, &m_blocks[i].license, NULL);
+            }
+        }
+
+        tra.release_licensing(m_node, &m_licensing);
+
+        if (m_error)
+        {
+            FlcErrorDelete(&m_error);
+        }
+    }
+
+    int open(const string&path)
+    {
+        // a large block is a large index array, so its allocation may fail
+        m_next = new (nothrow) atomic<uint32_t>[m_next_count];
+
+        void*memory = NULL;
+        if (NULL == m_next || 0 != posix_memalign(&memory, alignof(LeaseList), m_list_count * sizeof(LeaseList)))
+        {
+            return NOVA_ERROR_SYSTEM;
+        }
+
+        m_lists = static_cast<LeaseList*>(memory);
+        for (size_t i = 0; i < m_list_count; i++)
+        {
+            new (&m_lists[i]) LeaseList();
+        }
+
+        if (!FlcErrorCreate(&m_error)
+            || !create_licensing(m_node, &m_licensing, m_error)
+            || !add_license_sources(m_licensing, path, m_error))
+        {
+            return NOVA_FAILED;
+        }
+        return NOVA_OK;
+    }
+
+    const char* message()
+    {
+        return m_error ? FlcErrorGetMessage(m_error) : "";
+    }
+
+    int acquire(unsigned int&lease)
+    {
+        const size_t local = core();
+
+        for (size_t i = 0; i < m_list_count; i++)
+        {
+            if (pop(m_lists[(local + i) % m_list_count], lease))
+            {
+                return NOVA_OK;
+            }
+        }
+
+        return grow(local, lease);
+    }
+
+    int release(unsigned int lease)
+    {
+        if (lease >= m_next_count)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        push(m_lists[core()], lease);
+        return NOVA_OK;
+    }
+
+    /*!
+     * Gather every free count and return the blocks that are wholly free.
+     * Acquirers that find the lists empty meanwhile simply take a new block.
+     */
+    unsigned int trim()
+    {
+        lock_guard<mutex> guard(m_lock);
+
+        vector<unsigned int> free_counts(LEASE_MAX_BLOCKS);
+        vector<unsigned int> collected;
+
+        unsigned int lease = 0;
+        for (size_t i = 0; i < m_list_count; i++)
+        {
+            while (pop(m_lists[i], lease))
+            {
+                collected.push_back(lease);
+                free_counts[lease / m_block_size]++;
+            }
+        }
+
+        unsigned int returned = 0;
+        for (unsigned int i = 0; i < LEASE_MAX_BLOCKS; i++)
+        {
+            if (m_blocks[i].live && free_counts[i] == m_blocks[i].count)
+            {
+                if (FlcReturnLicenses(m_licensing, &m_blocks[i].license, m_error))
+                {
+                    m_blocks[i].live = false;
+                    returned += m_blocks[i].count;
+                }
+            }
+        }
+
+        for (size_t i = 0; i < collected.size(); i++)
+        {
+            if (m_blocks[collected[i] / m_block_size].live)
+            {
+                push(m_lists[i % m_list_count], collected[i]);
+            }
+        }
+
+        return returned;
+    }
+
+private:
+    size_t core() const
+    {
+        const int cpu = sched_getcpu();
+        return cpu < 0 ? 0 : (size_t)cpu % m_list_count;
+    }
+
+    bool pop(LeaseList&list, unsigned int&lease)
+    {
+        uint64_t head = list.head.load(memory_order_acquire);
+        for (;;)
+        {
+            const uint32_t top = (uint32_t)head;
+            if (0 == top)
+            {
+                return false;
+            }
+
+            const uint64_t next = ((head >> 32) + 1) << 32 | m_next[top - 1].load(memory_order_relaxed);
+            if (list.head.compare_exchange_weak(head, next, memory_order_acquire, memory_order_acquire))
+            {
+                lease = top - 1;
+                return true;
+            }
+        }
+    }
+
+    void push(LeaseList&list, unsigned int lease)
+    {
+        uint64_t head = list.head.load(memory_order_relaxed);
+        for (;;)
+        {
+            m_next[lease].store((uint32_t)head, memory_order_relaxed);
+
+            const uint64_t next = ((head >> 32) + 1) << 32 | (lease + 1);
+            if (list.head.compare_exchange_weak(head, next, memory_order_release, memory_order_relaxed))
+            {
+                return;
+            }
+        }
+    }
+
+    /*!
+     * One FlcAcquireLicenses for a whole block, halving the request while
+     * the feature has fewer counts left than a full block
+     */
+    int grow(size_t local, unsigned int&lease)
+    {
+        lock_guard<mutex> guard(m_lock);
+
+        // another thread may have grown while we waited
+        if (pop(m_lists[local], lease))
+        {
+            return NOVA_OK;
+        }
+
+        for (unsigned int i = 0; i < LEASE_MAX_BLOCKS; i++)
+        {
+            Block&block = m_blocks[i];
+            if (block.live)
+            {
+                continue;
+            }
+
+            for (unsigned int count = m_block_size; count > 0; count /= 2)
+            {
+                if (FlcAcquireLicenses(m_licensing, &block.license, m_feature.c_str(), m_version.c_str(), count, m_error))
+                {
+                    block.count = count;
+                    block.live = true;
+
+                    const unsigned int first = i * m_block_size;
+                    for (unsigned int j = count - 1; j > 0; j--)
+                    {
+                        push(m_lists[local], first + j);
+                    }
+
+                    lease = first;
+                    return NOVA_OK;
+                }
+            }
+            return NOVA_FAILED;
+        }
+        return NOVA_ERROR_SYSTEM;
+    }
+};
+
+extern "C"
+{
+    int LIB_EXPORT nova_lease_open(const char*lic, size_t lic_length,
+                                   const char*feature, const char*version,
+                                   unsigned int block, nova_lease**lease)
+    {
+        if (NULL == lic || NULL == feature || NULL == version || 0 == block || block > LEASE_MAX_BLOCK_SIZE || NULL == lease)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        TraScope scope;
+
+        CLease*manager = new (nothrow) CLease(tra.node(), feature, version, block);
+        if (NULL == manager)
+        {
+            return NOVA_ERROR_SYSTEM;
+        }
+
+        const int result = manager->open(string(lic, lic_length));
+        if (NOVA_OK != result)
+        {
+            DEBUG_PRINT("### lease open %s\n", manager->message());
+            delete manager;
+            return result;
+        }
+
+        *lease = (nova_lease*)manager;
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_lease_acquire(nova_lease*lease, unsigned int*count)
+    {
+        if (NULL == lease || NULL == count)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        return ((CLease*)lease)->acquire(*count);
+    }
+
+    int LIB_EXPORT nova_lease_release(nova_lease*lease, unsigned int count)
+    {
+        if (NULL == lease)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        return ((CLease*)lease)->release(count);
+    }
+
+    int LIB_EXPORT nova_lease_trim(nova_lease*lease)
+    {
+        if (NULL == lease)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        return (int)((CLease*)lease)->trim();
+    }
+
+    int LIB_EXPORT nova_lease_close(nova_lease*lease)
+    {
+        if (NULL == lease)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        TraScope scope;
+
+        delete (CLease*)lease;
+        return NOVA_OK;
+    }
+}
+/* extern c */
@@ -0,0 +1,407 @@
+/*
+ * File:   Nova.Marshal.cpp
+ * Author: jools
+ *
+ * Result fields of the Nova object without per call garbage.
+ *
+ * Nova.process() answers with a message, empty unless something failed, and
+ * an identity that only ever takes a couple of values, yet each call used to
+ * allocate a fresh String for both. Here every thread keeps, per field,
+ * global refs to the last few Strings it was given, keyed by a hash of the
+ * bytes, and reuses one whenever the value repeats; the empty String is a
+ * single global ref. A Nova object that declares a byte[] <name>Bytes field
+ * and an int <name>Length field, with the array allocated, gets the bytes
+ * written into that array instead and no String at all.
+ *
+ * Field IDs are looked up once per class and published as an immutable
+ * holder in a small table, so a call takes no lock, whichever of a few
+ * classes its object is. The lock is only taken to publish new IDs, to find
+ * those of a class beyond the table, to create the empty String, and to hand
+ * the refs of a finished thread to the next call, which deletes them.
+ */
+
+#include "Nova.Internal.h"
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+#include "Nova.Abi.h"
+
+using namespace std;
+
+#include "jni.h"
+
+// Strings remembered per field and thread
+static const unsigned int MARSHAL_CACHED = 4;
+
+// result fields of the Nova object
+static const int MARSHAL_FIELDS = 2;
+
+static const char*const field_names[MARSHAL_FIELDS] = { "message", "identity" };
+
+// classes whose field IDs are found without the lock
+static const int MARSHAL_CLASSES = 8;
+
+class CMarshal
+{
+    /*!
+     * Field IDs of one class, never changed once published
+     */
+    struct FieldIds
+    {
+        jclass source;
+        jfieldID string_field[MARSHAL_FIELDS];
+        jfieldID bytes_field[MARSHAL_FIELDS];
+        jfieldID length_field[MARSHAL_FIELDS];
+    };
+
+    // taken to publish field IDs or the empty String, and for the orphans
+    mutex m_lock;
+    // filled in order and never replaced, so a reader needs no lock
+    atomic<FieldIds*> m_ids[MARSHAL_CLASSES];
+    // classes beyond the table, only read under m_lock
+    vector<FieldIds*> m_overflow;
+    atomic<jstring> m_empty;
+    vector<jstring> m_orphans;
+    atomic<bool> m_orphaned;
+
+public:
+    CMarshal() : m_empty(NULL), m_orphaned(false)
+    {
+        for (int i = 0; i < MARSHAL_CLASSES; i++)
+        {
+            m_ids[i].store(NULL);
+        }
+    }
+
+    /*!
+     * Global refs are left to the VM, which outlives the library
+     */
+    virtual~CMarshal()
+    {
+        for (int i = 0; i < MARSHAL_CLASSES; i++)
+        {
+            delete m_ids[i].load();
+        }
+        for (size_t i = 0; i < m_overflow.size(); i++)
+        {
+            delete m_overflow[i];
+        }
+    }
+
+    bool set(JNIEnv*env, jobject object, const char*name, const char*value, size_t length);
+
+    /*!
+     * Take over the refs of a thread that is going away; they are deleted
+     * by the next call, which has a JNIEnv to do it with
+     */
+    void orphan(jstring text)
+    {
+        lock_guard<mutex> guard(m_lock);
+        m_orphans.push_back(text);
+        m_orphaned = true;
+    }
+
+private:
+    static int find(const char*name)
+    {
+        for (int i = 0; i < MARSHAL_FIELDS; i++)
+        {
+            if (0 == strcmp(field_names[i], name))
+            {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    void release_orphans(JNIEnv*env)
+    {
+        lock_guard<mutex> guard(m_lock);
+        for (size_t i = 0; i < m_orphans.size(); i++)
+        {
+            env->DeleteGlobalRef(m_orphans[i]);
+        }
+        m_orphans.clear();
+        m_orphaned = false;
+    }
+
+    /*!
+     * Published field IDs of source, if any, without the lock
+     */
+    const FieldIds*published(JNIEnv*env, jclass source)
+    {
+        for (int i = 0; i < MARSHAL_CLASSES; i++)
+        {
+            const FieldIds*ids = m_ids[i].load(memory_order_acquire);
+            if (NULL == ids)
+            {
+                break;
+            }
+            if (env->IsSameObject(source, ids->source))
+            {
+                return ids;
+            }
+        }
+        return NULL;
+    }
+
+    /*!
+     * Field IDs for the class of object, looked up once per class; the
+     * byte[] fields are optional, so a failed lookup is cleared. Holders
+     * live as long as the library, a concurrent call may be reading one.
+     */
+    const FieldIds*resolve(JNIEnv*env, jobject object)
+    {
+        jclass source = env->GetObjectClass(object);
+        if (NULL == source)
+        {
+            return NULL;
+        }
+
+        const FieldIds*ids = published(env, source);
+        if (ids)
+        {
+            env->DeleteLocalRef(source);
+            return ids;
+        }
+
+        lock_guard<mutex> guard(m_lock);
+
+        // another thread may have published it while we waited
+        ids = published(env, source);
+        if (ids)
+        {
+            env->DeleteLocalRef(source);
+            return ids;
+        }
+
+        for (size_t i = 0; i < m_overflow.size(); i++)
+        {
+            if (env->IsSameObject(source, m_overflow[i]->source))
+            {
+                env->DeleteLocalRef(source);
+                return m_overflow[i];
+            }
+        }
+
+        FieldIds*fresh = new FieldIds();
+        for (int i = 0; i < MARSHAL_FIELDS; i++)
+        {
+            const string name = field_names[i];
+
+            fresh->string_field[i] = env->GetFieldID(source, name.c_str(), "Ljava/lang/String;");
+            if (env->ExceptionCheck())
+            {
+                env->ExceptionClear();
+            }
+
+            fresh->bytes_field[i] = env->GetFieldID(source, (name + "Bytes").c_str(), "[B");
+            if (env->ExceptionCheck())
+            {
+                env->ExceptionClear();
+            }
+
+            fresh->length_field[i] = env->GetFieldID(source, (name + "Length").c_str(), "I");
+            if (env->ExceptionCheck())
+            {
+                env->ExceptionClear();
+            }
+        }
+
+        fresh->source = (jclass)env->NewGlobalRef(source);
+        env->DeleteLocalRef(source);
+        if (NULL == fresh->source)
+        {
+            delete fresh;
+            return NULL;
+        }
+
+        for (int i = 0; i < MARSHAL_CLASSES; i++)
+        {
+            if (NULL == m_ids[i].load(memory_order_relaxed))
+            {
+                m_ids[i].store(fresh, memory_order_release);
+                return fresh;
+            }
+        }
+
+        m_overflow.push_back(fresh);
+        return fresh;
+    }
+
+    jstring empty(JNIEnv*env)
+    {
+        jstring text = m_empty.load(memory_order_acquire);
+        if (text)
+        {
+            return text;
+        }
+
+        lock_guard<mutex> guard(m_lock);
+
+        text = m_empty.load(memory_order_acquire);
+        if (NULL == text)
+        {
+            jstring created = env->NewStringUTF("");
+            if (created)
+            {
+                text = (jstring)env->NewGlobalRef(created);
+                env->DeleteLocalRef(created);
+                m_empty.store(text, memory_order_release);
+            }
+        }
+        return text;
+    }
+
+    jstring intern(JNIEnv*env, int field, const char*value, size_t length);
+} marshal;
+
+/*!
+ * The Strings one thread has been given recently, per field
+ */
+class CStringCache
+{
+    struct Entry
+    {
+        uint64_t hash;
+        string value;
+        jstring text;
+
+        Entry() : hash(0), text(NULL)
+        {
+        }
+    };
+
+    Entry m_entries[MARSHAL_FIELDS][MARSHAL_CACHED];
+    unsigned int m_next[MARSHAL_FIELDS];
+
+public:
+    CStringCache()
+    {
+        for (int i = 0; i < MARSHAL_FIELDS; i++)
+        {
+            m_next[i] = 0;
+        }
+    }
+
+    virtual~CStringCache()
+    {
+        for (int i = 0; i < MARSHAL_FIELDS; i++)
+        {
+            for (unsigned int j = 0; j < MARSHAL_CACHED; j++)
+            {
+                if (m_entries[i][j].text)
+                {
+                    marshal.orphan(m_entries[i][j].text);
+                }
+            }
+        }
+    }
+
+    /*!
+     * A String equal to value, reused if this thread has given the field the
+     * same value recently
+     */
+    jstring intern(JNIEnv*env, int field, const char*value, size_t length)
+    {
+        const uint64_t hash = fnv1a64(value, length);
+        for (unsigned int i = 0; i < MARSHAL_CACHED; i++)
+        {
+            const Entry&entry = m_entries[field][i];
+            if (entry.text && entry.hash == hash && 0 == entry.value.compare(0, string::npos, value, length))
+            {
+                return entry.text;
+            }
+        }
+
+        // NewStringUTF wants a terminated string, only a miss pays for the copy
+        string copy(value, length);
+        jstring created = env->NewStringUTF(copy.c_str());
+        if (NULL == created)
+        {
+            return NULL;
+        }
+
+        Entry&entry = m_entries[field][m_next[field]];
+        m_next[field] = (m_next[field] + 1) % MARSHAL_CACHED;
+
+        if (entry.text)
+        {
+            env->DeleteGlobalRef(entry.text);
+        }
+        entry.hash = hash;
+        entry.value.swap(copy);
+        entry.text = (jstring)env->NewGlobalRef(created);
+        env->DeleteLocalRef(created);
+
+        return entry.text;
+    }
+};
+
+static thread_local CStringCache t_strings;
+
+jstring CMarshal::intern(JNIEnv*env, int field, const char*value, size_t length)
+{
+    return 0 == length ? empty(env) : t_strings.intern(env, field, value, length);
+}
+
+bool CMarshal::set(JNIEnv*env, jobject object, const char*name, const char*value, size_t length)
+{
+    const int field = find(name);
+    if (field < 0)
+    {
+        return false;
+    }
+
+    const FieldIds*ids = resolve(env, object);
+    if (NULL == ids)
+    {
+        return false;
+    }
+
+    if (m_orphaned.load(memory_order_relaxed))
+    {
+        release_orphans(env);
+    }
+
+    if (ids->bytes_field[field] && ids->length_field[field])
+    {
+        jbyteArray bytes = (jbyteArray)env->GetObjectField(object, ids->bytes_field[field]);
+        if (bytes)
+        {
+            // a short array gets the length only, so the caller can grow it
+            if ((size_t)env->GetArrayLength(bytes) >= length)
+            {
+                env->SetByteArrayRegion(bytes, 0, (jsize)length, (const jbyte*)value);
+            }
+            env->SetIntField(object, ids->length_field[field], (jint)length);
+            env->DeleteLocalRef(bytes);
+            return true;
+        }
+    }
+
+    if (NULL == ids->string_field[field])
+    {
+        return false;
+    }
+
+    jstring text = intern(env, field, value, length);
+    if (NULL == text)
+    {
+        return false;
+    }
+
+    env->SetObjectField(object, ids->string_field[field], text);
+    return true;
+}
+
+bool marshal_result(JNIEnv*env, jobject object, const char*name, const char*value, size_t length)
+{
+    ProfileStage stage(PROFILE_MARSHAL);
+    return marshal.set(env, object, name, value, length);
+}
@@ -0,0 +1,349 @@
+/*
+ * File:   Nova.Profile.cpp
+ * Author: jools
+ *
+ * Opt-in hardware counters per native stage.
+ *
+ * Wall clock histograms cannot say whether loading a TRA state, running
+ * its Lua, or FNE verifying a license is cache bound or branch bound. With
+ * profiling on, each thread opens one perf_event_open group counting
+ * cycles, instructions, last level cache misses and branch misses in user
+ * space, and each ProfileStage reads the group as it starts and ends. The
+ * differences are summed per stage into IPC and misses per thousand
+ * instructions, which nova_profile_report, TestProfile and
+ * Nova.profileReport() return.
+ *
+ * If perf_event_paranoid or a seccomp policy refuses the counters, the
+ * stages are still counted and timed. The report says why there are no
+ * counters. With profiling off, a stage costs one relaxed load.
+ */
+
+#include "Nova.Internal.h"
+
+#include <string>
+#include <sstream>
+#include <atomic>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "Nova.h"
+#include "Nova.Abi.h"
+
+using namespace std;
+
+#include "jni.h"
+#include "com_flexera_schneider_fnesigner_Nova.h"
+
+// counters of a group, in read order
+enum
+{
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_LLC_MISSES,
+    COUNTER_BRANCH_MISSES,
+    COUNTERS
+};
+
+static const char*const stage_names[PROFILE_STAGES] =
+{
+    "process",
+    "tra_load",
+    "tra_snif",
+    "initialize",
+    "fne",
+    "dump",
+    "marshal"
+};
+
+static atomic<bool> s_enabled(false);
+
+// bumped by a fork child, whose inherited groups count the parent's thread
+static atomic<unsigned int> s_generation(0);
+
+// errno of the last failed perf_event_open, 0 if none failed
+static atomic<int> s_failure(0);
+
+struct StageTotals
+{
+    atomic<unsigned long long> calls;
+    atomic<unsigned long long> counted;
+    atomic<unsigned long long> nanoseconds;
+    atomic<unsigned long long> counters[COUNTERS];
+};
+
+static StageTotals s_stages[PROFILE_STAGES];
+
+/*!
+ * The counter group of one thread, opened the first time a stage runs with
+ * profiling on
+ */
+class CCounters
+{
+    int m_fds[COUNTERS];
+    int m_slots[COUNTERS];
+    int m_leader;
+    int m_open;
+    bool m_tried;
+    unsigned int m_generation;
+
+public:
+    CCounters() : m_leader(-1), m_open(0), m_tried(false), m_generation(0)
+    {
+        for (int i = 0; i < COUNTERS; i++)
+        {
+            m_fds[i] = -1;
+            m_slots[i] = -1;
+        }
+    }
+
+    virtual~CCounters()
+    {
+        close_all();
+    }
+
+    /*!
+     * Current values, false when this thread has no counters
+     */
+    bool read(unsigned long long values[COUNTERS])
+    {
+        if (m_generation != s_generation.load(memory_order_relaxed))
+        {
+            // the fds came from the parent and count one of its threads
+            close_all();
+            m_tried = false;
+        }
+
+        if (!m_tried)
+        {
+            open_all();
+        }
+        if (0 == m_open)
+        {
+            return false;
+        }
+
+        // PERF_FORMAT_GROUP: the count, then a value per open member
+        unsigned long long buffer[1 + COUNTERS];
+        const ssize_t size = ::read(m_leader, buffer, sizeof buffer);
+        if (size < (ssize_t)sizeof(unsigned long long))
+        {
+            return false;
+        }
+
+        for (int i = 0; i < COUNTERS; i++)
+        {
+            values[i] = m_slots[i] >= 0 && (unsigned long long)m_slots[i] < buffer[0] ? buffer[1 + m_slots[i]] : 0;
+        }
+        return true;
+    }
+
+private:
+    void open_all()
+    {
+        static const unsigned long long configs[COUNTERS] =
+        {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES
+        };
+
+        m_tried = true;
+        m_generation = s_generation.load(memory_order_relaxed);
+
+        for (int i = 0; i < COUNTERS; i++)
+        {
+            perf_event_attr attributes;
+            memset(&attributes, 0, sizeof attributes);
+            attributes.size = sizeof attributes;
+            attributes.type = PERF_TYPE_HARDWARE;
+            attributes.config = configs[i];
+            attributes.read_format = PERF_FORMAT_GROUP;
+            attributes.exclude_kernel = 1;
+            attributes.exclude_hv = 1;
+
+            // this thread, any CPU
+            const int fd = (int)syscall(SYS_perf_event_open, &attributes, 0, -1, m_leader, PERF_FLAG_FD_CLOEXEC);
+            if (fd < 0)
+            {
+                // a missing event, say LLC misses in a VM, only loses that column
+                s_failure.store(errno, memory_order_relaxed);
+                continue;
+            }
+
+            m_fds[i] = fd;
+            m_slots[i] = m_open++;
+            if (m_leader < 0)
+            {
+                m_leader = fd;
+            }
+        }
+    }
+
+    void close_all()
+    {
+        for (int i = 0; i < COUNTERS; i++)
+        {
+            if (m_fds[i] >= 0)
+            {
+                close(m_fds[i]);
+                m_fds[i] = -1;
+            }
+            m_slots[i] = -1;
+        }
+        m_leader = -1;
+        m_open = 0;
+    }
+};
+
+static thread_local CCounters t_counters;
+
+static void on_fork_child()
+{
+    s_generation++;
+}
+
+static const int profile_fork = pthread_atfork(NULL, NULL, on_fork_child);
+
+ProfileStage::ProfileStage(int stage) : m_stage(stage), m_active(s_enabled.load(memory_order_relaxed)), m_counted(false), m_start(0)
+{
+    if (m_active)
+    {
+        m_counted = t_counters.read(m_counters);
+        m_start = monotonic_ns();
+    }
+}
+
+ProfileStage::~ProfileStage()
+{
+    if (!m_active)
+    {
+        return;
+    }
+
+    const unsigned long long elapsed = monotonic_ns() - m_start;
+
+    StageTotals&totals = s_stages[m_stage];
+    totals.calls.fetch_add(1, memory_order_relaxed);
+    totals.nanoseconds.fetch_add(elapsed, memory_order_relaxed);
+
+    unsigned long long values[COUNTERS];
+    if (m_counted && t_counters.read(values))
+    {
+        totals.counted.fetch_add(1, memory_order_relaxed);
+        for (int i = 0; i < COUNTERS; i++)
+        {
+            totals.counters[i].fetch_add(values[i] - m_counters[i], memory_order_relaxed);
+        }
+    }
+}
+
+static string profile_report()
+{
+    stringstream stream;
+
+    const int failure = s_failure.load();
+    if (failure)
+    {
+        stream << "counters: " << strerror(failure)
+               << (EACCES == failure || EPERM == failure ? " (see /proc/sys/kernel/perf_event_paranoid)" : "") << std::endl;
+    }
+
+    for (int i = 0; i < PROFILE_STAGES; i++)
+    {
+        const StageTotals&totals = s_stages[i];
+        const unsigned long long calls = totals.calls.load();
+        if (0 == calls)
+        {
+            continue;
+        }
+
+        stream << stage_names[i] << ": calls " << calls << ", " << totals.nanoseconds.load() / calls << " ns/call";
+
+        const unsigned long long counted = totals.counted.load();
+        const double cycles = (double)totals.counters[COUNTER_CYCLES].load();
+        const double instructions = (double)totals.counters[COUNTER_INSTRUCTIONS].load();
+        if (counted && instructions > 0)
+        {
+            stream << ", ipc " << (cycles > 0 ? instructions / cycles : 0)
+                   << ", llc misses/kinstr " << 1000.0 * totals.counters[COUNTER_LLC_MISSES].load() / instructions
+                   << ", branch misses/kinstr " << 1000.0 * totals.counters[COUNTER_BRANCH_MISSES].load() / instructions
+                   << ", instr/call " << (unsigned long long)(instructions / counted);
+        }
+        stream << std::endl;
+    }
+
+    return stream.str();
+}
+
+extern "C"
+{
+    /*!
+     * Turn stage profiling on or off; returns the previous setting
+     */
+    int LIB_EXPORT nova_profile_enable(int enable)
+    {
+        return s_enabled.exchange(0 != enable) ? 1 : 0;
+    }
+
+    int LIB_EXPORT nova_profile_reset(void)
+    {
+        for (int i = 0; i < PROFILE_STAGES; i++)
+        {
+            StageTotals&totals = s_stages[i];
+            totals.calls.store(0);
+            totals.counted.store(0);
+            totals.nanoseconds.store(0);
+            for (int j = 0; j < COUNTERS; j++)
+            {
+                totals.counters[j].store(0);
+            }
+        }
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_profile_report(char*out_report, size_t*report_length)
+    {
+        if (NULL == report_length)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        return copy_out(profile_report(), out_report, report_length);
+    }
+
+    LIB_EXPORT jstring JNICALL Java_com_flexera_schneider_fnesigner_Nova_profileReport(JNIEnv*env, jobject)
+    {
+        return env->NewStringUTF(profile_report().c_str());
+    }
+
+    /*!
+     * Stage profile of a run of process calls. Passes when every call was
+     * seen, with or without counters.
+     */
+    bool LIB_EXPORT TestProfile(stringstream&stream)
+    {
+        const int calls = 50;
+
+        const int previous = nova_profile_enable(1);
+        nova_profile_reset();
+
+        string identity, message;
+        for (int i = 0; i < calls; i++)
+        {
+            run_process(string(), identity, message);
+        }
+
+        nova_profile_enable(previous);
+
+        stream << profile_report();
+
+        return (unsigned long long)calls == s_stages[PROFILE_PROCESS].calls.load();
+    }
+}
+/* extern c */
@@ -0,0 +1,489 @@
+/*
+ * File:   Nova.Refresh.cpp
+ * Author: jools
+ *
+ * Renew-interval driven refresh of capability exchanges.
+ *
+ * The licensing environment knows when trusted storage next needs an
+ * update (FlcServerUpdateGetNextTime, FlcServerInstanceGetSecondsUntilNextUpdate,
+ * or the renew interval of the last response). Refreshing on fixed timers
+ * instead lines a whole fleet up against the back office. Here each
+ * registered exchange is put on a one second timer wheel at its due time,
+ * brought forward by a random part of the interval, and failed refreshes
+ * back off with decorrelated jitter. No more than a set number of refreshes
+ * run at once; they go through the exchange workers so no application
+ * thread ever waits on a renewal.
+ */
+
+#include "Nova.Internal.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+
+#include <pthread.h>
+
+#include "Nova.Abi.h"
+
+using namespace std;
+
+// one revolution of the wheel in one second ticks
+static const unsigned int REFRESH_SLOTS = 4096;
+
+// due times are brought forward by up to this share of the interval
+static const int REFRESH_SPREAD_PERCENT = 10;
+
+// first refresh of an entry with nothing to go on falls within this
+static const int REFRESH_FIRST_SPREAD = 60;
+
+// decorrelated jitter backoff after a failed refresh, seconds
+static const int REFRESH_BACKOFF_BASE = 5;
+static const int REFRESH_BACKOFF_CAP = 900;
+
+static const int REFRESH_DEFAULT_LIMIT = 4;
+
+class CRefresh
+{
+    struct Entry
+    {
+        nova_exchange*exchange;
+        CapabilitySpec spec;
+        int fallback;
+        int backoff;
+        bool running;
+
+        Entry() : exchange(0), fallback(0), backoff(0), running(false)
+        {
+        }
+    };
+
+    struct Slot
+    {
+        unsigned long long id;
+        unsigned int rounds;
+    };
+
+    struct Completion
+    {
+        unsigned long long id;
+        int result;
+        int seconds;
+    };
+
+    /*!
+     * The scheduler thread and the condition variables waited on with it,
+     * held together so a fork child can abandon them in one go (see release)
+     */
+    struct Scheduler
+    {
+        condition_variable wake;
+        condition_variable posted;
+        thread runner;
+    };
+
+    mutex m_lock;
+    Scheduler*m_scheduler;
+    // exchange dispatch is generating a request for, outside m_lock
+    nova_exchange*m_posting;
+    unordered_map<unsigned long long, Entry> m_entries;
+    vector<list<Slot> > m_wheel;
+    deque<unsigned long long> m_ready;
+    deque<Completion> m_completed;
+    unsigned int m_cursor;
+    unsigned long long m_next;
+    int m_running;
+    int m_limit;
+    bool m_stop;
+    mt19937 m_random;
+
+public:
+    CRefresh() : m_scheduler(NULL), m_posting(0), m_wheel(REFRESH_SLOTS), m_cursor(0), m_next(0), m_running(0)
+        , m_limit(REFRESH_DEFAULT_LIMIT), m_stop(false), m_random(random_device()())
+    {
+    }
+
+    virtual~CRefresh()
+    {
+        if (NULL == m_scheduler)
+        {
+            return;
+        }
+
+        {
+            lock_guard<mutex> guard(m_lock);
+            m_stop = true;
+        }
+        m_scheduler->wake.notify_all();
+
+        m_scheduler->runner.join();
+        delete m_scheduler;
+    }
+
+    unsigned long long add(nova_exchange*exchange, const CapabilitySpec&spec, int fallback)
+    {
+        // outside the lock, this takes the exchange's SDK lock
+        const int due = exchange_next_update(exchange, spec.instance);
+
+        lock_guard<mutex> guard(m_lock);
+
+        if (NULL == m_scheduler)
+        {
+            m_scheduler = new Scheduler();
+            m_scheduler->runner = thread(&CRefresh::run, this, m_scheduler);
+        }
+
+        const unsigned long long id = ++m_next;
+
+        Entry&entry = m_entries[id];
+        entry.exchange = exchange;
+        entry.spec = spec;
+        entry.fallback = fallback;
+
+        schedule(id, due < 0 ? uniform(0, min(fallback, REFRESH_FIRST_SPREAD)) : early(due));
+
+        return id;
+    }
+
+    bool remove(unsigned long long id)
+    {
+        lock_guard<mutex> guard(m_lock);
+        return drop(id);
+    }
+
+    void forget(nova_exchange*exchange)
+    {
+        unique_lock<mutex> guard(m_lock);
+
+        // the exchange is about to be closed, let a request in progress finish with it
+        if (m_scheduler)
+        {
+            m_scheduler->posted.wait(guard, [&]{ return m_posting != exchange; });
+        }
+
+        vector<unsigned long long> ids;
+        for (unordered_map<unsigned long long, Entry>::iterator i = m_entries.begin(); i != m_entries.end(); ++i)
+        {
+            if (i->second.exchange == exchange)
+            {
+                ids.push_back(i->first);
+            }
+        }
+
+        for (size_t i = 0; i < ids.size(); i++)
+        {
+            drop(ids[i]);
+        }
+    }
+
+    void limit(int concurrent)
+    {
+        lock_guard<mutex> guard(m_lock);
+
+        m_limit = concurrent;
+        if (m_scheduler)
+        {
+            m_scheduler->wake.notify_all();
+        }
+    }
+
+    void fork_prepare()
+    {
+        m_lock.lock();
+    }
+
+    void fork_parent()
+    {
+        m_lock.unlock();
+    }
+
+    /*!
+     * The scheduler thread and the exchanges it drives are gone
+     */
+    void fork_child()
+    {
+        release();
+        m_posting = 0;
+
+        m_entries.clear();
+        for (size_t i = 0; i < m_wheel.size(); i++)
+        {
+            m_wheel[i].clear();
+        }
+        m_ready.clear();
+        m_completed.clear();
+        m_running = 0;
+
+        m_lock.unlock();
+    }
+
+private:
+    /*!
+     * Abandons the scheduler in a fork child, where its thread is gone: it
+     * can be neither joined nor detached, and the condition variables may
+     * still record its waiters, so none of it is destroyed. It is leaked
+     * once per fork, and the next add() makes a fresh one.
+     */
+    void release()
+    {
+        m_scheduler = NULL;
+    }
+
+    int uniform(int low, int high)
+    {
+        return high <= low ? low : uniform_int_distribution<int>(low, high)(m_random);
+    }
+
+    /*!
+     * Somewhere in the last REFRESH_SPREAD_PERCENT of the interval, never late
+     */
+    int early(int due)
+    {
+        return due - uniform(0, (int)((long long)due * REFRESH_SPREAD_PERCENT / 100));
+    }
+
+    /*!
+     * Called with m_lock held
+     */
+    void schedule(unsigned long long id, int seconds)
+    {
+        const unsigned int ticks = seconds < 1 ? 1 : (unsigned int)seconds;
+
+        Slot slot;
+        slot.id = id;
+        slot.rounds = (ticks - 1) / REFRESH_SLOTS;
+
+        m_wheel[(m_cursor + ticks) % REFRESH_SLOTS].push_back(slot);
+    }
+
+    /*!
+     * Called with m_lock held. Wheel slots of a dropped entry are skipped
+     * when they come round.
+     */
+    bool drop(unsigned long long id)
+    {
+        unordered_map<unsigned long long, Entry>::iterator entry = m_entries.find(id);
+        if (entry == m_entries.end())
+        {
+            return false;
+        }
+
+        // its completion, if it ever comes, finds no entry
+        if (entry->second.running)
+        {
+            m_running--;
+        }
+
+        m_entries.erase(entry);
+        return true;
+    }
+
+    void run(Scheduler*scheduler)
+    {
+        unique_lock<mutex> guard(m_lock);
+
+        chrono::steady_clock::time_point tick = chrono::steady_clock::now() + chrono::seconds(1);
+
+        while (!m_stop)
+        {
+            scheduler->wake.wait_until(guard, tick, [this]{ return m_stop || !m_completed.empty() || (!m_ready.empty() && m_running < m_limit); });
+
+            while (!m_completed.empty())
+            {
+                const Completion completion = m_completed.front();
+                m_completed.pop_front();
+                complete(completion);
+            }
+
+            for (const chrono::steady_clock::time_point now = chrono::steady_clock::now(); tick <= now; tick += chrono::seconds(1))
+            {
+                advance();
+            }
+
+            dispatch(guard, scheduler);
+        }
+    }
+
+    /*!
+     * Called with m_lock held, moves every entry due in the next slot to the ready queue
+     */
+    void advance()
+    {
+        m_cursor = (m_cursor + 1) % REFRESH_SLOTS;
+
+        list<Slot>&slot = m_wheel[m_cursor];
+        for (list<Slot>::iterator i = slot.begin(); i != slot.end();)
+        {
+            if (i->rounds)
+            {
+                i->rounds--;
+                ++i;
+                continue;
+            }
+
+            if (m_entries.count(i->id))
+            {
+                m_ready.push_back(i->id);
+            }
+            i = slot.erase(i);
+        }
+    }
+
+    /*!
+     * Called with m_lock held, which is dropped while a request is
+     * generated and signed. forget() waits for m_posting, so the exchange
+     * cannot be closed under it; the hook itself only queues.
+     */
+    void dispatch(unique_lock<mutex>&guard, Scheduler*scheduler)
+    {
+        while (!m_ready.empty() && m_running < m_limit)
+        {
+            const unsigned long long id = m_ready.front();
+            m_ready.pop_front();
+
+            unordered_map<unsigned long long, Entry>::iterator entry = m_entries.find(id);
+            if (entry == m_entries.end())
+            {
+                continue;
+            }
+
+            entry->second.running = true;
+            m_running++;
+
+            nova_exchange*const exchange = entry->second.exchange;
+            const CapabilitySpec spec = entry->second.spec;
+            m_posting = exchange;
+
+            guard.unlock();
+
+            const int result = exchange_post(exchange, spec, [this, scheduler, id](int result, int seconds)
+            {
+                {
+                    lock_guard<mutex> guard(m_lock);
+
+                    Completion completion;
+                    completion.id = id;
+                    completion.result = result;
+                    completion.seconds = seconds;
+                    m_completed.push_back(completion);
+                }
+                scheduler->wake.notify_all();
+            });
+
+            guard.lock();
+
+            m_posting = 0;
+            scheduler->posted.notify_all();
+
+            // complete() skips an entry removed meanwhile, drop() already counted it
+            if (NOVA_OK != result)
+            {
+                Completion completion;
+                completion.id = id;
+                completion.result = result;
+                completion.seconds = -1;
+                complete(completion);
+            }
+        }
+    }
+
+    /*!
+     * Called with m_lock held
+     */
+    void complete(const Completion&completion)
+    {
+        unordered_map<unsigned long long, Entry>::iterator found = m_entries.find(completion.id);
+        if (found == m_entries.end())
+        {
+            return;
+        }
+
+        Entry&entry = found->second;
+        entry.running = false;
+        m_running--;
+
+        if (NOVA_OK == completion.result)
+        {
+            entry.backoff = 0;
+
+            // 0 comes from an overdue next update or an empty response, no better than unknown
+            const int due = completion.seconds <= 0 ? entry.fallback : completion.seconds;
+            schedule(completion.id, max(REFRESH_BACKOFF_BASE, early(due)));
+        }
+        else
+        {
+            // decorrelated jitter: between the base and three times the last wait
+            entry.backoff = min(REFRESH_BACKOFF_CAP, uniform(REFRESH_BACKOFF_BASE, max(REFRESH_BACKOFF_BASE, entry.backoff) * 3));
+            schedule(completion.id, min(entry.backoff, entry.fallback));
+        }
+    }
+} refresh;
+
+static void on_fork_prepare()
+{
+    refresh.fork_prepare();
+}
+
+static void on_fork_parent()
+{
+    refresh.fork_parent();
+}
+
+static void on_fork_child()
+{
+    refresh.fork_child();
+}
+
+static const int refresh_fork = pthread_atfork(on_fork_prepare, on_fork_parent, on_fork_child);
+
+void refresh_forget(nova_exchange*exchange)
+{
+    refresh.forget(exchange);
+}
+
+extern "C"
+{
+    int LIB_EXPORT nova_refresh_add(nova_exchange*exchange, const nova_request*request,
+                                    int fallback_seconds, unsigned long long*id)
+    {
+        if (NULL == exchange || NULL == request || fallback_seconds < 1 || NULL == id)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        const CapabilitySpec&spec = *(const CapabilitySpec*)request;
+        if (!spec.correlation.empty())
+        {
+            // a fixed correlation ID would be replayed on every refresh
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        *id = refresh.add(exchange, spec, fallback_seconds);
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_refresh_remove(unsigned long long id)
+    {
+        return refresh.remove(id) ? NOVA_OK : NOVA_ERROR_TICKET;
+    }
+
+    int LIB_EXPORT nova_refresh_limit(int concurrent)
+    {
+        if (concurrent < 1)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        refresh.limit(concurrent);
+        return NOVA_OK;
+    }
+}
+/* extern c */
@@ -0,0 +1,81 @@
+/*
+ * File:   Nova.Sdt.h
+ * Author: jools
+ *
+ * USDT probes with the sys/sdt.h note layout, so bpftrace, perf and
+ * SystemTap can attach to libnova-jni despite its hidden symbols:
+ *
+ *   bpftrace -e 'usdt:./libnova-jni.so:nova:fne__return { @[str(arg0)] = count(); }'
+ *
+ * A probe is a single nop plus a .note.stapsdt entry naming the nop, the
+ * provider, the probe and where each argument lives. Nothing runs unless a
+ * tracer patches the nop, so the probes stay in production builds. There
+ * are no semaphores. Arguments are passed as signed 64 bit values, and
+ * strings as pointers. Defining NOVA_NO_PROBES compiles every probe away.
+ *
+ * Only x86-64 and aarch64 GCC/Clang are supported, which is all this
+ * library builds for. Anywhere else the probes expand to nothing.
+ */
+
+#ifndef NOVA_SDT_H
+#define NOVA_SDT_H
+
+#if !defined(NOVA_NO_PROBES) && defined(__GNUC__) && (defined(__x86_64__) || defined(__aarch64__))
+
+#define NOVA_SDT_ARG(x) ((long long)(x))
+
+/*
+ * The note, as sys/sdt.h emits it: probe address, .stapsdt.base (so tools
+ * can correct for prelink), semaphore address (none), provider, name and
+ * the argument descriptors
+ */
+#define NOVA_SDT_NOTE(provider, name, arguments)                                \
+    "990: nop\n"                                                                \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n"                               \
+    ".balign 4\n"                                                               \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                          \
+    "991: .asciz \"stapsdt\"\n"                                                 \
+    "992: .balign 4\n"                                                          \
+    "993: .8byte 990b\n"                                                        \
+    ".8byte _.stapsdt.base\n"                                                   \
+    ".8byte 0\n"                                                                \
+    ".asciz \"" #provider "\"\n"                                                \
+    ".asciz \"" #name "\"\n"                                                    \
+    ".asciz \"" arguments "\"\n"                                                \
+    "994: .balign 4\n"                                                          \
+    ".popsection\n"                                                             \
+    ".ifndef _.stapsdt.base\n"                                                  \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"     \
+    ".weak _.stapsdt.base\n"                                                    \
+    ".hidden _.stapsdt.base\n"                                                  \
+    "_.stapsdt.base: .space 1\n"                                                \
+    ".size _.stapsdt.base, 1\n"                                                 \
+    ".popsection\n"                                                             \
+    ".endif\n"
+
+#define NOVA_PROBE0(provider, name)                                             \
+    __asm__ __volatile__ (NOVA_SDT_NOTE(provider, name, ""))
+
+#define NOVA_PROBE1(provider, name, a1)                                         \
+    __asm__ __volatile__ (NOVA_SDT_NOTE(provider, name, "-8@%0")               \
+                          :: "nor" (NOVA_SDT_ARG(a1)))
+
+#define NOVA_PROBE2(provider, name, a1, a2)                                     \
+    __asm__ __volatile__ (NOVA_SDT_NOTE(provider, name, "-8@%0 -8@%1")         \
+                          :: "nor" (NOVA_SDT_ARG(a1)), "nor" (NOVA_SDT_ARG(a2)))
+
+#define NOVA_PROBE3(provider, name, a1, a2, a3)                                 \
+    __asm__ __volatile__ (NOVA_SDT_NOTE(provider, name, "-8@%0 -8@%1 -8@%2")   \
+                          :: "nor" (NOVA_SDT_ARG(a1)), "nor" (NOVA_SDT_ARG(a2)), \
+                             "nor" (NOVA_SDT_ARG(a3)))
+
+#else
+
+#define NOVA_PROBE0(provider, name)
+#define NOVA_PROBE1(provider, name, a1)
+#define NOVA_PROBE2(provider, name, a1, a2)
+#define NOVA_PROBE3(provider, name, a1, a2, a3)
+
+#endif
+
+#endif /* NOVA_SDT_H */
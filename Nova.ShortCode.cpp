@@ -0,0 +1,348 @@
+/*
+ * File:   Nova.ShortCode.cpp
+ * Author: jools
+ *
+ * Batched short code response processing.
+ *
+ * A short code environment belongs to one licensing environment and has to
+ * load and parse its templates before it can process a response, which is
+ * more work than processing the response itself. A short code service reads
+ * the template files once, parses them once into each of its workers' own
+ * environments, and then takes response codes a batch at a time. The codes
+ * of a batch are spread over the workers, the calling thread being one of
+ * them, and every result lands in one caller supplied array.
+ */
+
+#include "Nova.Internal.h"
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstring>
+
+#include "Nova.Abi.h"
+
+using namespace std;
+
+#include "FlcLicenseManager.h"
+#include "FlcShortCode.h"
+
+// upper bound on workers of one service
+static const unsigned int SHORT_CODE_MAX_WORKERS = 32;
+
+class CShortCode
+{
+    struct Worker
+    {
+        FlcLicensingRef licensing;
+        FlcShortCodeEnvironmentRef environment;
+        FlcErrorRef error;
+
+        Worker() : licensing(0), environment(0), error(0)
+        {
+        }
+    };
+
+    int m_node;
+    vector<Worker> m_workers;
+    string m_message;
+    size_t m_segment;
+    bool m_separators;
+
+    // one batch at a time
+    mutex m_batch;
+
+    mutex m_lock;
+    condition_variable m_work;
+    condition_variable m_done;
+    const char*const*m_codes;
+    nova_shortcode_result*m_results;
+    size_t m_count;
+    atomic<size_t> m_next;
+    unsigned int m_busy;
+    unsigned long long m_round;
+    bool m_stop;
+    vector<thread> m_threads;
+
+public:
+    CShortCode(int node, unsigned int workers)
+        : m_node(node), m_workers(workers), m_segment(0), m_separators(false), m_codes(0), m_results(0), m_count(0)
+        , m_next(0), m_busy(0), m_round(0), m_stop(false)
+    {
+    }
+
+    virtual~CShortCode()
+    {
+        {
+            lock_guard<mutex> guard(m_lock);
+            m_stop = true;
+        }
+        m_work.notify_all();
+
+        for (size_t i = 0; i < m_threads.size(); i++)
+        {
+            m_threads[i].join();
+        }
+
+        for (size_t i = 0; i < m_workers.size(); i++)
+        {
+            Worker&worker = m_workers[i];
+            if (worker.environment)
+            {
+                FlcShortCodeEnvironmentDelete(&worker.environment, NULL);
+            }
+
+            tra.release_licensing(m_node, &worker.licensing);
+
+            if (worker.error)
+            {
+                FlcErrorDelete(&worker.error);
+            }
+        }
+    }
+
+    /*!
+     * Read the templates at path (a file, or every file in a directory) and
+     * parse them into an environment per worker
+     */
+    int open(const string&path, int encoding, const char*characters, size_t segment)
+    {
+        vector<vector<FlcUInt8> > templates;
+        read_files(is_directory(path) ? list_files(path, "") : vector<string>(1, path),
+                   [&](const string&name, const unsigned char*data, size_t size, int failure)
+        {
+            // only read by DEBUG_PRINT, which compiles out of release builds
+            (void)name;
+
+            // directories and unreadable files are not templates
+            if (failure || 0 == size)
+            {
+                DEBUG_PRINT("### skipped %s\n", name.c_str());
+            }
+            else
+            {
+                templates.push_back(vector<FlcUInt8>(data, data + size));
+            }
+        });
+
+        if (templates.empty())
+        {
+            m_message = "no short code templates in " + path;
+            return NOVA_FAILED;
+        }
+
+        m_segment = segment;
+        m_separators = NULL == characters;
+
+        for (size_t i = 0; i < m_workers.size(); i++)
+        {
+            Worker&worker = m_workers[i];
+
+            bool result = FlcErrorCreate(&worker.error)
+                && create_licensing(m_node, &worker.licensing, worker.error)
+                && FlcShortCodeEnvironmentCreate(worker.licensing, &worker.environment, worker.error)
+                && FlcShortCodeSetResponseDecoding(worker.environment, (FlcShortCodeEncoding)encoding, characters, segment, worker.error);
+
+            for (size_t t = 0; result && t < templates.size(); t++)
+            {
+                result = FlcShortCodeEnvironmentAddTemplateFromData(worker.environment, NULL, &templates[t][0], templates[t].size(), worker.error);
+            }
+
+            if (!result)
+            {
+                m_message = worker.error ? FlcErrorGetMessage(worker.error) : "";
+                return NOVA_FAILED;
+            }
+        }
+
+        for (size_t i = 1; i < m_workers.size(); i++)
+        {
+            m_threads.push_back(thread(&CShortCode::run, this, i));
+        }
+        return NOVA_OK;
+    }
+
+    const string&message() const
+    {
+        return m_message;
+    }
+
+    void process(const char*const*codes, size_t count, nova_shortcode_result*results)
+    {
+        lock_guard<mutex> batch(m_batch);
+
+        // a single code is not worth waking anyone for
+        const bool wake = count > 1 && !m_threads.empty();
+        {
+            lock_guard<mutex> guard(m_lock);
+            m_codes = codes;
+            m_results = results;
+            m_count = count;
+            m_next.store(0);
+            m_busy = wake ? (unsigned int)m_threads.size() : 0;
+            m_round++;
+        }
+
+        if (wake)
+        {
+            m_work.notify_all();
+        }
+
+        drain(m_workers[0]);
+
+        unique_lock<mutex> guard(m_lock);
+        m_done.wait(guard, [this]{ return 0 == m_busy; });
+    }
+
+private:
+    void run(size_t index)
+    {
+        unsigned long long seen = 0;
+
+        unique_lock<mutex> guard(m_lock);
+        for (;;)
+        {
+            m_work.wait(guard, [this, seen]{ return m_stop || m_round != seen; });
+            if (m_stop)
+            {
+                return;
+            }
+            seen = m_round;
+
+            // a batch nobody was woken for
+            if (0 == m_busy)
+            {
+                continue;
+            }
+
+            guard.unlock();
+            drain(m_workers[index]);
+            guard.lock();
+
+            if (0 == --m_busy)
+            {
+                m_done.notify_all();
+            }
+        }
+    }
+
+    void drain(Worker&worker)
+    {
+        for (size_t i = m_next.fetch_add(1); i < m_count; i = m_next.fetch_add(1))
+        {
+            one(worker, m_codes[i], m_results[i]);
+        }
+    }
+
+    void one(Worker&worker, const char*code, nova_shortcode_result&result)
+    {
+        FlcUInt16 template_id = 0;
+
+        bool processed = NULL != code
+            && FlcShortCodeResponseReset(worker.environment, worker.error)
+            && (m_segment ? segments(worker, code) : FlcShortCodeResponseSet(worker.environment, code, worker.error));
+
+        result.template_id = processed && FlcShortCodeResponseGetTemplateId(worker.environment, &template_id, NULL) ? template_id : -1;
+
+        processed = processed && FlcProcessShortCodeResponse(worker.environment, worker.error);
+
+        result.result = processed ? NOVA_OK : NOVA_FAILED;
+        result.error_code = processed || NULL == code ? 0 : FlcErrorGetCode(worker.error);
+
+        const char*message = processed ? "" : NULL == code ? "no code" : FlcErrorGetMessage(worker.error);
+        strncpy(result.message, message, sizeof result.message - 1);
+        result.message[sizeof result.message - 1] = 0;
+    }
+
+    /*!
+     * Segmented codes may be entered as typed, with separators unless the
+     * decoding has its own characters. The decoder takes them m_segment
+     * characters at a time, and an empty segment after a full last one.
+     */
+    bool segments(Worker&worker, const char*code)
+    {
+        string plain;
+        for (const char*c = code; *c; c++)
+        {
+            if (!m_separators || ('-' != *c && ' ' != *c))
+            {
+                plain += *c;
+            }
+        }
+
+        for (size_t at = 0; at < plain.size(); at += m_segment)
+        {
+            if (!FlcShortCodeResponseAddSegment(worker.environment, plain.substr(at, m_segment).c_str(), worker.error))
+            {
+                return false;
+            }
+        }
+
+        return plain.size() % m_segment || FlcShortCodeResponseAddSegment(worker.environment, NULL, worker.error);
+    }
+};
+
+extern "C"
+{
+    int LIB_EXPORT nova_shortcode_open(const char*templates, size_t templates_length,
+                                       int encoding, const char*characters, size_t segment_size,
+                                       unsigned int workers, nova_shortcode**service)
+    {
+        if (NULL == templates || 0 == workers || workers > SHORT_CODE_MAX_WORKERS || NULL == service)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        TraScope scope;
+
+        CShortCode*created = new CShortCode(tra.node(), workers);
+
+        const int result = created->open(string(templates, templates_length), encoding, characters, segment_size);
+        if (NOVA_OK != result)
+        {
+            DEBUG_PRINT("### shortcode open %s\n", created->message().c_str());
+            delete created;
+            return result;
+        }
+
+        *service = (nova_shortcode*)created;
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_shortcode_process(nova_shortcode*service, const char*const*codes, size_t count,
+                                          nova_shortcode_result*results)
+    {
+        if (NULL == service || (count && (NULL == codes || NULL == results)))
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        ((CShortCode*)service)->process(codes, count, results);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            if (NOVA_OK != results[i].result)
+            {
+                return NOVA_FAILED;
+            }
+        }
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_shortcode_close(nova_shortcode*service)
+    {
+        if (NULL == service)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        TraScope scope;
+
+        delete (CShortCode*)service;
+        return NOVA_OK;
+    }
+}
+/* extern c */
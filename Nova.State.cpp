@@ -0,0 +1,802 @@
+/*
+ * File:   Nova.State.cpp
+ * Author: jools
+ *
+ * NUMA aware ownership of TRA states and licensing environments.
+ *
+ * On multi-socket hosts a single global state is touched from both sockets
+ * and its Lua heap lives wherever the first caller happened to run. Each
+ * node now gets its own state and session pool, loaded by a thread pinned
+ * to that node, and callers are served from the node getcpu reports.
+ */
+
+#include "Nova.Internal.h"
+
+#include <cstdio>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <unordered_map>
+#include <cstdint>
+
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+using namespace std;
+
+#include "tra_gen/nova_declarative_data.h"
+#include "FlcLicenseManager.h"
+#include "Nova.Abi.h"
+#include "Nova.Sdt.h"
+
+// generated by tra-gen in tra_gen/nova_tra.c
+extern "C"
+{
+    void tra_thread_lock_enter(tra_State*);
+    void tra_thread_lock_leave(tra_State*);
+}
+
+/*
+ * libtra takes a state's lock through the tra_cb_thread_lock_* callbacks
+ * that the generated tra_thread_lock_* functions call. The library is linked
+ * with --wrap for both callbacks (see the linker flags in .cproject), which
+ * routes every acquisition through here without touching generated code.
+ * tra__lock_enter fires before the wait, tra__lock_acquired once the lock
+ * is held and tra__lock_leave after the release, each with the state.
+ *
+ * The wraps also count real waits. tra_State is opaque, so its mutex
+ * cannot be tried directly. Each state instead gets a slot counting the
+ * threads that hold or wait for its lock. A thread that finds the count
+ * above zero, and does not hold the lock already, is about to block: only
+ * then is the blocking lock timed. The lock is recursive, so each thread
+ * keeps the depth of the locks it holds. The counts are per thread, read by
+ * tra_lock_counts.
+ */
+struct LockSlot
+{
+    atomic<tra_State*> state;
+    atomic<int> inside;
+};
+
+struct HeldLock
+{
+    tra_State*state;
+    LockSlot*slot;
+    int depth;
+};
+
+// states ever locked, slots are never freed; beyond this waits go uncounted
+static const size_t LOCK_SLOTS = 1024;
+
+// locks one thread can hold at once and still have them counted
+static const int HELD_LOCKS = 8;
+
+static LockSlot s_lock_slots[LOCK_SLOTS];
+
+static thread_local HeldLock t_held[HELD_LOCKS];
+static thread_local int t_held_count = 0;
+static thread_local TraLockCounts t_lock_counts;
+
+static LockSlot*lock_slot(tra_State*state)
+{
+    size_t index = (size_t)(((uintptr_t)state >> 4) * 0x9E3779B97F4A7C15ULL) % LOCK_SLOTS;
+    for (size_t probe = 0; probe < LOCK_SLOTS; probe++, index = (index + 1) % LOCK_SLOTS)
+    {
+        LockSlot&slot = s_lock_slots[index];
+
+        tra_State*current = slot.state.load(memory_order_acquire);
+        if (NULL == current && slot.state.compare_exchange_strong(current, state))
+        {
+            return &slot;
+        }
+        if (current == state)
+        {
+            return &slot;
+        }
+    }
+    return NULL;
+}
+
+static HeldLock*held_lock(tra_State*state)
+{
+    for (int i = t_held_count - 1; i >= 0; i--)
+    {
+        if (t_held[i].state == state)
+        {
+            return &t_held[i];
+        }
+    }
+    return NULL;
+}
+
+/*!
+ * Called by a fork child before it releases the locks fork_prepare took;
+ * the threads that held or waited for the others are gone
+ */
+static void lock_slots_fork_child()
+{
+    for (size_t i = 0; i < LOCK_SLOTS; i++)
+    {
+        s_lock_slots[i].inside.store(0);
+    }
+    for (int i = 0; i < t_held_count; i++)
+    {
+        if (t_held[i].slot)
+        {
+            t_held[i].slot->inside.store(1);
+        }
+    }
+}
+
+TraLockCounts tra_lock_counts()
+{
+    return t_lock_counts;
+}
+
+extern "C"
+{
+    void __real_tra_cb_thread_lock_enter(tra_State*);
+    void __real_tra_cb_thread_lock_leave(tra_State*);
+
+    void __wrap_tra_cb_thread_lock_enter(tra_State*state)
+    {
+        NOVA_PROBE1(nova, tra__lock_enter, state);
+
+        t_lock_counts.acquired++;
+
+        HeldLock*held = held_lock(state);
+        if (held)
+        {
+            // already ours, cannot block
+            __real_tra_cb_thread_lock_enter(state);
+            held->depth++;
+            NOVA_PROBE1(nova, tra__lock_acquired, state);
+            return;
+        }
+
+        LockSlot*slot = lock_slot(state);
+        if (slot && slot->inside.fetch_add(1, memory_order_acq_rel) > 0)
+        {
+            const unsigned long long start = monotonic_ns();
+            __real_tra_cb_thread_lock_enter(state);
+            t_lock_counts.contended++;
+            t_lock_counts.wait_nanoseconds += monotonic_ns() - start;
+        }
+        else
+        {
+            __real_tra_cb_thread_lock_enter(state);
+        }
+
+        if (t_held_count < HELD_LOCKS)
+        {
+            HeldLock&entry = t_held[t_held_count++];
+            entry.state = state;
+            entry.slot = slot;
+            entry.depth = 1;
+        }
+        else if (slot)
+        {
+            // untracked from here on, so no longer counted as inside
+            slot->inside.fetch_sub(1, memory_order_acq_rel);
+        }
+
+        NOVA_PROBE1(nova, tra__lock_acquired, state);
+    }
+
+    void __wrap_tra_cb_thread_lock_leave(tra_State*state)
+    {
+        HeldLock*held = held_lock(state);
+
+        __real_tra_cb_thread_lock_leave(state);
+
+        if (held && 0 == --held->depth)
+        {
+            if (held->slot)
+            {
+                held->slot->inside.fetch_sub(1, memory_order_acq_rel);
+            }
+            *held = t_held[--t_held_count];
+        }
+
+        NOVA_PROBE1(nova, tra__lock_leave, state);
+    }
+}
+
+// idle licensing environments kept per node, any more are deleted
+static const size_t MAX_POOLED_SESSIONS = 16;
+
+// state and node bound by the innermost TraScope of this thread
+static thread_local tra_State*t_state = NULL;
+static thread_local int t_node = -1;
+
+/*!
+ * Held shared by every outermost TraScope and exclusively across fork() so
+ * a child never inherits a state or session that was half way through a call
+ */
+static pthread_rwlock_t s_gate;
+
+static atomic<int> s_fork_mode(NOVA_FORK_REBUILD_UNSHARED);
+
+// bumped whenever a state is closed, so per thread TDT caches know to let go
+static atomic<unsigned int> s_generation(0);
+
+/*!
+ * Parse a sysfs list such as "0-3,8-11"
+ */
+static vector<int> parse_list(const string&path)
+{
+    vector<int> list;
+
+    ifstream file(path.c_str());
+    string text;
+    if (getline(file, text))
+    {
+        stringstream stream(text);
+        string range;
+        while (getline(stream, range, ','))
+        {
+            int first = 0, last = 0;
+            const int matched = sscanf(range.c_str(), "%d-%d", &first, &last);
+            if (1 == matched)
+            {
+                last = first;
+            }
+            else if (2 != matched)
+            {
+                continue;
+            }
+
+            for (int i = first; i <= last; i++)
+            {
+                list.push_back(i);
+            }
+        }
+    }
+    return list;
+}
+
+struct Topology
+{
+    vector<int> nodes;
+    vector<vector<int> > cpus;
+
+    Topology()
+    {
+        nodes = parse_list("/sys/devices/system/node/online");
+
+        for (size_t i = 0; i < nodes.size(); i++)
+        {
+            char path[64];
+            snprintf(path, sizeof path, "/sys/devices/system/node/node%d/cpulist", nodes[i]);
+            cpus.push_back(parse_list(path));
+        }
+
+        if (nodes.empty())
+        {
+            nodes.push_back(0);
+            cpus.push_back(vector<int>());
+        }
+    }
+};
+
+static const Topology&topology()
+{
+    static const Topology topology;
+    return topology;
+}
+
+int node_count()
+{
+    return (int)topology().nodes.size();
+}
+
+int current_node()
+{
+    const Topology&layout = topology();
+    if (layout.nodes.size() < 2)
+    {
+        return 0;
+    }
+
+    unsigned int cpu = 0, node = 0;
+    if (0 != syscall(SYS_getcpu, &cpu, &node, NULL))
+    {
+        return 0;
+    }
+
+    for (size_t i = 0; i < layout.nodes.size(); i++)
+    {
+        if (layout.nodes[i] == (int)node)
+        {
+            return (int)i;
+        }
+    }
+    return 0;
+}
+
+/*!
+ * Run a function on a thread pinned to a node so that everything it
+ * allocates is first touched there. Runs inline on single node hosts.
+ */
+template<typename Function>
+static void run_on_node(int node, Function function)
+{
+    const Topology&layout = topology();
+    if (layout.nodes.size() < 2 || layout.cpus[node].empty())
+    {
+        function();
+        return;
+    }
+
+    thread worker([&]
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (size_t i = 0; i < layout.cpus[node].size(); i++)
+        {
+            CPU_SET(layout.cpus[node][i], &set);
+        }
+        if (0 != sched_setaffinity(0, sizeof set, &set))
+        {
+            DEBUG_PRINTLN("sched_setaffinity failed");
+        }
+        function();
+    });
+    worker.join();
+}
+
+struct CTra::Node
+{
+    atomic<tra_State*> state;
+    mutex lock;
+    vector<FlcLicensingRef> sessions;
+
+    Node() : state(NULL)
+    {
+    }
+};
+
+static void on_fork_prepare()
+{
+    tra.fork_prepare();
+}
+
+static void on_fork_parent()
+{
+    tra.fork_parent();
+}
+
+static void on_fork_child()
+{
+    lock_slots_fork_child();
+    tra.fork_child(NOVA_FORK_REBUILD_ALL == s_fork_mode.load());
+}
+
+CTra::CTra() : m_nodes(0), m_count(node_count())
+{
+    m_nodes = new Node[m_count];
+
+    // writers first, otherwise a busy process could hold fork off forever
+    pthread_rwlockattr_t attributes;
+    pthread_rwlockattr_init(&attributes);
+    pthread_rwlockattr_setkind_np(&attributes, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&s_gate, &attributes);
+    pthread_rwlockattr_destroy(&attributes);
+
+    pthread_atfork(on_fork_prepare, on_fork_parent, on_fork_child);
+}
+
+CTra::~CTra()
+{
+    for (int i = 0; i < m_count; i++)
+    {
+        for (size_t j = 0; j < m_nodes[i].sessions.size(); j++)
+        {
+            FlcLicensingDelete(&m_nodes[i].sessions[j], NULL);
+        }
+
+        tra_State*state = m_nodes[i].state.load();
+        if (state)
+        {
+            tra_close(state);
+        }
+    }
+    s_generation++;
+    delete[] m_nodes;
+}
+
+CTra::operator tra_State* ()
+{
+    if (t_state)
+    {
+        return t_state;
+    }
+    return node_state(current_node());
+}
+
+tra_State* CTra::node_state(int node)
+{
+    Node&local = m_nodes[node];
+
+    tra_State*state = local.state.load(memory_order_acquire);
+    if (NULL == state)
+    {
+        lock_guard<mutex> guard(local.lock);
+
+        state = local.state.load(memory_order_relaxed);
+        if (NULL == state)
+        {
+            DEBUG_PRINTLN("Lazy Load TRA");
+            run_on_node(node, [&]
+            {
+                // on the loading thread, whose counters see the load
+                ProfileStage stage(PROFILE_TRA_LOAD);
+                state = tra_load_nova_declarative_data();
+            });
+            local.state.store(state, memory_order_release);
+        }
+    }
+    return state;
+}
+
+int CTra::node()
+{
+    return t_node >= 0 ? t_node : current_node();
+}
+
+FlcBool CTra::acquire_licensing(int node, FlcLicensingRef*licensing, const FlcUInt8*identity, FlcSize size, FlcErrorRef error)
+{
+    Node&local = m_nodes[node];
+
+    FlcLicensingRef pooled = 0;
+
+    // pooled environments carry the identity the stale cache had
+    if (!host_stale())
+    {
+        lock_guard<mutex> guard(local.lock);
+        if (!local.sessions.empty())
+        {
+            pooled = local.sessions.back();
+            local.sessions.pop_back();
+        }
+    }
+
+    if (pooled)
+    {
+        host_prepare(pooled, false, NULL, NULL);
+        *licensing = pooled;
+        return FLC_TRUE;
+    }
+
+    FlcBool result = FLC_FALSE;
+    run_on_node(node, [&]{ result = FlcLicensingCreate(licensing, identity, size, NULL, NULL, error); });
+    if (result)
+    {
+        host_prepare(*licensing, true, NULL, NULL);
+    }
+    return result;
+}
+
+void CTra::release_licensing(int node, FlcLicensingRef*licensing)
+{
+    if (NULL == *licensing)
+    {
+        return;
+    }
+
+    if (FlcLicensingReset(*licensing, NULL))
+    {
+        Node&local = m_nodes[node];
+
+        lock_guard<mutex> guard(local.lock);
+        if (local.sessions.size() < MAX_POOLED_SESSIONS)
+        {
+            local.sessions.push_back(*licensing);
+            *licensing = 0;
+            return;
+        }
+    }
+
+    FlcLicensingDelete(licensing, NULL);
+}
+
+void CTra::prewarm()
+{
+    for (int i = 0; i < m_count; i++)
+    {
+        node_state(i);
+    }
+}
+
+/*!
+ * Quiesce: wait for in-flight calls to leave, then take every node lock and
+ * the TRA lock of every loaded state so nothing is mid-update at the fork
+ */
+void CTra::fork_prepare()
+{
+    pthread_rwlock_wrlock(&s_gate);
+
+    for (int i = 0; i < m_count; i++)
+    {
+        m_nodes[i].lock.lock();
+
+        tra_State*state = m_nodes[i].state.load();
+        if (state)
+        {
+            tra_thread_lock_enter(state);
+        }
+    }
+}
+
+void CTra::fork_parent()
+{
+    for (int i = m_count - 1; i >= 0; i--)
+    {
+        tra_State*state = m_nodes[i].state.load();
+        if (state)
+        {
+            tra_thread_lock_leave(state);
+        }
+
+        m_nodes[i].lock.unlock();
+    }
+
+    pthread_rwlock_unlock(&s_gate);
+}
+
+/*!
+ * Re-arm the locks, which the forking thread still owns in the child, and
+ * drop what cannot be shared. Pooled licensing environments depend on SDK
+ * threads that no longer exist, so they are abandoned rather than deleted.
+ */
+void CTra::fork_child(bool rebuild_all)
+{
+    for (int i = m_count - 1; i >= 0; i--)
+    {
+        m_nodes[i].sessions.clear();
+
+        tra_State*state = m_nodes[i].state.load();
+        if (state)
+        {
+            tra_thread_lock_leave(state);
+
+            if (rebuild_all)
+            {
+                tra_close(state);
+                m_nodes[i].state.store(NULL);
+                s_generation++;
+            }
+        }
+
+        m_nodes[i].lock.unlock();
+    }
+
+    pthread_rwlock_unlock(&s_gate);
+}
+
+CTra tra;
+
+TraScope::TraScope() : m_previous(t_state), m_previous_node(t_node)
+{
+    if (NULL == t_state)
+    {
+        NOVA_PROBE0(nova, tra__scope_enter);
+        pthread_rwlock_rdlock(&s_gate);
+
+        t_node = current_node();
+        t_state = tra.node_state(t_node);
+        NOVA_PROBE1(nova, tra__scope_bound, t_node);
+    }
+}
+
+TraScope::~TraScope()
+{
+    if (NULL == m_previous)
+    {
+        pthread_rwlock_unlock(&s_gate);
+        NOVA_PROBE1(nova, tra__scope_leave, t_node);
+
+        arena_reset();
+    }
+
+    t_state = m_previous;
+    t_node = m_previous_node;
+}
+
+/*!
+ * TDT objects of one thread on one state: a constant per alias, and status
+ * objects handed out to TraLocal. Everything is deleted when the thread
+ * exits, unless the state was closed first, in which case it went with it.
+ */
+class CTdtCache
+{
+    struct Cache
+    {
+        tra_State*state;
+        unsigned int generation;
+        unordered_map<int, TFT*> constants;
+        vector<TFT*> locals;
+
+        Cache() : state(NULL), generation(0)
+        {
+        }
+    };
+
+    vector<Cache> m_caches;
+
+public:
+    virtual~CTdtCache()
+    {
+        pthread_rwlock_rdlock(&s_gate);
+
+        for (size_t i = 0; i < m_caches.size(); i++)
+        {
+            Cache&cache = m_caches[i];
+            if (cache.state && cache.generation == s_generation.load())
+            {
+                for (unordered_map<int, TFT*>::iterator it = cache.constants.begin(); it != cache.constants.end(); ++it)
+                {
+                    delete it->second;
+                }
+                for (size_t j = 0; j < cache.locals.size(); j++)
+                {
+                    delete cache.locals[j];
+                }
+            }
+        }
+
+        pthread_rwlock_unlock(&s_gate);
+    }
+
+    /*!
+     * Cache for the state bound by the current TraScope
+     */
+    Cache&bound()
+    {
+        if (m_caches.empty())
+        {
+            m_caches.resize(node_count());
+        }
+
+        Cache&cache = m_caches[tra.node()];
+        tra_State*state = tra;
+
+        const unsigned int generation = s_generation.load(memory_order_acquire);
+        if (cache.state != state || cache.generation != generation)
+        {
+            // the objects belonged to a closed state, there is nothing to delete them with
+            cache.constants.clear();
+            cache.locals.clear();
+            cache.state = state;
+            cache.generation = generation;
+        }
+        return cache;
+    }
+
+    const TFT&constant(TRA_VARIABLE_INDEX alias)
+    {
+        Cache&cache = bound();
+
+        TFT*&value = cache.constants[alias];
+        if (NULL == value)
+        {
+            value = new TFT(cache.state, alias);
+        }
+        return *value;
+    }
+
+    TFT*take(TRA_VARIABLE_INDEX alias)
+    {
+        Cache&cache = bound();
+
+        if (cache.locals.empty())
+        {
+            return new TFT(cache.state, alias);
+        }
+
+        TFT*value = cache.locals.back();
+        cache.locals.pop_back();
+        *value = constant(alias);
+        return value;
+    }
+
+    void give(TFT*value)
+    {
+        bound().locals.push_back(value);
+    }
+};
+
+static thread_local CTdtCache t_tdt;
+
+const TFT&tra_constant(TRA_VARIABLE_INDEX alias)
+{
+    return t_tdt.constant(alias);
+}
+
+TraLocal::TraLocal(TRA_VARIABLE_INDEX alias) : m_value(t_tdt.take(alias))
+{
+}
+
+TraLocal::~TraLocal()
+{
+    t_tdt.give(m_value);
+}
+
+TFT&TraLocal::operator*() const
+{
+    return *m_value;
+}
+
+extern "C"
+{
+    int LIB_EXPORT nova_prewarm(void)
+    {
+        tra.prewarm();
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_fork_mode(int mode)
+    {
+        if (NOVA_FORK_REBUILD_UNSHARED != mode && NOVA_FORK_REBUILD_ALL != mode)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        return s_fork_mode.exchange(mode);
+    }
+
+    /*!
+     * Cross-socket check: TDT arithmetic from each node against the state of
+     * every node. Local rows should match the diagonal once states are per node.
+     */
+    bool LIB_EXPORT TestNuma(stringstream&stream)
+    {
+        const int count = node_count();
+        const int operations = 20000;
+
+        bool result = true;
+
+        for (int source = 0; source < count; source++)
+        {
+            for (int target = 0; target < count; target++)
+            {
+                tra_State*state = tra.node_state(target);
+
+                double rate = 0;
+                bool correct = false;
+
+                run_on_node(source, [&]
+                {
+                    TFT value(state, TRA_VARIABLE_zero_ALIAS_13);
+                    TFT one(state, TRA_VARIABLE_one_ALIAS_10);
+
+                    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                    for (int i = 0; i < operations; i++)
+                    {
+                        value += one;
+                    }
+                    const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+                    correct = operations == value.get();
+                    rate = elapsed.count() > 0 ? operations / elapsed.count() : 0;
+                });
+
+                stream << "node " << source << " -> state " << target
+                       << (source == target ? " (local): " : " (remote): ")
+                       << (long)rate << " ops/s" << (correct ? "" : " MISMATCH") << std::endl;
+
+                result = result && correct;
+            }
+        }
+
+        return result;
+    }
+}
+/* extern c */
@@ -0,0 +1,335 @@
+/*
+ * File:   Nova.Stress.cpp
+ * Author: jools
+ *
+ * Concurrent TRA stress and throughput harness.
+ *
+ * TestTra runs one fixed sequence on one thread. Before the state model is
+ * scaled further, it has to hold up with many threads on one state. Here
+ * every thread runs randomized programs of TDT arithmetic. The same
+ * decisions are replayed on plain ints as the oracle, and each program's
+ * TDT result is checked against it by get() and by comparison. Each run
+ * uses one state layout:
+ *
+ *   shared      every thread on the node state, as the entry points use it
+ *   pooled      a quarter as many private states as threads, shared round robin
+ *   per-thread  a private state per thread
+ *
+ * and is timed on one thread and on N. A state's lock is taken inside the
+ * TRA library on every call. The lock wraps in Nova.State.cpp count the
+ * acquisitions that found the lock taken by another thread and time how
+ * long those waited; each run reports their share and the wait per call.
+ * The pooled and per-thread states are loaded for the run and closed after
+ * it.
+ */
+
+#include "Nova.Internal.h"
+
+#include <string>
+#include <sstream>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+
+#include "Nova.h"
+#include "Nova.Abi.h"
+
+using namespace std;
+
+// programs per thread and operations per program
+static const int STRESS_PROGRAMS = 500;
+static const int STRESS_STEPS = 24;
+
+enum StressLayout
+{
+    STRESS_SHARED,
+    STRESS_POOLED,
+    STRESS_PER_THREAD
+};
+
+struct StressWorker
+{
+    uint64_t seed;
+    tra_State*state;
+    unsigned long long calls;
+    unsigned long long corrupted;
+    TraLockCounts locks;
+    string first_failure;
+};
+
+static uint64_t next_random(uint64_t&seed)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+/*!
+ * One random program on state, checked against the same steps on ints.
+ * Values stay far inside 32 bits, so neither side overflows.
+ */
+static bool run_program(tra_State*state, uint64_t&seed, unsigned long long&calls, string&failure)
+{
+    TFT value(state, TRA_VARIABLE_zero_ALIAS_16);
+    TFT other(state, TRA_VARIABLE_zero_ALIAS_17);
+    TFT operand(state, TRA_VARIABLE_zero_ALIAS_18);
+    calls += 3;
+
+    long long expected = 0;
+    long long expected_other = 0;
+
+    for (int step = 0; step < STRESS_STEPS; step++)
+    {
+        const uint64_t random = next_random(seed);
+        const int constant = (int)((random >> 32) % 17) - 8;
+
+        // a large value is reset, which bounds it and its copy to a few million
+        const bool reset = expected > 100000 || expected < -100000;
+
+        switch (reset ? 0 : random % 7)
+        {
+            case 0:
+                value = constant;
+                expected = constant;
+                calls += 1;
+                break;
+            case 1:
+                operand = constant;
+                value += operand;
+                expected += constant;
+                calls += 2;
+                break;
+            case 2:
+                operand = constant;
+                value -= operand;
+                expected -= constant;
+                calls += 2;
+                break;
+            case 3:
+                operand = constant;
+                value *= operand;
+                expected *= constant;
+                calls += 2;
+                break;
+            case 4:
+                ++value;
+                expected++;
+                // the increment creates and deletes a constant TDT
+                calls += 3;
+                break;
+            case 5:
+                other = value;
+                expected_other = expected;
+                calls += 1;
+                break;
+            case 6:
+                value += other;
+                expected += expected_other;
+                calls += 1;
+                break;
+        }
+    }
+
+    const int actual = value.get();
+    operand = (int)expected;
+    const bool equal = value == operand;
+    calls += 4;
+
+    if (actual == expected && equal)
+    {
+        return true;
+    }
+
+    if (failure.empty())
+    {
+        stringstream stream;
+        stream << "expected " << expected << ", got " << actual << (equal ? "" : ", compare failed");
+        failure = stream.str();
+    }
+    return false;
+}
+
+struct StressRun
+{
+    unsigned long long programs;
+    unsigned long long calls;
+    unsigned long long corrupted;
+    unsigned long long acquired;
+    unsigned long long contended;
+    unsigned long long wait_nanoseconds;
+    double seconds;
+    string first_failure;
+};
+
+static StressRun run_layout(StressLayout layout, int threads)
+{
+    vector<StressWorker> workers(threads);
+    vector<tra_State*> states;
+
+    if (STRESS_POOLED == layout)
+    {
+        const int pool = threads / 4 > 0 ? threads / 4 : 1;
+        for (int i = 0; i < pool; i++)
+        {
+            states.push_back(tra_load_nova_declarative_data());
+        }
+    }
+
+    atomic<int> ready(0);
+    atomic<bool> go(false);
+
+    const auto work = [&](int index)
+    {
+        StressWorker&worker = workers[index];
+        worker.seed = 0x9E3779B97F4A7C15ULL * (uint64_t)(index + 1);
+        worker.calls = 0;
+        worker.corrupted = 0;
+
+        // binds the node state for the shared layout, and holds off a fork
+        TraScope scope;
+
+        tra_State*own = NULL;
+        switch (layout)
+        {
+            case STRESS_SHARED:
+                worker.state = tra;
+                break;
+            case STRESS_POOLED:
+                worker.state = states[index % states.size()];
+                break;
+            case STRESS_PER_THREAD:
+                own = tra_load_nova_declarative_data();
+                worker.state = own;
+                break;
+        }
+
+        ready++;
+        while (!go.load())
+        {
+            this_thread::yield();
+        }
+
+        const TraLockCounts before = tra_lock_counts();
+        for (int i = 0; i < STRESS_PROGRAMS; i++)
+        {
+            if (!run_program(worker.state, worker.seed, worker.calls, worker.first_failure))
+            {
+                worker.corrupted++;
+            }
+        }
+        const TraLockCounts after = tra_lock_counts();
+        worker.locks.acquired = after.acquired - before.acquired;
+        worker.locks.contended = after.contended - before.contended;
+        worker.locks.wait_nanoseconds = after.wait_nanoseconds - before.wait_nanoseconds;
+
+        if (own)
+        {
+            tra_close(own);
+        }
+    };
+
+    vector<thread> pool;
+    for (int i = 0; i < threads; i++)
+    {
+        pool.push_back(thread(work, i));
+    }
+    while (ready.load() < threads)
+    {
+        this_thread::yield();
+    }
+
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    go = true;
+    for (int i = 0; i < threads; i++)
+    {
+        pool[i].join();
+    }
+
+    StressRun run = StressRun();
+    run.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    for (int i = 0; i < threads; i++)
+    {
+        run.programs += STRESS_PROGRAMS;
+        run.calls += workers[i].calls;
+        run.corrupted += workers[i].corrupted;
+        run.acquired += workers[i].locks.acquired;
+        run.contended += workers[i].locks.contended;
+        run.wait_nanoseconds += workers[i].locks.wait_nanoseconds;
+        if (run.first_failure.empty())
+        {
+            run.first_failure = workers[i].first_failure;
+        }
+    }
+    for (size_t i = 0; i < states.size(); i++)
+    {
+        tra_close(states[i]);
+    }
+
+    return run;
+}
+
+extern "C"
+{
+    /*!
+     * Throughput, measured lock waits and corruption of the shared, pooled
+     * and per-thread layouts at one thread and at threads threads (0 for
+     * one per CPU); passes when no program result was corrupted
+     */
+    bool LIB_EXPORT TestTraStress(int threads, stringstream&stream)
+    {
+        if (threads <= 0)
+        {
+            threads = (int)thread::hardware_concurrency();
+            threads = threads > 0 ? threads : 4;
+        }
+
+        static const char*const names[] = { "shared", "pooled", "per-thread" };
+
+        bool result = true;
+        for (int layout = STRESS_SHARED; layout <= STRESS_PER_THREAD; layout++)
+        {
+            const StressRun single = run_layout((StressLayout)layout, 1);
+            const StressRun many = run_layout((StressLayout)layout, threads);
+
+            stream << names[layout] << ": "
+                   << (unsigned long long)(single.calls / single.seconds) << " calls/s on 1 thread, "
+                   << (unsigned long long)(many.calls / many.seconds) << " calls/s on " << threads << ", "
+                   << (unsigned long long)(many.programs / many.seconds) << " programs/s, "
+                   << many.contended << " of " << many.acquired << " lock acquisitions waited, "
+                   << (many.calls ? many.wait_nanoseconds / many.calls : 0) << " ns wait/call, "
+                   << single.corrupted + many.corrupted << " corrupted";
+
+            const string&failure = single.first_failure.empty() ? many.first_failure : single.first_failure;
+            if (!failure.empty())
+            {
+                stream << " (" << failure << ")";
+            }
+            stream << std::endl;
+
+            result = result && 0 == single.corrupted && 0 == many.corrupted;
+        }
+
+        return result;
+    }
+
+    int LIB_EXPORT nova_test_tra_stress(int threads, char*out, size_t*out_length)
+    {
+        if (NULL == out_length)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        stringstream stream;
+
+        const bool result = TestTraStress(threads, stream);
+
+        const int copied = copy_out(stream.str(), out, out_length);
+
+        return NOVA_OK != copied ? copied : result ? NOVA_OK : NOVA_FAILED;
+    }
+}
+/* extern c */
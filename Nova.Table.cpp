@@ -0,0 +1,507 @@
+/*
+ * File:   Nova.Table.cpp
+ * Author: jools
+ *
+ * Columnar feature table for reporting over large license sets.
+ *
+ * A report over the features of a license walks an FlcFeatureCollectionRef
+ * with a handful of opaque getter calls per feature, for every request. A
+ * table reads the collection once per load into flat columns (start and
+ * expiration epochs, count, flags, interned name and version) and answers
+ * filter queries with a scan over those columns. The scan runs four rows a
+ * step with AVX2, two with SSE4.2, or one at a time, chosen once from what
+ * the CPU supports; the library itself is still built for baseline x86-64.
+ */
+
+#include "Nova.Internal.h"
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <sstream>
+#include <chrono>
+#include <limits>
+#include <ctime>
+#include <cstdint>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "Nova.h"
+#include "Nova.Abi.h"
+
+using namespace std;
+
+#include "FlcLicenseManager.h"
+#include "FlcFeature.h"
+
+/*!
+ * Rows are selected when start <= at, expires_from <= expiration <= expires_to
+ * and (flags & mask) == value, see nova_table_query
+ */
+struct TableColumns
+{
+    const int64_t*start;
+    const int64_t*expiration;
+    const uint32_t*flags;
+    size_t rows;
+};
+
+typedef size_t (*TableKernel)(const TableColumns&columns, const nova_table_query&query, uint32_t*out, size_t capacity);
+
+/*!
+ * Rows from first on, one at a time; also the tail of the vector kernels
+ */
+static size_t select_scalar_from(const TableColumns&columns, const nova_table_query&query, size_t first,
+                                 uint32_t*out, size_t capacity, size_t selected)
+{
+    for (size_t i = first; i < columns.rows; i++)
+    {
+        if (columns.start[i] <= query.at
+            && columns.expiration[i] >= query.expires_from && columns.expiration[i] <= query.expires_to
+            && (columns.flags[i] & query.flags_mask) == query.flags_value)
+        {
+            if (selected < capacity)
+            {
+                out[selected] = (uint32_t)i;
+            }
+            selected++;
+        }
+    }
+    return selected;
+}
+
+static size_t select_scalar(const TableColumns&columns, const nova_table_query&query, uint32_t*out, size_t capacity)
+{
+    return select_scalar_from(columns, query, 0, out, capacity, 0);
+}
+
+#if defined(__x86_64__)
+
+/*!
+ * Append the rows of a lane mask
+ */
+static inline size_t emit(unsigned int mask, size_t base, uint32_t*out, size_t capacity, size_t selected)
+{
+    while (mask)
+    {
+        if (selected < capacity)
+        {
+            out[selected] = (uint32_t)(base + __builtin_ctz(mask));
+        }
+        selected++;
+        mask &= mask - 1;
+    }
+    return selected;
+}
+
+__attribute__((target("sse4.2")))
+static size_t select_sse(const TableColumns&columns, const nova_table_query&query, uint32_t*out, size_t capacity)
+{
+    const __m128i at = _mm_set1_epi64x(query.at);
+    const __m128i from = _mm_set1_epi64x(query.expires_from);
+    const __m128i to = _mm_set1_epi64x(query.expires_to);
+    const __m128i mask = _mm_set1_epi64x(query.flags_mask);
+    const __m128i value = _mm_set1_epi64x(query.flags_value);
+
+    size_t selected = 0;
+    size_t i = 0;
+    for (; i + 2 <= columns.rows; i += 2)
+    {
+        const __m128i start = _mm_loadu_si128((const __m128i*)(columns.start + i));
+        const __m128i expiration = _mm_loadu_si128((const __m128i*)(columns.expiration + i));
+        const __m128i flags = _mm_cvtepu32_epi64(_mm_loadl_epi64((const __m128i*)(columns.flags + i)));
+
+        const __m128i reject = _mm_or_si128(_mm_cmpgt_epi64(start, at),
+                                            _mm_or_si128(_mm_cmpgt_epi64(from, expiration), _mm_cmpgt_epi64(expiration, to)));
+        const __m128i match = _mm_andnot_si128(reject, _mm_cmpeq_epi64(_mm_and_si128(flags, mask), value));
+
+        selected = emit((unsigned int)_mm_movemask_pd(_mm_castsi128_pd(match)), i, out, capacity, selected);
+    }
+    return select_scalar_from(columns, query, i, out, capacity, selected);
+}
+
+__attribute__((target("avx2")))
+static size_t select_avx2(const TableColumns&columns, const nova_table_query&query, uint32_t*out, size_t capacity)
+{
+    const __m256i at = _mm256_set1_epi64x(query.at);
+    const __m256i from = _mm256_set1_epi64x(query.expires_from);
+    const __m256i to = _mm256_set1_epi64x(query.expires_to);
+    const __m256i mask = _mm256_set1_epi64x(query.flags_mask);
+    const __m256i value = _mm256_set1_epi64x(query.flags_value);
+
+    size_t selected = 0;
+    size_t i = 0;
+    for (; i + 4 <= columns.rows; i += 4)
+    {
+        const __m256i start = _mm256_loadu_si256((const __m256i*)(columns.start + i));
+        const __m256i expiration = _mm256_loadu_si256((const __m256i*)(columns.expiration + i));
+        const __m256i flags = _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i*)(columns.flags + i)));
+
+        const __m256i reject = _mm256_or_si256(_mm256_cmpgt_epi64(start, at),
+                                               _mm256_or_si256(_mm256_cmpgt_epi64(from, expiration), _mm256_cmpgt_epi64(expiration, to)));
+        const __m256i match = _mm256_andnot_si256(reject, _mm256_cmpeq_epi64(_mm256_and_si256(flags, mask), value));
+
+        selected = emit((unsigned int)_mm256_movemask_pd(_mm256_castsi256_pd(match)), i, out, capacity, selected);
+    }
+    return select_scalar_from(columns, query, i, out, capacity, selected);
+}
+
+#endif
+
+static TableKernel best_kernel()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return select_avx2;
+    }
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        return select_sse;
+    }
+#endif
+    return select_scalar;
+}
+
+static const TableKernel table_kernel = best_kernel();
+
+/*!
+ * Seconds since the epoch of an SDK date taken as UTC midnight
+ */
+static int64_t epoch_of(const struct tm*date, int64_t missing)
+{
+    if (NULL == date)
+    {
+        return missing;
+    }
+
+    struct tm copy = *date;
+    return (int64_t)timegm(&copy);
+}
+
+class CTable
+{
+    vector<int64_t> m_start;
+    vector<int64_t> m_expiration;
+    vector<int32_t> m_count;
+    vector<uint32_t> m_flags;
+    vector<uint32_t> m_name;
+    vector<uint32_t> m_version;
+
+    vector<string> m_strings;
+    unordered_map<string, uint32_t> m_interned;
+
+public:
+    CTable()
+    {
+    }
+
+    virtual~CTable()
+    {
+    }
+
+    /*!
+     * One pass over the feature collection of a licensing environment
+     */
+    bool load(FlcLicensingRef licensing, FlcErrorRef error)
+    {
+        FlcFeatureCollectionRef features = 0;
+        FlcSize size = 0;
+        if (!FlcGetFeatureCollection(licensing, &features, error) || !FlcFeatureCollectionSize(features, &size, error))
+        {
+            if (features)
+            {
+                FlcFeatureCollectionDelete(&features, NULL);
+            }
+            return false;
+        }
+
+        m_start.reserve(size);
+        m_expiration.reserve(size);
+        m_count.reserve(size);
+        m_flags.reserve(size);
+        m_name.reserve(size);
+        m_version.reserve(size);
+
+        for (FlcSize i = 0; i < size; i++)
+        {
+            FlcFeatureRef feature = 0;
+            const FlcChar*name = 0;
+            const FlcChar*version = 0;
+            if (!FlcFeatureCollectionGet(features, &feature, (FlcUInt32)i, error)
+                || !FlcFeatureGetName(feature, &name, error)
+                || !FlcFeatureGetVersion(feature, &version, error))
+            {
+                continue;
+            }
+
+            FlcBool metered = FLC_FALSE, served = FLC_FALSE, uncounted = FLC_FALSE, perpetual = FLC_FALSE, reusable = FLC_FALSE;
+            FlcFeatureIsMetered(feature, &metered, NULL);
+            FlcFeatureIsMeteredReusable(feature, &reusable, NULL);
+            FlcFeatureIsServed(feature, &served, NULL);
+            FlcFeatureIsUncounted(feature, &uncounted, NULL);
+            FlcFeatureIsPerpetual(feature, &perpetual, NULL);
+
+            uint32_t flags = 0;
+            flags |= metered ? NOVA_FEATURE_METERED : 0;
+            flags |= reusable ? NOVA_FEATURE_REUSABLE : 0;
+            flags |= served ? NOVA_FEATURE_SERVED : 0;
+            flags |= uncounted ? NOVA_FEATURE_UNCOUNTED : 0;
+            flags |= perpetual ? NOVA_FEATURE_PERPETUAL : 0;
+
+            const struct tm*date = 0;
+            m_start.push_back(FlcFeatureGetStartDate(feature, &date, NULL) ? epoch_of(date, numeric_limits<int64_t>::min()) : numeric_limits<int64_t>::min());
+            m_expiration.push_back(perpetual || !FlcFeatureGetExpiration(feature, &date, NULL)
+                                   ? numeric_limits<int64_t>::max() : epoch_of(date, numeric_limits<int64_t>::max()));
+
+            FlcInt32 count = 0;
+            FlcFeatureGetCount(feature, &count, NULL);
+            m_count.push_back(count);
+
+            m_flags.push_back(flags);
+            m_name.push_back(intern(name));
+            m_version.push_back(intern(version));
+        }
+
+        FlcFeatureCollectionDelete(&features, NULL);
+        return true;
+    }
+
+    size_t rows() const
+    {
+        return m_start.size();
+    }
+
+    size_t select(const nova_table_query&query, uint32_t*out, size_t capacity, TableKernel kernel = table_kernel) const
+    {
+        TableColumns columns;
+        columns.start = m_start.empty() ? NULL : &m_start[0];
+        columns.expiration = m_expiration.empty() ? NULL : &m_expiration[0];
+        columns.flags = m_flags.empty() ? NULL : &m_flags[0];
+        columns.rows = m_start.size();
+
+        return kernel(columns, query, out, capacity);
+    }
+
+    void row(size_t index, nova_table_row&row) const
+    {
+        row.name = m_strings[m_name[index]].c_str();
+        row.version = m_strings[m_version[index]].c_str();
+        row.name_id = m_name[index];
+        row.start = m_start[index];
+        row.expiration = m_expiration[index];
+        row.count = m_count[index];
+        row.flags = m_flags[index];
+    }
+
+private:
+    uint32_t intern(const char*value)
+    {
+        const string key(value);
+
+        unordered_map<string, uint32_t>::const_iterator found = m_interned.find(key);
+        if (found != m_interned.end())
+        {
+            return found->second;
+        }
+
+        const uint32_t id = (uint32_t)m_strings.size();
+        m_strings.push_back(key);
+        m_interned[key] = id;
+        return id;
+    }
+};
+
+/*!
+ * Table of the license file (or directory) at path
+ */
+static CTable* open_table(const string&path, string&message)
+{
+    TraScope scope;
+
+    const int node = tra.node();
+    FlcErrorRef error = 0;
+    FlcLicensingRef licensing = 0;
+
+    CTable*table = new CTable();
+
+    if (!FlcErrorCreate(&error)
+        || !create_licensing(node, &licensing, error)
+        || !add_license_sources(licensing, path, error)
+        || !table->load(licensing, error))
+    {
+        message = error ? FlcErrorGetMessage(error) : "";
+        delete table;
+        table = NULL;
+    }
+
+    tra.release_licensing(node, &licensing);
+
+    if (error)
+    {
+        FlcErrorDelete(&error);
+    }
+    return table;
+}
+
+extern "C"
+{
+    int LIB_EXPORT nova_table_open(const char*lic, size_t lic_length, nova_table**table)
+    {
+        if (NULL == lic || NULL == table)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        string message;
+        CTable*loaded = open_table(string(lic, lic_length), message);
+        if (NULL == loaded)
+        {
+            DEBUG_PRINT("### table open %s\n", message.c_str());
+            return NOVA_FAILED;
+        }
+
+        *table = (nova_table*)loaded;
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_table_rows(const nova_table*table, size_t*rows)
+    {
+        if (NULL == table || NULL == rows)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        *rows = ((const CTable*)table)->rows();
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_table_select(const nova_table*table, const nova_table_query*query,
+                                     unsigned int*out_rows, size_t*count)
+    {
+        if (NULL == table || NULL == query || NULL == count || (NULL == out_rows && *count))
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        const size_t capacity = *count;
+        *count = ((const CTable*)table)->select(*query, out_rows, capacity);
+
+        return *count > capacity ? NOVA_ERROR_BUFFER_SIZE : NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_table_get(const nova_table*table, unsigned int index, nova_table_row*row)
+    {
+        if (NULL == table || NULL == row || index >= ((const CTable*)table)->rows())
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        ((const CTable*)table)->row(index, *row);
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_table_close(nova_table*table)
+    {
+        if (NULL == table)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        delete (CTable*)table;
+        return NOVA_OK;
+    }
+
+    bool LIB_EXPORT TestTable(const string&licenseFilePath, stringstream&stream)
+    {
+        const int rounds = 1000;
+
+        const chrono::steady_clock::time_point loading = chrono::steady_clock::now();
+
+        string message;
+        CTable*table = open_table(licenseFilePath, message);
+        if (NULL == table)
+        {
+            stream << "table open failed: " << message << std::endl;
+            return false;
+        }
+
+        const chrono::duration<double, milli> loaded = chrono::steady_clock::now() - loading;
+        stream << table->rows() << " features loaded in " << loaded.count() << " ms" << std::endl;
+
+        const int64_t now = (int64_t)time(NULL);
+
+        nova_table_query queries[3];
+        const char*names[3] = { "valid now", "expiring within 30 days", "served" };
+
+        queries[0].at = now;
+        queries[0].expires_from = now;
+        queries[0].expires_to = numeric_limits<int64_t>::max();
+        queries[0].flags_mask = 0;
+        queries[0].flags_value = 0;
+
+        queries[1] = queries[0];
+        queries[1].expires_to = now + 30 * 86400;
+
+        queries[2].at = numeric_limits<int64_t>::max();
+        queries[2].expires_from = numeric_limits<int64_t>::min();
+        queries[2].expires_to = numeric_limits<int64_t>::max();
+        queries[2].flags_mask = NOVA_FEATURE_SERVED;
+        queries[2].flags_value = NOVA_FEATURE_SERVED;
+
+        TableKernel kernels[3] = { select_scalar, table_kernel, table_kernel };
+        const char*kernel_names[3] = { "scalar", "best", "" };
+        int kernel_count = 2;
+#if defined(__x86_64__)
+        kernels[1] = select_sse;
+        kernels[2] = select_avx2;
+        kernel_names[1] = "sse4.2";
+        kernel_names[2] = "avx2";
+        kernel_count = __builtin_cpu_supports("avx2") ? 3 : __builtin_cpu_supports("sse4.2") ? 2 : 1;
+#endif
+
+        vector<uint32_t> rows(table->rows() + 1);
+        vector<uint32_t> expected_rows(rows.size());
+        bool result = true;
+
+        for (int q = 0; q < 3; q++)
+        {
+            stream << names[q] << ":";
+
+            size_t expected = 0;
+            for (int k = 0; k < kernel_count; k++)
+            {
+                size_t selected = 0;
+
+                const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+                for (int r = 0; r < rounds; r++)
+                {
+                    selected = table->select(queries[q], &rows[0], rows.size(), kernels[k]);
+                }
+                const chrono::duration<double, micro> elapsed = chrono::steady_clock::now() - start;
+
+                // the scalar kernel runs first, every other one has to pick the same rows in the same order
+                if (0 == k)
+                {
+                    expected = selected;
+                    expected_rows.assign(rows.begin(), rows.begin() + selected);
+                }
+                const bool same = selected == expected && equal(expected_rows.begin(), expected_rows.begin() + expected, rows.begin());
+                result = result && same;
+
+                stream << " " << kernel_names[k] << " " << selected << " rows " << elapsed.count() / rounds << " us"
+                       << (same ? "" : " MISMATCH");
+            }
+            stream << std::endl;
+        }
+
+        delete table;
+
+        return result;
+    }
+}
+/* extern c */
@@ -0,0 +1,426 @@
+/*
+ * File:   Nova.Trace.cpp
+ * Author: jools
+ *
+ * Recorder of production call traces for offline replay.
+ *
+ * Production load could not be reproduced against a new build. With a
+ * trace started, by nova_trace_start or by NOVA_TRACE=<file> in the
+ * environment of the process, every process call appends a fixed size
+ * record (see Nova.Trace.h) to a buffer of its thread, and the buffer is
+ * written out with one write() once it holds 64 KiB, when the thread exits
+ * and when the trace is stopped. License paths and data are hashed, and
+ * each thread writes the path of a source once. License bytes are only
+ * written with NOVA_TRACE_LICENSE_DATA (or NOVA_TRACE_DATA=1), so the
+ * replay driver can feed the same licenses back in; otherwise it needs
+ * --license. The file is created 0600 either way. Without a trace a call
+ * costs one relaxed load.
+ *
+ * A forked child stops recording, its calls would otherwise land in the
+ * parent's file.
+ */
+
+#include "Nova.Internal.h"
+
+#include <string>
+#include <vector>
+#include <set>
+#include <unordered_set>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+#include "Nova.Abi.h"
+#include "Nova.Trace.h"
+
+using namespace std;
+
+// bytes a thread collects before writing them out
+static const size_t TRACE_FLUSH = 65536;
+
+static atomic<bool> s_enabled(false);
+
+// whether license bytes go into the trace, not only their hash
+static atomic<bool> s_data(false);
+
+// bumped by every start, stop and fork child; buffers of an older session are dropped
+static atomic<unsigned int> s_session(0);
+
+// guards the buffer registry, the file and the session changes
+static mutex s_lock;
+static int s_fd = -1;
+static atomic<unsigned long long> s_base(0);
+
+/*!
+ * fnv1a64, never 0 so that 0 can mean no source
+ */
+static uint64_t source_hash(const void*value, size_t length)
+{
+    const uint64_t hash = fnv1a64(value, length);
+    return hash ? hash : 1;
+}
+
+/*!
+ * Called with s_lock held
+ */
+static void write_out(const char*bytes, size_t size)
+{
+    while (s_fd >= 0 && size)
+    {
+        const ssize_t written = ::write(s_fd, bytes, size);
+        if (written <= 0)
+        {
+            // a full disk ends the trace rather than the process
+            close(s_fd);
+            s_fd = -1;
+            s_enabled = false;
+            return;
+        }
+        bytes += written;
+        size -= (size_t)written;
+    }
+}
+
+class CTraceBuffer;
+
+static set<CTraceBuffer*> s_buffers;
+
+class CTraceBuffer
+{
+    // taken by the owning thread for each record and by a stop for the flush
+    mutex m_lock;
+    vector<char> m_bytes;
+    unordered_set<uint64_t> m_sources;
+    unsigned int m_session;
+    unsigned int m_thread;
+    bool m_registered;
+
+public:
+    CTraceBuffer() : m_session(0), m_thread((unsigned int)syscall(SYS_gettid)), m_registered(false)
+    {
+    }
+
+    virtual~CTraceBuffer()
+    {
+        lock_guard<mutex> guard(s_lock);
+        if (m_registered)
+        {
+            s_buffers.erase(this);
+            flush_locked();
+        }
+    }
+
+    unsigned int thread() const
+    {
+        return m_thread;
+    }
+
+    /*!
+     * Append a blob with the source unless this thread already wrote it
+     */
+    void source(uint64_t hash, unsigned short kind, const void*value, size_t length)
+    {
+        lock_guard<mutex> guard(m_lock);
+        if (!current() || !m_sources.insert(hash).second)
+        {
+            return;
+        }
+
+        nova_trace_record record;
+        memset(&record, 0, sizeof record);
+        record.type = NOVA_TRACE_BLOB;
+        record.entry = kind;
+        record.thread = m_thread;
+        record.source = hash;
+        record.length = (unsigned int)length;
+
+        append(&record, sizeof record);
+        append(value, length);
+
+        static const char padding[8] = { 0 };
+        append(padding, (8 - length % 8) % 8);
+    }
+
+    void call(const nova_trace_record&record)
+    {
+        vector<char> full;
+        {
+            lock_guard<mutex> guard(m_lock);
+            if (!current())
+            {
+                return;
+            }
+
+            append(&record, sizeof record);
+            if (m_bytes.size() < TRACE_FLUSH)
+            {
+                return;
+            }
+
+            // written outside m_lock, a stop takes s_lock before m_lock
+            full.swap(m_bytes);
+            m_bytes.reserve(TRACE_FLUSH + 4096);
+        }
+
+        lock_guard<mutex> guard(s_lock);
+        if (m_session == s_session.load())
+        {
+            write_out(full.data(), full.size());
+        }
+    }
+
+    /*!
+     * Called with s_lock held
+     */
+    void flush_locked()
+    {
+        lock_guard<mutex> guard(m_lock);
+        if (m_session == s_session.load())
+        {
+            write_out(m_bytes.data(), m_bytes.size());
+        }
+        m_bytes.clear();
+    }
+
+    /*!
+     * Called by a fork child, whose other threads are gone
+     */
+    void forget()
+    {
+        m_registered = false;
+        m_bytes.clear();
+        m_sources.clear();
+        m_thread = (unsigned int)syscall(SYS_gettid);
+    }
+
+private:
+    /*!
+     * Called with m_lock held. Joins the running session if this buffer
+     * is from an older one.
+     */
+    bool current()
+    {
+        const unsigned int session = s_session.load();
+        if (session == m_session)
+        {
+            return true;
+        }
+
+        m_bytes.clear();
+        m_sources.clear();
+        m_session = session;
+
+        if (!m_registered)
+        {
+            // not with m_lock held: a stop takes s_lock before m_lock
+            m_lock.unlock();
+            {
+                lock_guard<mutex> guard(s_lock);
+                s_buffers.insert(this);
+            }
+            m_lock.lock();
+            m_registered = true;
+        }
+
+        return session == s_session.load();
+    }
+
+    void append(const void*value, size_t length)
+    {
+        const char*bytes = (const char*)value;
+        m_bytes.insert(m_bytes.end(), bytes, bytes + length);
+    }
+};
+
+static thread_local CTraceBuffer t_trace;
+
+bool trace_active()
+{
+    return s_enabled.load(memory_order_relaxed);
+}
+
+TraceCall::TraceCall(int entry, const string&path, const unsigned char*data, size_t size) :
+    m_active(s_enabled.load(memory_order_relaxed)), m_result(NOVA_FAILED), m_start(0)
+{
+    if (!m_active)
+    {
+        return;
+    }
+
+    memset(&m_record, 0, sizeof m_record);
+    m_record.type = NOVA_TRACE_CALL;
+    m_record.entry = (unsigned short)entry;
+    m_record.thread = t_trace.thread();
+    m_record.length = (unsigned int)size;
+
+    // data is only the caller's for the length of the call, so its blob is taken now
+    if (data && size)
+    {
+        m_record.source = source_hash(data, size);
+        if (s_data.load(memory_order_relaxed))
+        {
+            t_trace.source(m_record.source, NOVA_TRACE_BLOB_DATA, data, size);
+        }
+    }
+    else if (!path.empty())
+    {
+        m_record.source = source_hash(path.data(), path.size());
+        t_trace.source(m_record.source, NOVA_TRACE_BLOB_PATH, path.data(), path.size());
+    }
+
+    m_start = monotonic_ns();
+}
+
+TraceCall::~TraceCall()
+{
+    if (!m_active)
+    {
+        return;
+    }
+
+    const unsigned long long end = monotonic_ns();
+
+    const unsigned long long base = s_base.load(memory_order_relaxed);
+    m_record.start = m_start > base ? m_start - base : 0;
+    m_record.duration = end - m_start;
+    m_record.result = m_result;
+
+    t_trace.call(m_record);
+}
+
+void TraceCall::result(int result)
+{
+    m_result = result;
+}
+
+static int trace_start(const char*file, int flags)
+{
+    lock_guard<mutex> guard(s_lock);
+
+    if (s_fd >= 0)
+    {
+        return NOVA_ERROR_ARGUMENT;
+    }
+
+    // license bytes and paths are nobody else's business; an existing file keeps its mode, so set it
+    const int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        return NOVA_ERROR_SYSTEM;
+    }
+    if (0 != fchmod(fd, 0600))
+    {
+        close(fd);
+        return NOVA_ERROR_SYSTEM;
+    }
+
+    nova_trace_header header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, NOVA_TRACE_MAGIC, sizeof header.magic);
+    header.version = NOVA_TRACE_VERSION;
+    header.record_size = sizeof(nova_trace_record);
+    header.realtime = clock_ns(CLOCK_REALTIME);
+    header.monotonic = monotonic_ns();
+
+    s_fd = fd;
+    s_base = header.monotonic;
+    write_out((const char*)&header, sizeof header);
+    if (s_fd < 0)
+    {
+        return NOVA_ERROR_SYSTEM;
+    }
+
+    s_data = 0 != (flags & NOVA_TRACE_LICENSE_DATA);
+    s_session++;
+    s_enabled = true;
+
+    return NOVA_OK;
+}
+
+static void on_fork_prepare()
+{
+    s_lock.lock();
+}
+
+static void on_fork_parent()
+{
+    s_lock.unlock();
+}
+
+static void on_fork_child()
+{
+    if (s_fd >= 0)
+    {
+        close(s_fd);
+        s_fd = -1;
+    }
+    s_enabled = false;
+    s_session++;
+
+    // the buffers of the other threads died with them
+    s_buffers.clear();
+    t_trace.forget();
+
+    s_lock.unlock();
+}
+
+static const int trace_fork = pthread_atfork(on_fork_prepare, on_fork_parent, on_fork_child);
+
+static int trace_environment()
+{
+    const char*file = getenv("NOVA_TRACE");
+    const char*data = getenv("NOVA_TRACE_DATA");
+    return file ? trace_start(file, data && '1' == data[0] ? NOVA_TRACE_LICENSE_DATA : 0) : NOVA_OK;
+}
+
+/*!
+ * NOVA_TRACE=<file> records from the moment the library is loaded
+ */
+static const int trace_environment_started = trace_environment();
+
+extern "C"
+{
+    int LIB_EXPORT nova_trace_start(const char*file, size_t file_length, int flags)
+    {
+        if (NULL == file || 0 == file_length || (flags & ~NOVA_TRACE_LICENSE_DATA))
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        return trace_start(string(file, file_length).c_str(), flags);
+    }
+
+    int LIB_EXPORT nova_trace_stop(void)
+    {
+        lock_guard<mutex> guard(s_lock);
+
+        if (s_fd < 0)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        s_enabled = false;
+
+        // calls still inside a TraceCall are dropped with their session
+        for (set<CTraceBuffer*>::iterator i = s_buffers.begin(); i != s_buffers.end(); ++i)
+        {
+            (*i)->flush_locked();
+        }
+        s_session++;
+
+        const int result = s_fd >= 0 && 0 == close(s_fd) ? NOVA_OK : NOVA_ERROR_SYSTEM;
+        s_fd = -1;
+
+        return result;
+    }
+}
+/* extern c */
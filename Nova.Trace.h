@@ -0,0 +1,62 @@
+/*
+ * File:   Nova.Trace.h
+ * Author: jools
+ *
+ * Layout of the call trace files written by nova_trace_start and read by
+ * the replay driver (replay/Nova.Replay.cpp).
+ *
+ * A file is a header and then records, each a nova_trace_record. Call
+ * records hold the entry point, the recording thread, when the call started
+ * and how long it took (nanoseconds from the header's monotonic base), the
+ * result, and the hash of its license path or data. The first time a thread
+ * sees a source, the hash is followed by a blob record with the path, or
+ * with the license bytes if the trace was started with
+ * NOVA_TRACE_LICENSE_DATA, padded to 8 bytes. Records from different
+ * threads are interleaved in flush order, so readers sort calls by start
+ * themselves.
+ * Everything is in host byte order.
+ */
+
+#ifndef NOVA_TRACE_H
+#define NOVA_TRACE_H
+
+#define NOVA_TRACE_MAGIC            "NOVATRC1"
+#define NOVA_TRACE_VERSION          1
+
+/* record types */
+#define NOVA_TRACE_CALL             1
+#define NOVA_TRACE_BLOB             2
+
+/* entry point of a call record */
+#define NOVA_TRACE_PROCESS          1   /* nova_process, path or none */
+#define NOVA_TRACE_PROCESS_DATA     2   /* nova_process_data */
+#define NOVA_TRACE_JAVA_PROCESS     3   /* Nova.process() */
+#define NOVA_TRACE_JAVA_BUFFER      4   /* Nova.processBuffer() */
+#define NOVA_TRACE_JAVA_BYTES       5   /* Nova.processBytes() */
+
+/* what a blob record holds, in its entry field */
+#define NOVA_TRACE_BLOB_PATH        1
+#define NOVA_TRACE_BLOB_DATA        2
+
+typedef struct nova_trace_header
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int record_size;
+    unsigned long long realtime;    /* CLOCK_REALTIME at start, ns */
+    unsigned long long monotonic;   /* CLOCK_MONOTONIC at start, ns */
+} nova_trace_header;
+
+typedef struct nova_trace_record
+{
+    unsigned short type;
+    unsigned short entry;
+    unsigned int thread;            /* kernel thread ID */
+    unsigned long long source;      /* FNV-1a of the path or data, 0 if none */
+    unsigned long long start;       /* call records only */
+    unsigned long long duration;
+    int result;                     /* NOVA_OK or NOVA_FAILED */
+    unsigned int length;            /* bytes of data, or of a blob's payload */
+} nova_trace_record;
+
+#endif /* NOVA_TRACE_H */
@@ -0,0 +1,657 @@
+/*
+ * File:   Nova.Usage.cpp
+ * Author: jools
+ *
+ * Batched usage capture for metered features.
+ *
+ * The usage_capture_client sample sends a capability request per usage
+ * event. Here workers add events to per-thread counters, and a flush thread
+ * merges them every flush window, or sooner once enough events are waiting,
+ * into one request carrying the summed desired-feature counts. Each batch
+ * is written to a spool directory and fsync'd before it is sent and only
+ * removed once the back office accepted it, so a crash loses at most the
+ * window being counted; spooled batches are sent again on the next open.
+ *
+ * Undo keeps the SDK's semantics per event: an event whose batch has not
+ * been merged yet is cancelled locally, otherwise the whole batch is undone
+ * by its correlation ID while FlcFeatureGetSecondsLeftInUndoInterval allows
+ * it and every other event of the batch is reported again.
+ */
+
+#include "Nova.Internal.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <memory>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Nova.Abi.h"
+
+using namespace std;
+
+#include "FlcCapabilityRequestOperation.h"
+
+// flushed batches remembered for undo
+static const size_t USAGE_MAX_SENT = 256;
+
+// how long close waits for batches still in flight before leaving them spooled
+static const int USAGE_CLOSE_SECONDS = 60;
+
+static atomic<unsigned long long> usage_serial(0);
+
+class CUsage : public enable_shared_from_this<CUsage>
+{
+    struct Shard
+    {
+        mutex lock;
+        unordered_map<string, long long> counts;
+        // batch the counts will be merged into, moved on by each swap
+        unsigned long long batch;
+
+        Shard() : batch(0)
+        {
+        }
+    };
+
+    struct Batch
+    {
+        unsigned long long sequence;
+        string correlation;
+        int operation;
+        map<string, long long> counts;
+        bool posted;
+
+        Batch() : sequence(0), operation(0), posted(false)
+        {
+        }
+    };
+
+    nova_exchange*m_exchange;
+    int m_operation;
+    string m_spool;
+    unsigned int m_flush_events;
+    int m_flush_ms;
+    const unsigned long long m_serial;
+    string m_prefix;
+
+    mutex m_lock;
+    condition_variable m_wake;
+    condition_variable m_idle;
+    vector<Shard*> m_shards;
+    atomic<unsigned long long> m_batch;
+    atomic<unsigned int> m_events;
+    map<string, long long> m_carry;
+    map<unsigned long long, unsigned long long> m_moved;
+    deque<Batch> m_unsent;
+    deque<Batch> m_sent;
+    unsigned long long m_recovered;
+    int m_inflight;
+    bool m_flush;
+    bool m_stop;
+    thread m_thread;
+
+public:
+    CUsage(nova_exchange*exchange, int operation, const string&spool, unsigned int flush_events, int flush_ms)
+        : m_exchange(exchange), m_operation(operation), m_spool(spool)
+        , m_flush_events(flush_events), m_flush_ms(flush_ms), m_serial(++usage_serial)
+        , m_batch(1), m_events(0), m_recovered(0), m_inflight(0), m_flush(false), m_stop(false)
+    {
+        random_device random;
+        char prefix[64];
+        snprintf(prefix, sizeof prefix, "nova-%08x%08x-", random(), random());
+        m_prefix = prefix;
+    }
+
+    virtual~CUsage()
+    {
+        for (size_t i = 0; i < m_shards.size(); i++)
+        {
+            delete m_shards[i];
+        }
+    }
+
+    /*!
+     * Pick up what an earlier process left in the spool and start flushing
+     */
+    void open()
+    {
+        lock_guard<mutex> guard(m_lock);
+
+        if (!m_spool.empty())
+        {
+            read_files(list_files(m_spool, ".usage"), [&](const string&, const unsigned char*data, size_t size, int failure)
+            {
+                Batch batch;
+                if (!failure && parse(string((const char*)data, size), batch))
+                {
+                    // never matches a token handed out by this process
+                    batch.sequence = 0;
+                    m_unsent.push_back(batch);
+                    m_recovered++;
+                }
+            });
+        }
+
+        m_thread = thread(&CUsage::run, this);
+    }
+
+    void close()
+    {
+        {
+            lock_guard<mutex> guard(m_lock);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        m_thread.join();
+
+        unique_lock<mutex> guard(m_lock);
+        m_idle.wait_for(guard, chrono::seconds(USAGE_CLOSE_SECONDS), [this]{ return 0 == m_inflight; });
+    }
+
+    void flush()
+    {
+        {
+            lock_guard<mutex> guard(m_lock);
+            m_flush = true;
+        }
+        m_wake.notify_all();
+    }
+
+    unsigned long long record(const string&feature, const string&version, int count)
+    {
+        Shard&shard = local();
+
+        unsigned long long token;
+        {
+            // the batch these counts are merged into, whenever the merge runs
+            lock_guard<mutex> guard(shard.lock);
+            token = shard.batch;
+            shard.counts[feature + '\n' + version] += count;
+        }
+
+        if (++m_events >= m_flush_events)
+        {
+            m_wake.notify_all();
+        }
+        return token;
+    }
+
+    int undo(unsigned long long token, const string&feature, const string&version, int count)
+    {
+        const string key = feature + '\n' + version;
+
+        Shard&shard = local();
+
+        unsigned long long batch;
+        {
+            // a merge holds m_lock over every shard swap, so no shard is half way
+            lock_guard<mutex> guard(m_lock);
+            batch = follow(token);
+
+            lock_guard<mutex> local(shard.lock);
+            if (batch == shard.batch)
+            {
+                shard.counts[key] -= count;
+                return NOVA_OK;
+            }
+        }
+
+        CapabilitySpec spec;
+        {
+            lock_guard<mutex> guard(m_lock);
+
+            for (size_t i = 0; i < m_unsent.size(); i++)
+            {
+                if (m_unsent[i].sequence == batch)
+                {
+                    // not accepted yet, try again once it has been
+                    return NOVA_PENDING;
+                }
+            }
+
+            deque<Batch>::iterator sent = m_sent.begin();
+            while (sent != m_sent.end() && sent->sequence != batch)
+            {
+                ++sent;
+            }
+            if (sent == m_sent.end())
+            {
+                return NOVA_ERROR_TICKET;
+            }
+
+            map<string, long long>::const_iterator counted = sent->counts.find(key);
+            if (counted == sent->counts.end() || counted->second < count)
+            {
+                return NOVA_ERROR_TICKET;
+            }
+
+            spec.operation = FLC_CAPABILITY_REQUEST_OPERATION_UNDO;
+            spec.correlation = sent->correlation;
+        }
+
+        if (exchange_undo_seconds(m_exchange, feature, version) <= 0)
+        {
+            // the undo interval is over, as the SDK would refuse it
+            return NOVA_FAILED;
+        }
+
+        Batch undone;
+        {
+            lock_guard<mutex> guard(m_lock);
+
+            deque<Batch>::iterator sent = m_sent.begin();
+            while (sent != m_sent.end() && sent->sequence != batch)
+            {
+                ++sent;
+            }
+            if (sent == m_sent.end())
+            {
+                return NOVA_ERROR_TICKET;
+            }
+
+            undone = *sent;
+            undone.counts[key] -= count;
+            m_sent.erase(sent);
+            m_inflight++;
+        }
+
+        shared_ptr<CUsage> self = shared_from_this();
+        const int result = exchange_post(m_exchange, spec, [self, undone, key, count](int result, int)
+        {
+            self->undone(undone, key, count, result);
+        });
+
+        if (NOVA_OK != result)
+        {
+            this->undone(undone, key, count, NOVA_FAILED);
+        }
+        return result;
+    }
+
+private:
+    Shard&local()
+    {
+        thread_local unordered_map<unsigned long long, Shard*> shards;
+
+        Shard*&shard = shards[m_serial];
+        if (NULL == shard)
+        {
+            shard = new Shard();
+
+            lock_guard<mutex> guard(m_lock);
+            shard->batch = m_batch.load();
+            m_shards.push_back(shard);
+        }
+        return *shard;
+    }
+
+    /*!
+     * Called with m_lock held; the batch an undone batch's events went to
+     */
+    unsigned long long follow(unsigned long long token)
+    {
+        for (map<unsigned long long, unsigned long long>::iterator moved = m_moved.find(token); moved != m_moved.end(); moved = m_moved.find(token))
+        {
+            token = moved->second;
+        }
+        return token;
+    }
+
+    void run()
+    {
+        unique_lock<mutex> guard(m_lock);
+
+        while (!m_stop)
+        {
+            m_wake.wait_for(guard, chrono::milliseconds(m_flush_ms), [this]{ return m_stop || m_flush || m_events >= m_flush_events; });
+            m_flush = false;
+            flush_window(guard);
+        }
+
+        // the last partial window
+        flush_window(guard);
+    }
+
+    /*!
+     * Called with m_lock held
+     */
+    void flush_window(unique_lock<mutex>&guard)
+    {
+        Batch batch;
+        batch.sequence = m_batch.load();
+        batch.operation = m_operation;
+        batch.counts.swap(m_carry);
+
+        m_events = 0;
+
+        for (size_t i = 0; i < m_shards.size(); i++)
+        {
+            unordered_map<string, long long> counts;
+            {
+                lock_guard<mutex> shard(m_shards[i]->lock);
+                counts.swap(m_shards[i]->counts);
+                m_shards[i]->batch = batch.sequence + 1;
+            }
+
+            for (unordered_map<string, long long>::iterator j = counts.begin(); j != counts.end(); ++j)
+            {
+                batch.counts[j->first] += j->second;
+            }
+        }
+
+        // new shards start in the next batch from here on
+        m_batch = batch.sequence + 1;
+
+        for (map<string, long long>::iterator i = batch.counts.begin(); i != batch.counts.end();)
+        {
+            if (0 == i->second)
+            {
+                batch.counts.erase(i++);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+
+        if (!batch.counts.empty())
+        {
+            stringstream correlation;
+            correlation << m_prefix << batch.sequence;
+            batch.correlation = correlation.str();
+
+            if (!spool(batch))
+            {
+                DEBUG_PRINT("### usage spool %s\n", strerror(errno));
+            }
+            m_unsent.push_back(batch);
+        }
+
+        vector<CapabilitySpec> specs;
+        for (size_t i = 0; i < m_unsent.size(); i++)
+        {
+            if (!m_unsent[i].posted)
+            {
+                m_unsent[i].posted = true;
+                m_inflight++;
+                specs.push_back(request(m_unsent[i]));
+            }
+        }
+
+        if (specs.empty())
+        {
+            return;
+        }
+
+        shared_ptr<CUsage> self = shared_from_this();
+
+        // generating the requests takes the exchange's SDK lock
+        guard.unlock();
+
+        vector<string> failed;
+        for (size_t i = 0; i < specs.size(); i++)
+        {
+            const string correlation = specs[i].correlation;
+            if (NOVA_OK != exchange_post(m_exchange, specs[i], [self, correlation](int result, int)
+                {
+                    self->posted(correlation, result);
+                }))
+            {
+                failed.push_back(correlation);
+            }
+        }
+
+        guard.lock();
+
+        for (size_t i = 0; i < failed.size(); i++)
+        {
+            complete(failed[i], NOVA_FAILED);
+        }
+    }
+
+    static CapabilitySpec request(const Batch&batch)
+    {
+        CapabilitySpec spec;
+        spec.operation = batch.operation;
+        spec.correlation = batch.correlation;
+
+        for (map<string, long long>::const_iterator i = batch.counts.begin(); i != batch.counts.end(); ++i)
+        {
+            const size_t split = i->first.find('\n');
+
+            CapabilitySpec::Feature feature;
+            feature.name = i->first.substr(0, split);
+            feature.version = i->first.substr(split + 1);
+            feature.count = i->second > INT_MAX ? INT_MAX : i->second < INT_MIN ? INT_MIN : (int)i->second;
+            spec.features.push_back(feature);
+        }
+        return spec;
+    }
+
+    void posted(const string&correlation, int result)
+    {
+        lock_guard<mutex> guard(m_lock);
+        complete(correlation, result);
+    }
+
+    /*!
+     * Called with m_lock held
+     */
+    void complete(const string&correlation, int result)
+    {
+        m_inflight--;
+        m_idle.notify_all();
+
+        for (deque<Batch>::iterator i = m_unsent.begin(); i != m_unsent.end(); ++i)
+        {
+            if (i->correlation != correlation)
+            {
+                continue;
+            }
+
+            if (NOVA_OK != result)
+            {
+                // spooled still, goes again with the same correlation ID
+                i->posted = false;
+                return;
+            }
+
+            if (!m_spool.empty())
+            {
+                unlink((m_spool + "/" + correlation + ".usage").c_str());
+            }
+
+            if (i->sequence)
+            {
+                m_sent.push_back(*i);
+                if (m_sent.size() > USAGE_MAX_SENT)
+                {
+                    m_sent.pop_front();
+                }
+            }
+            m_unsent.erase(i);
+            return;
+        }
+    }
+
+    /*!
+     * Everything but the undone event goes into the next batch, and the
+     * tokens of the old batch follow it there. A refused undo puts the batch
+     * back as it was sent, with the undone count of key added back.
+     */
+    void undone(const Batch&batch, const string&key, long long count, int result)
+    {
+        lock_guard<mutex> guard(m_lock);
+
+        m_inflight--;
+        m_idle.notify_all();
+
+        if (NOVA_OK != result)
+        {
+            Batch kept = batch;
+            kept.counts[key] += count;
+            m_sent.push_back(kept);
+            return;
+        }
+
+        for (map<string, long long>::const_iterator i = batch.counts.begin(); i != batch.counts.end(); ++i)
+        {
+            m_carry[i->first] += i->second;
+        }
+        m_moved[batch.sequence] = m_batch.load();
+    }
+
+    /*!
+     * Called with m_lock held. Written to a temporary name, synced and
+     * renamed so a crash leaves either the whole batch or nothing.
+     */
+    bool spool(const Batch&batch)
+    {
+        if (m_spool.empty())
+        {
+            return true;
+        }
+
+        stringstream stream;
+        stream << "nova-usage 1\n" << batch.correlation << '\n' << batch.operation << '\n';
+        for (map<string, long long>::const_iterator i = batch.counts.begin(); i != batch.counts.end(); ++i)
+        {
+            stream << i->second << '\n' << i->first << '\n';
+        }
+        const string content = stream.str();
+
+        const string path = m_spool + "/" + batch.correlation + ".usage";
+        const string temporary = path + ".tmp";
+
+        const int file = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (file < 0)
+        {
+            return false;
+        }
+
+        bool written = (ssize_t)content.size() == write(file, content.data(), content.size()) && 0 == fsync(file);
+        ::close(file);
+
+        written = written && 0 == rename(temporary.c_str(), path.c_str());
+
+        const int directory = ::open(m_spool.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (directory >= 0)
+        {
+            written = written && 0 == fsync(directory);
+            ::close(directory);
+        }
+        return written;
+    }
+
+    static bool parse(const string&content, Batch&batch)
+    {
+        stringstream stream(content);
+
+        string magic, count, feature, version;
+        if (!getline(stream, magic) || "nova-usage 1" != magic
+            || !getline(stream, batch.correlation) || !(stream >> batch.operation) || !stream.ignore())
+        {
+            return false;
+        }
+
+        while (getline(stream, count) && getline(stream, feature) && getline(stream, version))
+        {
+            batch.counts[feature + '\n' + version] += strtoll(count.c_str(), NULL, 10);
+        }
+        return !batch.counts.empty();
+    }
+};
+
+extern "C"
+{
+    int LIB_EXPORT nova_usage_open(nova_exchange*exchange, int operation,
+                                   const char*spool, size_t spool_length,
+                                   unsigned int flush_events, int flush_ms,
+                                   nova_usage**usage)
+    {
+        if (NULL == exchange || (NULL == spool && spool_length) || 0 == flush_events || flush_ms < 1 || NULL == usage
+            || (FLC_CAPABILITY_REQUEST_OPERATION_REQUEST != operation && FLC_CAPABILITY_REQUEST_OPERATION_REPORT != operation))
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        shared_ptr<CUsage>*aggregator = new shared_ptr<CUsage>(new CUsage(exchange, operation,
+            spool ? string(spool, spool_length) : string(), flush_events, flush_ms));
+
+        (*aggregator)->open();
+
+        *usage = (nova_usage*)aggregator;
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_usage_record(nova_usage*usage, const char*feature, const char*version, int count,
+                                     unsigned long long*token)
+    {
+        if (NULL == usage || NULL == feature || NULL == version)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        const unsigned long long batch = (*(shared_ptr<CUsage>*)usage)->record(feature, version, count);
+        if (token)
+        {
+            *token = batch;
+        }
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_usage_undo(nova_usage*usage, unsigned long long token,
+                                   const char*feature, const char*version, int count)
+    {
+        if (NULL == usage || NULL == feature || NULL == version || count < 1)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        return (*(shared_ptr<CUsage>*)usage)->undo(token, feature, version, count);
+    }
+
+    int LIB_EXPORT nova_usage_flush(nova_usage*usage)
+    {
+        if (NULL == usage)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        (*(shared_ptr<CUsage>*)usage)->flush();
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_usage_close(nova_usage*usage)
+    {
+        if (NULL == usage)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        shared_ptr<CUsage>*aggregator = (shared_ptr<CUsage>*)usage;
+        (*aggregator)->close();
+
+        // completions still queued on the exchange hold their own reference
+        delete aggregator;
+        return NOVA_OK;
+    }
+}
+/* extern c */
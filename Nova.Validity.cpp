@@ -0,0 +1,352 @@
+/*
+ * File:   Nova.Validity.cpp
+ * Author: jools
+ *
+ * Cached answer to "is the license still valid?".
+ *
+ * Asking the SDK means acquiring the license again, a full FNE pass. Yet the
+ * answer can only change at a few known times: a feature expiring, its
+ * grace period ending, a start date arriving or trusted storage falling due
+ * for an update. A validity oracle acquires once, works out the earliest of
+ * those times over every feature, and until then answers from a single
+ * clock read. The wall clock being wound back past a tolerance is caught by
+ * the same read and forces an early recheck, as does nova_validity_recheck.
+ */
+
+#include "Nova.Internal.h"
+
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <ctime>
+
+#include "Nova.Abi.h"
+
+using namespace std;
+
+#include "FlcLicenseManager.h"
+#include "FlcFeature.h"
+#include "FlcServerUpdateInformation.h"
+#include "FlcWindbackDetection.h"
+
+// a valid answer is never kept longer than this, seconds
+static const long long VALIDITY_MAX_SECONDS = 86400;
+
+// nor an invalid one, or one close to a date that matters
+static const long long VALIDITY_MIN_SECONDS = 60;
+
+// feature dates carry no zone, so each one is watched over this much either side
+static const long long VALIDITY_DATE_MARGIN = 86400;
+
+// the wall clock may step back this far before a recheck is forced
+static const long long VALIDITY_WINDBACK_TOLERANCE = 5;
+
+/*!
+ * Wall clock seconds from the vDSO, without a system call
+ */
+static long long wall_seconds()
+{
+    timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    return (long long)now.tv_sec;
+}
+
+class CValidity
+{
+    FlcLicensingRef m_licensing;
+    FlcErrorRef m_error;
+    int m_node;
+    string m_feature;
+    string m_version;
+
+    mutex m_sdk;
+    string m_message;
+
+    // deadline << 1 | valid, so both are read at once
+    atomic<long long> m_state;
+    atomic<long long> m_anchor;
+
+public:
+    CValidity(int node, const string&feature, const string&version)
+        : m_licensing(0), m_error(0), m_node(node), m_feature(feature), m_version(version)
+        , m_state(0), m_anchor(0)
+    {
+    }
+
+    virtual~CValidity()
+    {
+        tra.release_licensing(m_node, &m_licensing);
+
+        if (m_error)
+        {
+            FlcErrorDelete(&m_error);
+        }
+    }
+
+    int open(const string&path)
+    {
+        if (!FlcErrorCreate(&m_error)
+            || !create_licensing(m_node, &m_licensing, m_error)
+            || !add_license_sources(m_licensing, path, m_error))
+        {
+            return NOVA_FAILED;
+        }
+
+        // an invalid license still makes a usable oracle
+        revalidate(true);
+        return NOVA_OK;
+    }
+
+    const char* message()
+    {
+        return m_error ? FlcErrorGetMessage(m_error) : "";
+    }
+
+    /*!
+     * The hot path: one clock read and two comparisons
+     */
+    int check()
+    {
+        const long long state = m_state.load(memory_order_acquire);
+        const long long now = wall_seconds();
+
+        if (now < (state >> 1) && now + VALIDITY_WINDBACK_TOLERANCE >= m_anchor.load(memory_order_relaxed))
+        {
+            return (state & 1) ? NOVA_OK : NOVA_FAILED;
+        }
+        return revalidate(false);
+    }
+
+    int revalidate(bool forced)
+    {
+        lock_guard<mutex> guard(m_sdk);
+
+        // another caller may have rechecked while this one waited
+        const long long state = m_state.load(memory_order_relaxed);
+        const long long now = wall_seconds();
+        if (!forced && now < (state >> 1) && now + VALIDITY_WINDBACK_TOLERANCE >= m_anchor.load(memory_order_relaxed))
+        {
+            return (state & 1) ? NOVA_OK : NOVA_FAILED;
+        }
+
+        bool valid = acquire();
+
+        FlcBool wound = FLC_FALSE;
+        if (valid && FlcClockWindbackDetected(m_licensing, &wound, NULL) && wound)
+        {
+            m_message = "clock windback detected";
+            valid = false;
+        }
+
+        const long long deadline = valid ? earliest(now) : now + VALIDITY_MIN_SECONDS;
+
+        m_anchor.store(now, memory_order_relaxed);
+        m_state.store(deadline << 1 | (valid ? 1 : 0), memory_order_release);
+
+        return valid ? NOVA_OK : NOVA_FAILED;
+    }
+
+    /*!
+     * Seconds the current answer still holds, 0 if the next check rechecks
+     */
+    int seconds()
+    {
+        const long long left = (m_state.load(memory_order_acquire) >> 1) - wall_seconds();
+        return left > 0 ? (int)left : 0;
+    }
+
+    string last_message()
+    {
+        lock_guard<mutex> guard(m_sdk);
+        return m_message;
+    }
+
+private:
+    /*!
+     * Called with m_sdk held. The license is handed straight back, only
+     * whether the SDK grants it matters here.
+     */
+    bool acquire()
+    {
+        FlcLicenseRef license = 0;
+        if (!FlcAcquireLicense(m_licensing, &license, m_feature.c_str(), m_version.c_str(), m_error))
+        {
+            m_message = FlcErrorGetMessage(m_error);
+            return false;
+        }
+
+        if (!FlcReturnLicense(m_licensing, &license, NULL) && license)
+        {
+            FlcLicenseDelete(&license, NULL);
+        }
+
+        m_message.clear();
+        return true;
+    }
+
+    /*!
+     * Called with m_sdk held. Earliest time at which any feature, or the
+     * server update schedule, could change the answer.
+     */
+    long long earliest(long long now)
+    {
+        long long deadline = now + VALIDITY_MAX_SECONDS;
+
+        FlcInt32 update = 0;
+        if (FlcServerUpdateGetNextTime(m_licensing, &update, NULL) && update > 0)
+        {
+            deadline = min(deadline, now + update);
+        }
+
+        FlcFeatureCollectionRef features = 0;
+        FlcSize size = 0;
+        if (!FlcGetFeatureCollection(m_licensing, &features, NULL) || !FlcFeatureCollectionSize(features, &size, NULL))
+        {
+            if (features)
+            {
+                FlcFeatureCollectionDelete(&features, NULL);
+            }
+            return min(deadline, now + VALIDITY_MIN_SECONDS);
+        }
+
+        for (FlcSize i = 0; i < size; i++)
+        {
+            FlcFeatureRef feature = 0;
+            if (!FlcFeatureCollectionGet(features, &feature, (FlcUInt32)i, NULL))
+            {
+                continue;
+            }
+
+            const struct tm*date = 0;
+            if (FlcFeatureGetStartDate(feature, &date, NULL))
+            {
+                deadline = min(deadline, watch(date, now));
+            }
+
+            FlcBool perpetual = FLC_FALSE;
+            FlcFeatureIsPerpetual(feature, &perpetual, NULL);
+            if (!perpetual && FlcFeatureGetExpiration(feature, &date, NULL))
+            {
+                deadline = min(deadline, watch(date, now));
+            }
+
+            // the end of the grace period, perpetual ones fall outside the horizon
+            FlcBool grace = FLC_FALSE;
+            if (FlcFeatureIsInGracePeriod(feature, &grace, NULL) && grace && FlcFeatureGetFinalExpiration(feature, &date, NULL))
+            {
+                deadline = min(deadline, watch(date, now));
+            }
+        }
+
+        FlcFeatureCollectionDelete(&features, NULL);
+
+        return deadline;
+    }
+
+    /*!
+     * When a feature date next needs a recheck: the start of its margin,
+     * every VALIDITY_MIN_SECONDS while inside it, never once it is past
+     */
+    static long long watch(const struct tm*date, long long now)
+    {
+        if (NULL == date)
+        {
+            return now + VALIDITY_MAX_SECONDS;
+        }
+
+        struct tm copy = *date;
+        const long long at = (long long)timegm(&copy);
+
+        if (now < at - VALIDITY_DATE_MARGIN)
+        {
+            return at - VALIDITY_DATE_MARGIN;
+        }
+        if (now < at + 2 * VALIDITY_DATE_MARGIN)
+        {
+            return now + VALIDITY_MIN_SECONDS;
+        }
+        return now + VALIDITY_MAX_SECONDS;
+    }
+};
+
+extern "C"
+{
+    int LIB_EXPORT nova_validity_open(const char*lic, size_t lic_length,
+                                      const char*feature, const char*version,
+                                      nova_validity**validity)
+    {
+        if (NULL == lic || NULL == feature || NULL == version || NULL == validity)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        TraScope scope;
+
+        CValidity*oracle = new CValidity(tra.node(), feature, version);
+
+        if (NOVA_OK != oracle->open(string(lic, lic_length)))
+        {
+            DEBUG_PRINT("### validity open %s\n", oracle->message());
+            delete oracle;
+            return NOVA_FAILED;
+        }
+
+        *validity = (nova_validity*)oracle;
+        return NOVA_OK;
+    }
+
+    int LIB_EXPORT nova_validity_check(nova_validity*validity)
+    {
+        if (NULL == validity)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        return ((CValidity*)validity)->check();
+    }
+
+    int LIB_EXPORT nova_validity_recheck(nova_validity*validity)
+    {
+        if (NULL == validity)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        return ((CValidity*)validity)->revalidate(true);
+    }
+
+    int LIB_EXPORT nova_validity_seconds(nova_validity*validity)
+    {
+        if (NULL == validity)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        return ((CValidity*)validity)->seconds();
+    }
+
+    int LIB_EXPORT nova_validity_message(nova_validity*validity, char*out_message, size_t*message_length)
+    {
+        if (NULL == validity || NULL == message_length)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        return copy_out(((CValidity*)validity)->last_message(), out_message, message_length);
+    }
+
+    int LIB_EXPORT nova_validity_close(nova_validity*validity)
+    {
+        if (NULL == validity)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        TraScope scope;
+
+        delete (CValidity*)validity;
+        return NOVA_OK;
+    }
+}
+/* extern c */
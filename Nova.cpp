@@ -7,27 +7,18 @@
 // Nova.cpp : Defines the exported functions for the DLL application.
 //
 
-#define DUMP
-#undef DUMP
-
-#define LIB_EXPORT __attribute__ ((visibility ("default")))
-
-#ifdef DUMP
-#define DEBUG_PRINT(format, ...) printf(format, ##__VA_ARGS__)
-#define DEBUG_PRINTLN(a) printf("%s...\n", a);
-#define COUT cout
-#else
-#define DEBUG_PRINT(format, ...) //
-#define DEBUG_PRINTLN(a) //
-#endif
+#include "Nova.Internal.h"
 
 #include <ctime>
 #include <string>
 #include <sstream>
 #include <set>
-#include <vector>
+#include <chrono>
+#include <functional>
+#include <cstring>
 
 #include "Nova.h"
+#include "Nova.Abi.h"
 
 using namespace std;
 
@@ -41,51 +32,39 @@ using namespace std;
 #include "FlcFeature.h"
 //#include "Nova.IdentityClient.h"
 #include "fnedemo.RSA512.IdentityClient.h"
+#include "Nova.Sdt.h"
 
 /*!
- * Wrap tra_State pointer for lazy initialization
+ * One FNE call between nova:fne__entry and nova:fne__return probes, profiled
+ * as the fne stage
  */
-class CTra
+template<typename Call>
+static FlcBool fne_call(const char*name, Call call)
 {
-	tra_State *m_pTraState = 0;
-
-public:
-	CTra() : m_pTraState(0)
-	{
-	}
-	virtual~CTra()
-	{
-		if (m_pTraState)
-		{
-			tra_close(m_pTraState);
-		}
-	}
-    /*!
-     * Perform lazy load of TRA engine
-     */
-	operator tra_State* ()
-	{
-		if (NULL == m_pTraState)
-		{
-            DEBUG_PRINTLN("Lazy Load TRA");
-			m_pTraState = tra_load_nova_declarative_data();
-		}
-		return m_pTraState;
-	}
-} tra;
-
+    ProfileStage stage(PROFILE_FNE);
+    NOVA_PROBE1(nova, fne__entry, name);
+    const FlcBool result = call();
+    NOVA_PROBE2(nova, fne__return, name, result);
+    return result;
+}
 
 struct UserData
 {
+    int m_node;
 	FlcErrorRef m_error;
 	FlcLicensingRef m_licensing;
     FlcLicenseRef m_license;
-	string error;
-    string path;
-    vector<string> features;
+    // the caller's, which outlives this
+    const string*path;
+    const unsigned char*data;
+    // a byte[] of size bytes, pinned only while it is added
+    JNIEnv*env;
+    jbyteArray bytes;
+    size_t size;
     
-	UserData() : m_error(0), m_licensing(0), m_license(0)
+	UserData() : m_node(tra.node()), m_error(0), m_licensing(0), m_license(0), path(0), data(0), env(0), bytes(0), size(0)
 	{
+        last_error().clear();
 	}
 
 	virtual~UserData()
@@ -97,7 +76,7 @@ struct UserData
         
 		if (m_licensing)
 		{
-			FlcLicensingDelete(&m_licensing, NULL);
+			tra.release_licensing(m_node, &m_licensing);
 		}
 
 		if (m_error)
@@ -108,27 +87,34 @@ struct UserData
 
     int initialize()
     {
-        TFT status(tra, TRA_VARIABLE_zero_ALIAS_1);
-        TFT istrue(tra, TRA_VARIABLE_one_ALIAS_1);
+        ProfileStage stage(PROFILE_INITIALIZE);
+        TraLocal local(TRA_VARIABLE_zero_ALIAS_1);
+        TFT&status = *local;
+        const TFT&istrue = tra_constant(TRA_VARIABLE_one_ALIAS_1);
         
         DEBUG_PRINTLN("FlcErrorCreate");
-		status = TFT(tra, TRA_VARIABLE_zero_ALIAS_2) + FlcErrorCreate(&m_error);
+		status = tra_constant(TRA_VARIABLE_zero_ALIAS_2) + fne_call("FlcErrorCreate", [&]{ return FlcErrorCreate(&m_error); });
 		if (status == istrue)
 		{
             DEBUG_PRINTLN("FlcLicensingCreate");            
-			status = TFT(tra, TRA_VARIABLE_zero_ALIAS_3) + FlcLicensingCreate(&m_licensing, identity_data, sizeof identity_data, NULL, NULL, m_error);
+			status = tra_constant(TRA_VARIABLE_zero_ALIAS_3) + fne_call("FlcLicensingCreate", [&]{ return tra.acquire_licensing(m_node, &m_licensing, identity_data, sizeof identity_data, m_error); });
 			if (status == istrue)
 			{             
                 DEBUG_PRINTLN("FlcAddBufferLicenseSourceFromFile");                     
-                status = FlcAddBufferLicenseSourceFromFile(m_licensing, path.c_str(),  NULL, m_error);
+                status = fne_call("FlcAddBufferLicenseSource", [&]
+                {
+                    return bytes ? add_bytes()
+                        : data ? FlcAddBufferLicenseSourceFromData(m_licensing, data, size, "memory", m_error)
+                        : add_license_sources(m_licensing, path ? *path : string(), m_error);
+                });
 				if (status == istrue)
 				{
-                    const string feature = tra_get_string(tra, TRA_STRING_feature_name_ALIAS_1);
+                    const arena_string feature = tra_get_string(tra, TRA_STRING_feature_name_ALIAS_1);
 
-                    const string version = tra_get_string(tra, TRA_STRING_feature_version_ALIAS_1);
+                    const arena_string version = tra_get_string(tra, TRA_STRING_feature_version_ALIAS_1);
                 
                     DEBUG_PRINTLN("FlcAcquireLicense");    
-                    status = TFT(tra, TRA_VARIABLE_zero_ALIAS_4) + FlcAcquireLicense(m_licensing, &m_license, feature.c_str(), version.c_str(), m_error);
+                    status = tra_constant(TRA_VARIABLE_zero_ALIAS_4) + fne_call("FlcAcquireLicense", [&]{ return FlcAcquireLicense(m_licensing, &m_license, feature.c_str(), version.c_str(), m_error); });
                     if (status == istrue)
                     {
                         DEBUG_PRINTLN("FlcAcquireLicense succeeded");
@@ -137,27 +123,55 @@ struct UserData
 			}
 		}
 
-		error = FlcErrorGetMessage(m_error) ;  
+        last_error().capture(m_error, m_licensing);
         
         return status;
     }
+
+    /*!
+     * The SDK copies buffer source data (see add_license_sources), so the
+     * byte[] is pinned for this one call and released before the checkout
+     */
+    FlcBool add_bytes()
+    {
+        const FlcUInt8*pinned = static_cast<const FlcUInt8*>(env->GetPrimitiveArrayCritical(bytes, NULL));
+        if (NULL == pinned)
+        {
+            return FLC_FALSE;
+        }
+
+        const FlcBool result = FlcAddBufferLicenseSourceFromData(m_licensing, pinned, size, "memory", m_error);
+        env->ReleasePrimitiveArrayCritical(bytes, const_cast<FlcUInt8*>(pinned), JNI_ABORT);
+        return result;
+    }
+
+    /*!
+     * Message of the failure recorded by initialize, only looked up when
+     * there was one; valid while this UserData lives
+     */
+    const char*message() const
+    {
+        return m_error && last_error().failed() ? FlcErrorGetMessage(m_error) : "";
+    }
     
     int dump(stringstream&stream)
 	{
-        TFT status(tra, TRA_VARIABLE_zero_ALIAS_5);
-        TFT istrue(tra, TRA_VARIABLE_one_ALIAS_2);
+        ProfileStage stage(PROFILE_DUMP);
+        TraLocal local(TRA_VARIABLE_zero_ALIAS_5);
+        TFT&status = *local;
+        const TFT&istrue = tra_constant(TRA_VARIABLE_one_ALIAS_2);
         
         FlcFeatureCollectionRef features = 0;
         FlcSize size = 0;  
         
         DEBUG_PRINTLN("FlcGetFeatureCollection");
 
-		status = TFT(tra, TRA_VARIABLE_zero_ALIAS_7) + FlcGetFeatureCollection(m_licensing, &features, m_error);
+		status = tra_constant(TRA_VARIABLE_zero_ALIAS_7) + fne_call("FlcGetFeatureCollection", [&]{ return FlcGetFeatureCollection(m_licensing, &features, m_error); });
         if (status == istrue)
 		{
             DEBUG_PRINTLN("FlcFeatureCollectionSize");
 
-			status = TFT(tra, TRA_VARIABLE_zero_ALIAS_8) + FlcFeatureCollectionSize(features, &size, m_error);
+			status = tra_constant(TRA_VARIABLE_zero_ALIAS_8) + fne_call("FlcFeatureCollectionSize", [&]{ return FlcFeatureCollectionSize(features, &size, m_error); });
             if (status == istrue)
             {
 				for (FlcSize i = 0; i < size; i++)
@@ -165,21 +179,21 @@ struct UserData
 					DEBUG_PRINTLN("FlcFeatureCollectionGet");
 					FlcFeatureRef feature = 0;
 					
-                    status = TFT(tra, TRA_VARIABLE_zero_ALIAS_9) + FlcFeatureCollectionGet(features, &feature, i, m_error);
+                    status = tra_constant(TRA_VARIABLE_zero_ALIAS_9) + fne_call("FlcFeatureCollectionGet", [&]{ return FlcFeatureCollectionGet(features, &feature, i, m_error); });
                     if (status != istrue)
                     {
                         break;
                     }
                     
                     const FlcChar*name = 0;
-                    status = TFT(tra, TRA_VARIABLE_zero_ALIAS_10) + FlcFeatureGetName(feature, &name, m_error);
+                    status = tra_constant(TRA_VARIABLE_zero_ALIAS_10) + fne_call("FlcFeatureGetName", [&]{ return FlcFeatureGetName(feature, &name, m_error); });
                     if (status != istrue)
                     {
                         break;
                     }
                     
                     const FlcChar*version = 0;
-                    status = TFT(tra, TRA_VARIABLE_zero_ALIAS_11) + FlcFeatureGetVersion(feature, &version, m_error);
+                    status = tra_constant(TRA_VARIABLE_zero_ALIAS_11) + fne_call("FlcFeatureGetVersion", [&]{ return FlcFeatureGetVersion(feature, &version, m_error); });
                     if (status != istrue)
                     {
                         break;
@@ -206,6 +220,274 @@ struct UserData
 
 };
 
+FlcBool create_licensing(int node, FlcLicensingRef*licensing, FlcErrorRef error)
+{
+    return tra.acquire_licensing(node, licensing, identity_data, sizeof identity_data, error);
+}
+
+/*!
+ * The environment outlives this call, pooled by CTra or kept by the lease,
+ * exchange, validity and table services, while each file buffer is freed
+ * once its sink returns. That relies on FlcAddBufferLicenseSourceFromData
+ * copying what it is given, as it must for FlcAddBufferLicenseSourceFromFile,
+ * whose file buffer is the SDK's own and gone when it returns.
+ */
+FlcBool add_license_sources(FlcLicensingRef licensing, const string&path, FlcErrorRef error)
+{
+    if (!is_directory(path))
+    {
+        return FlcAddBufferLicenseSourceFromFile(licensing, path.c_str(),  NULL, error);
+    }
+
+    FlcBool result = FLC_TRUE;
+    read_files(list_licenses(path), [&](const string&name, const unsigned char*data, size_t size, int failure)
+    {
+        if (failure)
+        {
+            DEBUG_PRINT("### skipped %s\n", name.c_str());
+        }
+        else if (result)
+        {
+            result = FlcAddBufferLicenseSourceFromData(licensing, data, size, name.c_str(), error);
+        }
+    });
+    return result;
+}
+
+/*!
+ * Prime AX/BX and run the initialize snif for the supplied user data
+ */
+static void run_initialize(UserData&userdata)
+{
+    ProfileStage stage(PROFILE_TRA_SNIF);
+
+    // AX = 0
+    tra_set_value(tra, TRA_VARIABLE_ax_ALIAS_1, TRA_STRING_identity_ALIAS_1);
+    tra_set_value(tra, TRA_VARIABLE_bx_ALIAS_1, TRA_STRING_identity_bad_ALIAS_1);
+
+    /**
+     * For now ther is no license check
+     * 
+     * tra_if(tra, TRA_SNIF_initialize_ALIAS_1, &userdata);
+     * 
+     */
+    tra_if(tra, TRA_SNIF_initialize_ALIAS_1, &userdata);
+}
+
+/*!
+ * Identity string selected by the last run of the initialize snif
+ */
+static arena_string read_identity()
+{
+    int alias = 0;
+    tra_get_value(tra, TRA_VARIABLE_status_ALIAS_17, &alias);
+
+    return tra_get_string(tra, alias);
+}
+
+int run_process(const string&path, string&identity, string&message)
+{
+    return run_process(path, NULL, 0, identity, message);
+}
+
+int run_process(const string&path, const unsigned char*data, size_t size, string&identity, string&message)
+{
+    NOVA_PROBE2(nova, process__entry, data, size);
+
+    TraceCall trace(data ? NOVA_TRACE_PROCESS_DATA : NOVA_TRACE_PROCESS, path, data, size);
+    ProfileStage stage(PROFILE_PROCESS);
+    TraScope scope;
+
+    TraLocal local(TRA_VARIABLE_minus_one_ALIAS_2);
+    TFT&status = *local; //-2
+    const TFT&one = tra_constant(TRA_VARIABLE_one_ALIAS_16);
+
+    status -= one;
+
+    UserData userdata;
+
+    userdata.path = &path;
+    userdata.data = data;
+    userdata.size = size;
+
+    run_initialize(userdata);
+    status += tra_constant(TRA_VARIABLE_one_ALIAS_17); // -1
+
+    message.assign(userdata.message());
+    status += tra_constant(TRA_VARIABLE_one_ALIAS_18); // 0
+
+    const arena_string id = read_identity();
+    identity.assign(id.data(), id.size());
+    status += tra_constant(TRA_VARIABLE_one_ALIAS_20); // + 1
+
+    const int result = status == one ? NOVA_OK : NOVA_FAILED;
+
+    trace.result(result);
+    NOVA_PROBE1(nova, process__return, result);
+
+    return result;
+}
+
+int run_license(const string&path, string&message)
+{
+    TraScope scope;
+
+    UserData userdata;
+
+    userdata.path = &path;
+
+    TraLocal local(TRA_VARIABLE_zero_ALIAS_6);
+    TFT&status = *local;
+    const TFT&istrue = tra_constant(TRA_VARIABLE_one_ALIAS_19);
+    status = userdata.initialize();
+
+    message.assign(userdata.message());
+
+    return status == istrue ? NOVA_OK : NOVA_FAILED;
+}
+
+int copy_out(const string&value, char*out, size_t*length)
+{
+    const size_t capacity = *length;
+
+    *length = value.size();
+
+    if (NULL == out || capacity <= value.size())
+    {
+        return NOVA_ERROR_BUFFER_SIZE;
+    }
+
+    value.copy(out, value.size());
+    out[value.size()] = 0;
+
+    return NOVA_OK;
+}
+
+/*!
+ * Body of the Nova.process() family. With bytes set, the license is the
+ * size bytes of that array, pinned only around the calls that read it: a
+ * critical region must not be held while the TRA lock and the SDK may block.
+ * The probe sees no data for a byte[].
+ */
+static jboolean process_java(JNIEnv*env, jobject object, jbyteArray bytes, const unsigned char*data, size_t size)
+{
+    ProfileStage stage(PROFILE_PROCESS);
+    TraScope scope;
+
+    NOVA_PROBE2(nova, process__entry, data, size);
+
+    // the trace hashes the license up front, so a byte[] is pinned for that too
+    const unsigned char*traced = bytes && trace_active()
+        ? static_cast<const unsigned char*>(env->GetPrimitiveArrayCritical(bytes, NULL))
+        : data;
+
+    TraceCall trace(bytes ? NOVA_TRACE_JAVA_BYTES : data ? NOVA_TRACE_JAVA_BUFFER : NOVA_TRACE_JAVA_PROCESS, string(), traced, size);
+
+    if (bytes && traced)
+    {
+        env->ReleasePrimitiveArrayCritical(bytes, const_cast<unsigned char*>(traced), JNI_ABORT);
+    }
+
+    TraLocal local(TRA_VARIABLE_minus_one_ALIAS_1);
+    TFT&status = *local; //-2
+    const TFT&one = tra_constant(TRA_VARIABLE_one_ALIAS_3);
+    
+    status -= one;
+	if (env)
+	{
+        UserData userdata;
+
+//            userdata.path = convert(env, licenseFilePath);
+        userdata.data = data;
+        userdata.env = env;
+        userdata.bytes = bytes;
+        userdata.size = size;
+
+        run_initialize(userdata);
+
+        status += tra_constant(TRA_VARIABLE_one_ALIAS_4); // -1
+
+        const char*message = userdata.message();
+        if (marshal_result(env, object, "message", message, strlen(message)))
+        {
+            status += tra_constant(TRA_VARIABLE_one_ALIAS_5);   // 0
+        }
+
+        const arena_string id = read_identity();
+
+        DEBUG_PRINT("### %s\n", id.c_str());
+
+        if (marshal_result(env, object, "identity", id.data(), id.size()))
+        {
+            status += tra_constant(TRA_VARIABLE_one_ALIAS_6); // + 1
+        }
+    }
+
+    DEBUG_PRINT("RETURN %i %i %s\n", status.get(), one.get(), status == one ? "T" : "F");
+
+    const jboolean result = status == one;
+
+    trace.result(result ? NOVA_OK : NOVA_FAILED);
+    NOVA_PROBE1(nova, process__return, result);
+     
+	return result;
+}
+
+/*!
+ * Calls per second through the shared run_process core, the C ABI that
+ * FFM downcalls use, and with env set the JNI body with its field
+ * marshalling. The Java side of the transition costs only shows up in a
+ * Java harness; this is what each entry point adds natively.
+ */
+static bool call_rates(JNIEnv*env, jobject object, stringstream&stream)
+{
+    const int calls = 2000;
+
+    bool result = true;
+
+    const auto measure = [&](const char*name, const function<int()>&call)
+    {
+        const int expected = call();
+
+        const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        for (int i = 0; i < calls; i++)
+        {
+            result = call() == expected && result;
+        }
+        const chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+        stream << name << ": " << (long long)(calls / elapsed.count()) << " calls/s, "
+               << (long long)(elapsed.count() * 1e9 / calls) << " ns/call" << std::endl;
+
+        return expected;
+    };
+
+    string identity, message;
+    const int core = measure("run_process", [&]{ return run_process(string(), identity, message); });
+
+    char identity_buffer[256];
+    char message_buffer[1024];
+    const int abi = measure("nova_process", [&]
+    {
+        size_t identity_length = sizeof identity_buffer;
+        size_t message_length = sizeof message_buffer;
+        return nova_process(NULL, 0, identity_buffer, &identity_length, message_buffer, &message_length);
+    });
+    result = result && core == abi;
+
+    if (env)
+    {
+        const int jni = measure("jni process", [&]{ return process_java(env, object, NULL, NULL, 0) ? NOVA_OK : NOVA_FAILED; });
+        result = result && core == jni;
+    }
+    else
+    {
+        stream << "jni process: needs a JVM, see Nova.benchCalls()" << std::endl;
+    }
+
+    return result;
+}
+
 extern "C"
 {
 //    int do_initialize(tra_Data *ptr)
@@ -225,11 +507,13 @@ extern "C"
 	int do_initialize(tra_Data *ptr)
 	{
 		DEBUG_PRINTLN("do_initialize");
+        NOVA_PROBE0(nova, do_initialize);
         
-        TFT result(tra, TRA_VARIABLE_zero_ALIAS_12);
+        TraLocal local(TRA_VARIABLE_zero_ALIAS_12);
+        TFT&result = *local;
 
         // license check would go here
-        result += TFT(tra, TRA_VARIABLE_one_ALIAS_12);
+        result += tra_constant(TRA_VARIABLE_one_ALIAS_12);
         
 		return result;
 	}
@@ -237,6 +521,7 @@ extern "C"
 	int do_checkout(tra_Data *)
 	{
 		DEBUG_PRINTLN("SUCCESS");
+        NOVA_PROBE0(nova, do_checkout);
 
 		tra_copy(tra, TRA_VARIABLE_status_ALIAS_1, TRA_VARIABLE_ax_ALIAS_2);
 		tra_call(tra, TRA_SF_MULTIPLY_ALIAS_1, NULL, TRA_VARIABLE_status_ALIAS_2, TRA_VARIABLE_zero_ALIAS_1, NULL);
@@ -260,6 +545,7 @@ extern "C"
 	int do_initialize_fail(tra_Data *)
 	{
 		DEBUG_PRINTLN("FAILED");
+        NOVA_PROBE0(nova, do_initialize_fail);
 
 		tra_copy(tra, TRA_VARIABLE_status_ALIAS_10, TRA_VARIABLE_bx_ALIAS_2);
 		tra_call(tra, TRA_SF_MULTIPLY_ALIAS_1, NULL, TRA_VARIABLE_status_ALIAS_11, TRA_VARIABLE_one_ALIAS_1, NULL);
@@ -283,83 +569,44 @@ extern "C"
     
     
 	LIB_EXPORT jboolean JNICALL Java_com_flexera_schneider_fnesigner_Nova_process(JNIEnv*env, jobject object)
-	{           
-        TFT status(tra, TRA_VARIABLE_minus_one_ALIAS_1); //-2
-        TFT one(tra, TRA_VARIABLE_one_ALIAS_3);
-        
-        status -= one;
-		if (env)
-		{
-            UserData userdata;
-
-//            userdata.path = convert(env, licenseFilePath);
-
-
-            // AX = 0
-            tra_set_value(tra, TRA_VARIABLE_ax_ALIAS_1, TRA_STRING_identity_ALIAS_1);
-            tra_set_value(tra, TRA_VARIABLE_bx_ALIAS_1, TRA_STRING_identity_bad_ALIAS_1);
-
-            /**
-             * For now ther is no license check
-             * 
-             * tra_if(tra, TRA_SNIF_initialize_ALIAS_1, &userdata);
-             * 
-             */
-            tra_if(tra, TRA_SNIF_initialize_ALIAS_1, &userdata);
-            status += TFT(tra, TRA_VARIABLE_one_ALIAS_4); // -1
-            jclass source = env->GetObjectClass(object);
-            if (source)
-            {
-                DEBUG_PRINT("### class %p\n", (void*)source);
-
-                jfieldID field_m = env->GetFieldID(source, "message", "Ljava/lang/String;");
-
-                DEBUG_PRINT("### field_m %p\n", (void*)field_m);
-
-                if (field_m)
-                {
-                    jstring string = env->NewStringUTF(userdata.error.c_str());
-                    if (string)
-                    {
-                        DEBUG_PRINT("### message %p\n", (void*)string);
-                        env->SetObjectField(object, field_m, string);
-                        status += TFT(tra, TRA_VARIABLE_one_ALIAS_5);   // 0                      
-                    }
-                }
-
-                jfieldID field_i = env->GetFieldID(source, "identity", "Ljava/lang/String;");
-
-                DEBUG_PRINT("### field_i %p\n", (void*)field_i);
-
-                if (field_i)
-                {
-                    int alias = 0;
-                    tra_get_value(tra, TRA_VARIABLE_status_ALIAS_17, &alias);
-
-                    string id = tra_get_string(tra, alias);
+	{
+        return process_java(env, object, NULL, NULL, 0);
+    }
 
-                    DEBUG_PRINT("### %s\n", id.c_str());
+    /*!
+     * Nova.process() over license bytes in a direct ByteBuffer, read in place
+     */
+    LIB_EXPORT jboolean JNICALL Java_com_flexera_schneider_fnesigner_Nova_processBuffer(JNIEnv*env, jobject object, jobject buffer)
+    {
+        const unsigned char*data = buffer ? (const unsigned char*)env->GetDirectBufferAddress(buffer) : NULL;
+        const jlong size = buffer ? env->GetDirectBufferCapacity(buffer) : -1;
+        if (NULL == data || size <= 0)
+        {
+            return JNI_FALSE;
+        }
 
-                    jstring identity = env->NewStringUTF(id.c_str());
-                    if (identity)
-                    {
-                        DEBUG_PRINT("### identity %p\n", (void*)identity);
+        return process_java(env, object, NULL, data, (size_t)size);
+    }
 
-                        env->SetObjectField(object, field_i, identity);
-                        
-                        status += TFT(tra, TRA_VARIABLE_one_ALIAS_6); // + 1                         
-                    }
-                }
-            }
+    /*!
+     * Nova.process() over license bytes in a byte[], pinned only while the
+     * SDK adds it
+     */
+    LIB_EXPORT jboolean JNICALL Java_com_flexera_schneider_fnesigner_Nova_processBytes(JNIEnv*env, jobject object, jbyteArray bytes)
+    {
+        const jsize size = bytes ? env->GetArrayLength(bytes) : 0;
+        if (size <= 0)
+        {
+            return JNI_FALSE;
         }
 
-        DEBUG_PRINT("RETURN %i %i %s\n", status.get(), one.get(), status == one ? "T" : "F");
-         
-		return status == one;
-	}
+        return process_java(env, object, bytes, NULL, (size_t)size);
+    }
        
     bool LIB_EXPORT TestTra(stringstream&stream)
     {
+        TraScope scope;
+
         TFT status(tra);
         
         tra_copy(tra, TRA_VARIABLE_status_ALIAS_1, TRA_VARIABLE_zero_ALIAS_1);
@@ -400,14 +647,85 @@ extern "C"
         return count == result;
     }
 
+    /*!
+     * Cost of each TRA entry point the TDT wrappers go through, every one a
+     * dispatch by magic index inside the TRA library, next to the per thread
+     * cached constant that replaces a TDT construction on the hot paths
+     */
+    bool LIB_EXPORT TestTraDispatch(stringstream&stream)
+    {
+        TraScope scope;
+
+        const int operations = 20000;
+        tra_State*state = tra;
+
+        TFT value(state, TRA_VARIABLE_zero_ALIAS_14);
+        TFT one(state, TRA_VARIABLE_one_ALIAS_13);
+
+        int sink = 0;
+        bool result = true;
+
+        const auto measure = [&](const char*name, const function<void()>&operation)
+        {
+            const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+            for (int i = 0; i < operations; i++)
+            {
+                operation();
+            }
+            const chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+
+            stream << name << ": " << (long)(elapsed.count() / operations) << " ns" << std::endl;
+        };
+
+        measure("tra_set_value", [&]{ value.set(sink & 1); });
+        measure("tra_get_value", [&]{ sink += value.get(); });
+        measure("tra_copy", [&]{ value = one; });
+        measure("tra_call add", [&]{ value += one; });
+        measure("tra_new + tra_delete", [&]{ TFT constant(state, TRA_VARIABLE_one_ALIAS_14); });
+        measure("tra_constant", [&]{ sink += &tra_constant(TRA_VARIABLE_one_ALIAS_14) != NULL; });
+
+        value = tra_constant(TRA_VARIABLE_zero_ALIAS_15);
+        for (int i = 0; i < operations; i++)
+        {
+            value += tra_constant(TRA_VARIABLE_one_ALIAS_15);
+        }
+        result = operations == value.get();
+
+        stream << "checked " << operations << " cached additions" << (result ? "" : " MISMATCH") << std::endl;
+
+        return result;
+    }
+
+    /*!
+     * Calls per second through run_process and nova_process; passes when
+     * every call gave the same result through both
+     */
+    bool LIB_EXPORT TestCalls(stringstream&stream)
+    {
+        return call_rates(NULL, NULL, stream);
+    }
+
+    /*!
+     * TestCalls from Java, adding the JNI body on the calling object
+     */
+    LIB_EXPORT jstring JNICALL Java_com_flexera_schneider_fnesigner_Nova_benchCalls(JNIEnv*env, jobject object)
+    {
+        stringstream stream;
+        call_rates(env, object, stream);
+        return env->NewStringUTF(stream.str().c_str());
+    }
+
     bool LIB_EXPORT TestFne(const string&licenseFilePath, stringstream&stream)
     {
+        TraScope scope;
+
         UserData data;
         
-        data.path = licenseFilePath;
+        data.path = &licenseFilePath;
         
-        TFT status(tra);
-        const TFT istrue(tra, TRA_VARIABLE_one_ALIAS_19);
+        TraLocal local(TRA_VARIABLE_zero_ALIAS_6);
+        TFT&status = *local;
+        const TFT&istrue = tra_constant(TRA_VARIABLE_one_ALIAS_19);
         status = data.initialize();
         if (status == istrue)
         {
@@ -416,5 +734,107 @@ extern "C"
             
         return status == istrue;
     }
+
+    int LIB_EXPORT nova_abi_version(void)
+    {
+        return NOVA_ABI_VERSION;
+    }
+
+    int LIB_EXPORT nova_process(const char*lic, size_t lic_length,
+                                char*out_identity, size_t*identity_length,
+                                char*out_message, size_t*message_length)
+    {
+        if (NULL == identity_length || NULL == message_length || (NULL == lic && lic_length))
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        string identity, message;
+
+        const int result = run_process(lic ? string(lic, lic_length) : string(), identity, message);
+
+        // fill both buffers so a caller can size them in a single retry
+        const int copied_message = copy_out(message, out_message, message_length);
+        const int copied_identity = copy_out(identity, out_identity, identity_length);
+
+        if (NOVA_OK != copied_message || NOVA_OK != copied_identity)
+        {
+            return NOVA_ERROR_BUFFER_SIZE;
+        }
+
+        return result;
+    }
+
+    int LIB_EXPORT nova_process_data(const void*data, size_t size,
+                                     char*out_identity, size_t*identity_length,
+                                     char*out_message, size_t*message_length)
+    {
+        if (NULL == data || 0 == size || NULL == identity_length || NULL == message_length)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        string identity, message;
+
+        const int result = run_process(string(), (const unsigned char*)data, size, identity, message);
+
+        const int copied_message = copy_out(message, out_message, message_length);
+        const int copied_identity = copy_out(identity, out_identity, identity_length);
+
+        if (NOVA_OK != copied_message || NOVA_OK != copied_identity)
+        {
+            return NOVA_ERROR_BUFFER_SIZE;
+        }
+
+        return result;
+    }
+
+    int LIB_EXPORT nova_test_tra(char*out, size_t*out_length)
+    {
+        if (NULL == out_length)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        stringstream stream;
+
+        const bool result = TestTra(stream);
+
+        const int copied = copy_out(stream.str(), out, out_length);
+
+        return NOVA_OK != copied ? copied : result ? NOVA_OK : NOVA_FAILED;
+    }
+
+    int LIB_EXPORT nova_test_calls(char*out, size_t*out_length)
+    {
+        if (NULL == out_length)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        stringstream stream;
+
+        const bool result = TestCalls(stream);
+
+        const int copied = copy_out(stream.str(), out, out_length);
+
+        return NOVA_OK != copied ? copied : result ? NOVA_OK : NOVA_FAILED;
+    }
+
+    int LIB_EXPORT nova_test_fne(const char*lic, size_t lic_length, char*out, size_t*out_length)
+    {
+        if (NULL == lic || NULL == out_length)
+        {
+            return NOVA_ERROR_ARGUMENT;
+        }
+
+        stringstream stream;
+
+        const bool result = TestFne(string(lic, lic_length), stream);
+
+        const int copied = copy_out(stream.str(), out, out_length);
+
+        return NOVA_OK != copied ? copied : result ? NOVA_OK : NOVA_FAILED;
+    }
 } 
 /* extern c */
@@ -24,6 +24,22 @@ extern "C"
 
     bool TestTra(std::stringstream&output);
 
+    bool TestTraDispatch(std::stringstream&output);
+
+    bool TestCalls(std::stringstream&output);
+
+    bool TestTraStress(int threads, std::stringstream&output);
+
+    bool TestArena(std::stringstream&output);
+
+    bool TestProfile(std::stringstream&output);
+
+    bool TestNuma(std::stringstream&output);
+
+    bool TestExchange(const std::string&licenseFilePath, const std::string&responseDirectory, std::stringstream&output);
+
+    bool TestTable(const std::string&licenseFilePath, std::stringstream&output);
+
     // TBC
 }
 
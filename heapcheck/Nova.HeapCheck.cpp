@@ -0,0 +1,218 @@
+/*
+ * File:   Nova.HeapCheck.cpp
+ * Author: jools
+ *
+ * Heap check of the steady state process call and license check.
+ *
+ * TestArena only counts the chunks the arena itself had to malloc, so a
+ * std::string or vector that goes around the arena passes it unseen. Here
+ * malloc, calloc, realloc and operator new are replaced by counting versions
+ * for the whole process, a few warm up calls let every thread local cache
+ * and arena chunk settle, and then the counts over the next calls have to be
+ * zero. run_process is checked as the entry points call it; its snif does
+ * not run the license check yet, so run_license is checked too, which goes
+ * through UserData::initialize with the error, licensing environment,
+ * license sources and feature name and version of a real call. operator new
+ * is only used by the C++ side, our code and the standard library on its
+ * behalf, so it must stay at zero. malloc is also what the FNE SDK and libtra
+ * allocate through; it is reported, and only fails the check with --strict.
+ *
+ * heapcheck/ is excluded from the library's managed build in .cproject,
+ * since this has a main(). run_process and run_license are not exported, so
+ * it links the library's objects rather than the shared library:
+ *
+ *   gcc -c -fPIC -O2 -I../fne-toolkit/include ../tra_gen/nova_tra.c -o nova_tra.o
+ *   g++ -std=c++11 -O2 -m64 -I.. -I../tra_gen -I../fne-toolkit/include -I$JAVA_HOME/include \
+ *       -I$JAVA_HOME/include/linux Nova.HeapCheck.cpp ../Nova.cpp ../Nova.[A-Z]*.cpp nova_tra.o -o nova-heapcheck \
+ *       -L../fne-toolkit/lib -lFlxClientXT_pic -lFlxCommonXT_pic -ltra_pic -lpthread \
+ *       -Wl,--wrap=tra_cb_thread_lock_enter,--wrap=tra_cb_thread_lock_leave
+ *   ./nova-heapcheck <license file or directory> [--strict]
+ */
+
+#include "Nova.Internal.h"
+
+#include <string>
+#include <atomic>
+#include <functional>
+#include <new>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+
+#include "Nova.Abi.h"
+
+using namespace std;
+
+extern "C"
+{
+    void*__libc_malloc(size_t size);
+    void*__libc_calloc(size_t count, size_t size);
+    void*__libc_realloc(void*pointer, size_t size);
+    void __libc_free(void*pointer);
+}
+
+// calls checked after the warm up
+static const int HEAPCHECK_WARMUP = 8;
+static const int HEAPCHECK_CALLS = 200;
+
+// counting is off until the warm up is done, so startup does not count
+static atomic<bool> s_counting(false);
+static atomic<unsigned long long> s_mallocs(0);
+static atomic<unsigned long long> s_news(0);
+
+static void tally(atomic<unsigned long long>&counter)
+{
+    if (s_counting.load(memory_order_relaxed))
+    {
+        counter.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+extern "C"
+{
+    void*malloc(size_t size)
+    {
+        tally(s_mallocs);
+        return __libc_malloc(size);
+    }
+
+    void*calloc(size_t number, size_t size)
+    {
+        tally(s_mallocs);
+        return __libc_calloc(number, size);
+    }
+
+    void*realloc(void*pointer, size_t size)
+    {
+        tally(s_mallocs);
+        return __libc_realloc(pointer, size);
+    }
+
+    void free(void*pointer)
+    {
+        __libc_free(pointer);
+    }
+}
+
+static void*counted_new(size_t size)
+{
+    tally(s_news);
+
+    void*pointer = __libc_malloc(size ? size : 1);
+    if (NULL == pointer)
+    {
+        throw bad_alloc();
+    }
+    return pointer;
+}
+
+void*operator new(size_t size)
+{
+    return counted_new(size);
+}
+
+void*operator new[](size_t size)
+{
+    return counted_new(size);
+}
+
+void*operator new(size_t size, const nothrow_t&) noexcept
+{
+    tally(s_news);
+    return __libc_malloc(size ? size : 1);
+}
+
+void*operator new[](size_t size, const nothrow_t&) noexcept
+{
+    tally(s_news);
+    return __libc_malloc(size ? size : 1);
+}
+
+void operator delete(void*pointer) noexcept
+{
+    __libc_free(pointer);
+}
+
+void operator delete[](void*pointer) noexcept
+{
+    __libc_free(pointer);
+}
+
+void operator delete(void*pointer, size_t) noexcept
+{
+    __libc_free(pointer);
+}
+
+void operator delete[](void*pointer, size_t) noexcept
+{
+    __libc_free(pointer);
+}
+
+int main(int argc, char**argv)
+{
+    string path;
+    bool strict = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (0 == strcmp("--strict", argv[i]))
+        {
+            strict = true;
+        }
+        else
+        {
+            path = argv[i];
+        }
+    }
+
+    if (path.empty())
+    {
+        cerr << "usage: " << argv[0] << " <license file or directory> [--strict]" << endl;
+        return 2;
+    }
+
+    nova_prewarm();
+
+    // the caller's strings keep their capacity, as a JNI or ABI caller's buffers would
+    string identity, message;
+
+    const auto check = [&](const char*name, const function<int()>&call)
+    {
+        for (int i = 0; i < HEAPCHECK_WARMUP; i++)
+        {
+            call();
+        }
+
+        const size_t chunks = arena_heap_allocations();
+        s_news = 0;
+        s_mallocs = 0;
+
+        int result = NOVA_OK;
+        s_counting = true;
+        for (int i = 0; i < HEAPCHECK_CALLS; i++)
+        {
+            result = call();
+        }
+        s_counting = false;
+
+        const unsigned long long news = s_news.load();
+        const unsigned long long mallocs = s_mallocs.load();
+        const size_t arena = arena_heap_allocations() - chunks;
+
+        const bool passed = 0 == news && 0 == arena && (!strict || 0 == mallocs);
+
+        cout << name << " over " << HEAPCHECK_CALLS << " calls: "
+             << news << " operator new, "
+             << mallocs << " malloc, "
+             << arena << " arena chunks, "
+             << (NOVA_OK == result ? "licensed" : message) << ": "
+             << (passed ? "passed" : "FAILED") << endl;
+
+        return passed;
+    };
+
+    const bool process = check("run_process", [&]{ return run_process(path, identity, message); });
+    const bool license = check("run_license", [&]{ return run_license(path, message); });
+
+    return process && license ? 0 : 1;
+}
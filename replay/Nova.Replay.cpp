@@ -0,0 +1,347 @@
+/*
+ * File:   Nova.Replay.cpp
+ * Author: jools
+ *
+ * Replay driver for the call traces recorded by nova_trace_start.
+ *
+ * Links libnova-jni directly and plays a trace back through the C ABI, on
+ * as many threads as the trace was recorded on. Each thread issues its calls
+ * in the recorded order at the recorded offsets, divided by --speed, or
+ * back to back with --asap. Then it prints the latency distribution per
+ * entry point next to the recorded one, so two builds can be compared on
+ * production load. Java entry points are replayed through their C
+ * equivalents. Paths are replayed as recorded unless --license names a
+ * file to use in their place, e.g. on a host without the production
+ * paths. --license also stands in for license data the trace only has
+ * the hash of; without it those calls are skipped.
+ *
+ * replay/ is excluded from the library's managed build in .cproject, since
+ * this has a main(); build it on its own against the library:
+ *
+ *   g++ -std=c++11 -O2 -I.. Nova.Replay.cpp -o nova-replay -L.. -lnova-jni -lpthread
+ *   ./nova-replay production.trace --speed 4
+ */
+
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <cstring>
+#include <cstdlib>
+
+#include "Nova.Abi.h"
+#include "Nova.Trace.h"
+
+using namespace std;
+
+struct Blob
+{
+    unsigned short kind;
+    string bytes;
+};
+
+struct Call
+{
+    nova_trace_record record;
+    unsigned long long latency;
+    long long lateness;
+    int result;
+    bool replayed;
+};
+
+struct Options
+{
+    string trace;
+    string license;
+    double speed;
+    bool asap;
+};
+
+static const char*entry_name(unsigned short entry)
+{
+    switch (entry)
+    {
+        case NOVA_TRACE_PROCESS: return "nova_process";
+        case NOVA_TRACE_PROCESS_DATA: return "nova_process_data";
+        case NOVA_TRACE_JAVA_PROCESS: return "Nova.process";
+        case NOVA_TRACE_JAVA_BUFFER: return "Nova.processBuffer";
+        case NOVA_TRACE_JAVA_BYTES: return "Nova.processBytes";
+    }
+    return "unknown";
+}
+
+/*!
+ * Blobs by source hash and calls by recording thread, each thread's calls
+ * in start order
+ */
+static bool load(const string&file, map<unsigned long long, Blob>&blobs, map<unsigned int, vector<Call> >&threads)
+{
+    ifstream stream(file.c_str(), ios::binary);
+    if (!stream)
+    {
+        cerr << file << ": cannot open" << endl;
+        return false;
+    }
+
+    nova_trace_header header;
+    if (!stream.read((char*)&header, sizeof header)
+        || 0 != memcmp(header.magic, NOVA_TRACE_MAGIC, sizeof header.magic)
+        || NOVA_TRACE_VERSION != header.version
+        || sizeof(nova_trace_record) != header.record_size)
+    {
+        cerr << file << ": not a version " << NOVA_TRACE_VERSION << " trace" << endl;
+        return false;
+    }
+
+    nova_trace_record record;
+    while (stream.read((char*)&record, sizeof record))
+    {
+        if (NOVA_TRACE_BLOB == record.type)
+        {
+            Blob&blob = blobs[record.source];
+            blob.kind = record.entry;
+            blob.bytes.resize(record.length);
+            if (record.length && !stream.read(&blob.bytes[0], record.length))
+            {
+                break;
+            }
+            stream.ignore((8 - record.length % 8) % 8);
+        }
+        else if (NOVA_TRACE_CALL == record.type)
+        {
+            Call call;
+            memset(&call, 0, sizeof call);
+            call.record = record;
+            threads[record.thread].push_back(call);
+        }
+        else
+        {
+            cerr << file << ": unknown record type " << record.type << ", stopped reading" << endl;
+            break;
+        }
+    }
+
+    for (map<unsigned int, vector<Call> >::iterator i = threads.begin(); i != threads.end(); ++i)
+    {
+        sort(i->second.begin(), i->second.end(), [](const Call&a, const Call&b)
+        {
+            return a.record.start < b.record.start;
+        });
+    }
+
+    return true;
+}
+
+/*!
+ * One call through the C ABI; false if its license is not in the trace
+ */
+static bool invoke(const Options&options, const map<unsigned long long, Blob>&blobs, Call&call)
+{
+    const Blob*blob = NULL;
+    if (call.record.source)
+    {
+        map<unsigned long long, Blob>::const_iterator found = blobs.find(call.record.source);
+        if (found != blobs.end())
+        {
+            blob = &found->second;
+        }
+        else if (options.license.empty())
+        {
+            // license data recorded as a hash only
+            return false;
+        }
+    }
+
+    char identity[256];
+    char message[1024];
+    size_t identity_length = sizeof identity;
+    size_t message_length = sizeof message;
+
+    if (NULL == blob && call.record.source)
+    {
+        call.result = nova_process(options.license.data(), options.license.size(), identity, &identity_length, message, &message_length);
+    }
+    else if (blob && NOVA_TRACE_BLOB_DATA == blob->kind)
+    {
+        call.result = nova_process_data(blob->bytes.data(), blob->bytes.size(),
+                                        identity, &identity_length, message, &message_length);
+    }
+    else if (blob)
+    {
+        const string&path = options.license.empty() ? blob->bytes : options.license;
+        call.result = nova_process(path.data(), path.size(), identity, &identity_length, message, &message_length);
+    }
+    else
+    {
+        call.result = nova_process(NULL, 0, identity, &identity_length, message, &message_length);
+    }
+
+    return true;
+}
+
+static void replay_thread(const Options&options, const map<unsigned long long, Blob>&blobs,
+                          vector<Call>&calls, chrono::steady_clock::time_point start)
+{
+    for (size_t i = 0; i < calls.size(); i++)
+    {
+        Call&call = calls[i];
+
+        const chrono::steady_clock::time_point due = start
+            + chrono::nanoseconds((long long)(call.record.start / options.speed));
+        if (!options.asap)
+        {
+            this_thread::sleep_until(due);
+        }
+
+        const chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+        call.replayed = invoke(options, blobs, call);
+        const chrono::steady_clock::time_point end = chrono::steady_clock::now();
+
+        call.latency = chrono::duration_cast<chrono::nanoseconds>(end - begin).count();
+        call.lateness = options.asap ? 0 : chrono::duration_cast<chrono::nanoseconds>(begin - due).count();
+    }
+}
+
+static unsigned long long percentile(const vector<unsigned long long>&sorted, double fraction)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    const size_t index = (size_t)(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+static void print_distribution(const char*label, vector<unsigned long long>&values)
+{
+    sort(values.begin(), values.end());
+
+    cout << "  " << setw(9) << left << label << right
+         << " p50 " << setw(9) << percentile(values, 0.5) / 1000
+         << " p90 " << setw(9) << percentile(values, 0.9) / 1000
+         << " p99 " << setw(9) << percentile(values, 0.99) / 1000
+         << " p99.9 " << setw(9) << percentile(values, 0.999) / 1000
+         << " max " << setw(9) << (values.empty() ? 0 : values.back() / 1000) << " us" << endl;
+}
+
+static void report(const map<unsigned int, vector<Call> >&threads, double seconds)
+{
+    map<unsigned short, vector<unsigned long long> > recorded, replayed;
+    map<unsigned short, size_t> mismatches, skipped;
+    vector<unsigned long long> lateness;
+    size_t total = 0;
+
+    for (map<unsigned int, vector<Call> >::const_iterator i = threads.begin(); i != threads.end(); ++i)
+    {
+        for (size_t j = 0; j < i->second.size(); j++)
+        {
+            const Call&call = i->second[j];
+            const unsigned short entry = call.record.entry;
+
+            recorded[entry].push_back(call.record.duration);
+            if (!call.replayed)
+            {
+                skipped[entry]++;
+                continue;
+            }
+
+            total++;
+            replayed[entry].push_back(call.latency);
+            lateness.push_back(call.lateness > 0 ? (unsigned long long)call.lateness : 0);
+            if (call.result != call.record.result)
+            {
+                mismatches[entry]++;
+            }
+        }
+    }
+
+    cout << total << " calls on " << threads.size() << " threads in " << seconds << " s" << endl;
+
+    for (map<unsigned short, vector<unsigned long long> >::iterator i = recorded.begin(); i != recorded.end(); ++i)
+    {
+        const unsigned short entry = i->first;
+        cout << entry_name(entry) << ": " << i->second.size() << " calls, "
+             << mismatches[entry] << " results differ, " << skipped[entry] << " skipped" << endl;
+        print_distribution("recorded", i->second);
+        print_distribution("replayed", replayed[entry]);
+    }
+
+    cout << "behind schedule:" << endl;
+    print_distribution("start", lateness);
+}
+
+static bool parse(int argc, char**argv, Options&options)
+{
+    options.speed = 1.0;
+    options.asap = false;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const string argument = argv[i];
+        if ("--speed" == argument && i + 1 < argc)
+        {
+            options.speed = atof(argv[++i]);
+        }
+        else if ("--license" == argument && i + 1 < argc)
+        {
+            options.license = argv[++i];
+        }
+        else if ("--asap" == argument)
+        {
+            options.asap = true;
+        }
+        else if (options.trace.empty() && '-' != argument[0])
+        {
+            options.trace = argument;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return !options.trace.empty() && options.speed > 0;
+}
+
+int main(int argc, char**argv)
+{
+    Options options;
+    if (!parse(argc, argv, options))
+    {
+        cerr << "usage: " << argv[0] << " <trace> [--speed <factor> | --asap] [--license <file>]" << endl;
+        return 2;
+    }
+
+    map<unsigned long long, Blob> blobs;
+    map<unsigned int, vector<Call> > threads;
+    if (!load(options.trace, blobs, threads))
+    {
+        return 1;
+    }
+
+    // load the TRA states before the clock starts
+    nova_prewarm();
+
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+    vector<thread> workers;
+    for (map<unsigned int, vector<Call> >::iterator i = threads.begin(); i != threads.end(); ++i)
+    {
+        workers.push_back(thread(replay_thread, cref(options), cref(blobs), ref(i->second), start));
+    }
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i].join();
+    }
+
+    const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    report(threads, seconds);
+
+    return 0;
+}